@@ -0,0 +1,320 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <ctime>
+#include "../single_include/ffmpegcv.hpp"
+
+
+struct Options {
+    std::string workdir = ".";             // where the inputs and encoded outputs go
+    std::string output = "benchmark.json";
+    int repeat = 3;                        // each number is the median of this many runs
+    bool quick = false;                    // skip 4K
+};
+
+struct Input {
+    std::string name;
+    int width;
+    int height;
+    int nframes;
+    std::string path;
+};
+
+struct Timing {
+    double seconds = 0;  // median
+    int frames = 0;      // frames of the median run
+};
+
+
+double now_seconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// Runs fn `repeat` times; fn returns the number of frames it handled.
+Timing median_run(int repeat, const std::function<int()>& fn) {
+    std::vector<std::pair<double, int>> runs;
+    for (int i = 0; i < repeat; ++i) {
+        double t0 = now_seconds();
+        int frames = fn();
+        runs.push_back(std::make_pair(now_seconds() - t0, frames));
+    }
+    std::sort(runs.begin(), runs.end());
+    Timing timing;
+    timing.seconds = runs[runs.size() / 2].first;
+    timing.frames = runs[runs.size() / 2].second;
+    return timing;
+}
+
+
+// Same testsrc clip as examples/prepare_inputVideo.sh, at the input's size and length.
+bool prepare_input(const Input& input) {
+    std::ostringstream cmd;
+    cmd << "ffmpeg -y -loglevel error -f lavfi -i \"testsrc=size=" << input.width << "x" << input.height
+        << ":rate=30\" -frames:v " << input.nframes << " -c:v libx264 -pix_fmt yuv420p \"" << input.path << "\"";
+    return std::system(cmd.str().c_str()) == 0;
+}
+
+
+std::string json_string(const std::string& text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') quoted += '\\';
+        if (c == '\n') continue;
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+
+class JsonRecords {
+public:
+    void add(const std::string& fields) {
+        records.push_back("    {" + fields + "}");
+        std::cerr << fields << std::endl;
+    }
+    std::string str(const std::string& meta) const {
+        std::ostringstream out;
+        out << "{\n  \"meta\": {" << meta << "},\n  \"results\": [\n";
+        for (size_t i = 0; i < records.size(); ++i) {
+            out << records[i] << (i + 1 < records.size() ? ",\n" : "\n");
+        }
+        out << "  ]\n}\n";
+        return out.str();
+    }
+
+private:
+    std::vector<std::string> records;
+};
+
+
+std::string throughput_fields(const Timing& timing, int expected, double bytes_per_frame) {
+    std::ostringstream out;
+    double fps = timing.seconds > 0 ? timing.frames / timing.seconds : 0;
+    out << "\"frames\": " << timing.frames << ", \"expected_frames\": " << expected
+        << ", \"ok\": " << (timing.frames == expected ? "true" : "false")
+        << ", \"seconds\": " << timing.seconds << ", \"fps\": " << fps
+        << ", \"mb_per_s\": " << fps * bytes_per_frame / 1e6;
+    return out.str();
+}
+
+
+// VideoCapture frames/s and MB/s of raw output for each pix_fmt and crop/resize.
+void bench_read(const Input& input, const Options& options, JsonRecords& records) {
+    struct Geometry {
+        std::string name;
+        std::tuple<int, int, int, int> crop_xywh;
+        ffmpegcv::Size_wh resize;
+    };
+    const int w = input.width, h = input.height;
+    std::vector<Geometry> geometries = {
+        {"full", std::make_tuple(0, 0, 0, 0), {0, 0}},
+        {"crop", std::make_tuple(w / 4 / 2 * 2, h / 4 / 2 * 2, w / 2 / 2 * 2, h / 2 / 2 * 2), {0, 0}},
+        {"resize", std::make_tuple(0, 0, 0, 0), {w / 2 / 2 * 2, h / 2 / 2 * 2}},
+        {"crop_resize", std::make_tuple(w / 4 / 2 * 2, h / 4 / 2 * 2, w / 2 / 2 * 2, h / 2 / 2 * 2), {224, 224}},
+    };
+    for (std::string pix_fmt : {"bgr24", "rgb24", "gray", "yuv420p"}) {
+        for (auto& geometry : geometries) {
+            int bytes_per_frame = 0;
+            Timing timing = median_run(options.repeat, [&] {
+                ffmpegcv::VideoCapture cap(input.path, pix_fmt, geometry.crop_xywh, geometry.resize);
+                bytes_per_frame = cap.bytes_per_frame;
+                ffmpegcv::Frame frame;
+                int nframe = 0;
+                while (cap.read(frame)) nframe++;
+                return nframe;
+            });
+            std::ostringstream fields;
+            fields << "\"benchmark\": \"read\", \"input\": " << json_string(input.name)
+                   << ", \"pix_fmt\": " << json_string(pix_fmt) << ", \"geometry\": " << json_string(geometry.name)
+                   << ", " << throughput_fields(timing, input.nframes, bytes_per_frame);
+            records.add(fields.str());
+        }
+    }
+}
+
+
+// Open to first decoded frame: cold (ffprobe runs), with the probe cache warm, and without a probe.
+void bench_first_frame(const Input& input, const Options& options, JsonRecords& records) {
+    std::vector<std::string> modes = {"probe_cold", "probe_cached", "no_probe"};
+    for (auto& mode : modes) {
+        Timing timing = median_run(options.repeat, [&] {
+            if (mode == "probe_cold") ffmpegcv::clear_info_cache();
+            std::shared_ptr<ffmpegcv::VideoCapture> cap;
+            if (mode == "no_probe") cap = std::make_shared<ffmpegcv::VideoCaptureNoProbe>(input.path, "bgr24");
+            else cap = std::make_shared<ffmpegcv::VideoCapture>(input.path, "bgr24");
+            ffmpegcv::Frame frame;
+            return cap->read(frame) ? 1 : 0;
+        });
+        std::ostringstream fields;
+        fields << "\"benchmark\": \"first_frame\", \"input\": " << json_string(input.name)
+               << ", \"mode\": " << json_string(mode) << ", \"ok\": " << (timing.frames == 1 ? "true" : "false")
+               << ", \"seconds\": " << timing.seconds;
+        records.add(fields.str());
+    }
+}
+
+
+// VideoWriter encode frames/s from frames already in memory, and `cap >> writer` transcode.
+void bench_write(const Input& input, const Options& options, JsonRecords& records) {
+    std::vector<ffmpegcv::Frame> frames;
+    {
+        ffmpegcv::VideoCapture cap(input.path, "bgr24");
+        ffmpegcv::Frame frame;
+        while (cap.read(frame)) frames.push_back(frame);
+    }
+    const std::string output = options.workdir + "/bench_output_" + input.name + ".mp4";
+    const double bytes_per_frame = input.width * input.height * 3.0;
+    for (int async_frames : {0, 4}) {
+        Timing timing = median_run(options.repeat, [&] {
+            ffmpegcv::VideoWriter writer(output, "h264", 30, {input.width, input.height});
+            writer.async_frames = async_frames;
+            for (auto& frame : frames) writer.write(frame);
+            writer.release();
+            return (int)frames.size();
+        });
+        std::ostringstream fields;
+        fields << "\"benchmark\": \"write\", \"input\": " << json_string(input.name)
+               << ", \"codec\": \"h264\", \"async_frames\": " << async_frames
+               << ", " << throughput_fields(timing, input.nframes, bytes_per_frame);
+        records.add(fields.str());
+    }
+    frames.clear();
+
+    Timing timing = median_run(options.repeat, [&] {
+        ffmpegcv::VideoCapture cap(input.path, "bgr24");
+        ffmpegcv::VideoWriter writer(output, "h264", cap.fps, {cap.width, cap.height});
+        int nframe = 0;
+        while (cap.isOpened()) {
+            cap >> writer;
+            nframe++;
+        }
+        writer.release();
+        return nframe - 1;  // the last pass only finds the end of the file
+    });
+    std::ostringstream fields;
+    fields << "\"benchmark\": \"transcode\", \"input\": " << json_string(input.name)
+           << ", \"codec\": \"h264\", " << throughput_fields(timing, input.nframes, bytes_per_frame);
+    records.add(fields.str());
+    std::remove(output.c_str());
+}
+
+
+#ifdef FFMPEGCV_USE_LIBAV
+// The in-process libav backend against the ffmpeg pipe, same cases for both: bgr24 decode to EOF,
+// open to first frame (cold, nothing cached), and h264 encode of frames already in memory.
+void bench_backends(const Input& input, const Options& options, JsonRecords& records) {
+    std::vector<ffmpegcv::Frame> frames;
+    {
+        ffmpegcv::VideoCapture cap(input.path, "bgr24");
+        ffmpegcv::Frame frame;
+        while (cap.read(frame)) frames.push_back(frame);
+    }
+    const std::string output = options.workdir + "/bench_output_" + input.name + ".mp4";
+    const double bytes_per_frame = input.width * input.height * 3.0;
+    for (std::string backend : {"pipe", "libav"}) {
+        auto open_capture = [&]() -> std::shared_ptr<ffmpegcv::VideoCapture> {
+            if (backend == "libav") return std::make_shared<ffmpegcv::VideoCaptureLibav>(input.path, "bgr24");
+            return std::make_shared<ffmpegcv::VideoCapture>(input.path, "bgr24");
+        };
+        Timing timing = median_run(options.repeat, [&] {
+            std::shared_ptr<ffmpegcv::VideoCapture> cap = open_capture();
+            ffmpegcv::Frame frame;
+            int nframe = 0;
+            while (cap->read(frame)) nframe++;
+            return nframe;
+        });
+        std::ostringstream fields;
+        fields << "\"benchmark\": \"backend_read\", \"input\": " << json_string(input.name)
+               << ", \"backend\": " << json_string(backend) << ", " << throughput_fields(timing, input.nframes, bytes_per_frame);
+        records.add(fields.str());
+
+        timing = median_run(options.repeat, [&] {
+            ffmpegcv::clear_info_cache();
+            ffmpegcv::Frame frame;
+            return open_capture()->read(frame) ? 1 : 0;
+        });
+        fields.str("");
+        fields << "\"benchmark\": \"backend_first_frame\", \"input\": " << json_string(input.name)
+               << ", \"backend\": " << json_string(backend) << ", \"ok\": " << (timing.frames == 1 ? "true" : "false")
+               << ", \"seconds\": " << timing.seconds;
+        records.add(fields.str());
+
+        timing = median_run(options.repeat, [&] {
+            std::shared_ptr<ffmpegcv::VideoWriter> writer;
+            if (backend == "libav") {
+                writer = std::make_shared<ffmpegcv::VideoWriterLibav>(output, "h264", 30, ffmpegcv::Size_wh(input.width, input.height));
+            } else {
+                writer = std::make_shared<ffmpegcv::VideoWriter>(output, "h264", 30, ffmpegcv::Size_wh(input.width, input.height));
+            }
+            for (auto& frame : frames) writer->write(frame);
+            writer->release();
+            return (int)frames.size();
+        });
+        fields.str("");
+        fields << "\"benchmark\": \"backend_write\", \"input\": " << json_string(input.name)
+               << ", \"backend\": " << json_string(backend) << ", \"codec\": \"h264\", "
+               << throughput_fields(timing, input.nframes, bytes_per_frame);
+        records.add(fields.str());
+    }
+    std::remove(output.c_str());
+}
+#endif
+
+
+std::string meta_fields(const Options& options) {
+    std::string version = ffmpegcv::execute_command("ffmpeg -version");
+    version = version.substr(0, version.find('\n'));
+    char timestamp[32];
+    std::time_t now = std::time(NULL);
+    std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+    std::ostringstream fields;
+    fields << "\"ffmpeg\": " << json_string(version)
+#ifdef __VERSION__
+           << ", \"compiler\": " << json_string(__VERSION__)
+#endif
+           << ", \"hardware_threads\": " << std::thread::hardware_concurrency()
+           << ", \"repeat\": " << options.repeat << ", \"timestamp\": " << json_string(timestamp);
+    return fields.str();
+}
+
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--quick") options.quick = true;
+        else if (arg == "--repeat" && i + 1 < argc) options.repeat = std::max(1, atoi(argv[++i]));
+        else if (arg == "--output" && i + 1 < argc) options.output = argv[++i];
+        else if (arg == "--workdir" && i + 1 < argc) options.workdir = argv[++i];
+        else {
+            std::cerr << "usage: " << argv[0] << " [--quick] [--repeat N] [--output benchmark.json] [--workdir DIR]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<Input> inputs = {{"480p", 640, 480, 300}, {"1080p", 1920, 1080, 150}};
+    if (!options.quick) inputs.push_back({"2160p", 3840, 2160, 60});
+    JsonRecords records;
+    for (auto& input : inputs) {
+        input.path = options.workdir + "/bench_testsrc_" + input.name + ".mp4";
+        if (!prepare_input(input)) {
+            std::cerr << "cannot create " << input.path << std::endl;
+            return 1;
+        }
+        bench_read(input, options, records);
+        bench_first_frame(input, options, records);
+        bench_write(input, options, records);
+#ifdef FFMPEGCV_USE_LIBAV
+        bench_backends(input, options, records);
+#endif
+        std::remove(input.path.c_str());
+    }
+
+    std::ofstream out(options.output);
+    out << records.str(meta_fields(options));
+    std::cerr << "wrote " << options.output << std::endl;
+    return out.good() ? 0 : 1;
+}
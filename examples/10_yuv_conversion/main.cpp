@@ -0,0 +1,53 @@
+#include <iostream>
+#include <chrono>
+#include "../../single_include/ffmpegcv.hpp"
+
+
+// Read the whole video upscaled to `size` as bgr24, return the throughput in frames/s.
+// nthreads < 0: ffmpeg converts to bgr24; otherwise yuv420p is converted here.
+double read_all(ffmpegcv::Size_wh size, int nthreads) {
+    ffmpegcv::VideoCapture cap("../input.mp4", "bgr24", {0, 0, 0, 0}, size);
+    if (nthreads >= 0) cap.set_yuv_conversion(nthreads);
+    ffmpegcv::Frame frame;
+
+    auto t0 = std::chrono::steady_clock::now();
+    int nframe = 0;
+    while (cap.read(frame)) {
+        nframe++;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+    return nframe / elapsed.count();
+}
+
+
+// Convert one frame repeatedly, without decoding, return frames/s.
+double convert_only(ffmpegcv::Size_wh size, int nthreads) {
+    ffmpegcv::YUVConverter converter(size.width, size.height, "bgr24", nthreads);
+    std::vector<uint8_t> yuv(converter.input_size(), 128);
+    std::vector<uint8_t> bgr(converter.output_size());
+    const int repeat = 50;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeat; ++i) {
+        converter.convert(yuv.data(), bgr.data());
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+    return repeat / elapsed.count();
+}
+
+
+int main(int argc, char* argv[]) {
+    std::vector<ffmpegcv::Size_wh> sizes = {{1920, 1080}, {3840, 2160}};
+    for (auto size : sizes) {
+        double fps_ffmpeg = read_all(size, -1);
+        double fps_single = read_all(size, 1);
+        double fps_all = read_all(size, 0);
+        std::cout << size.width << "x" << size.height
+                  << "  ffmpeg bgr24: " << fps_ffmpeg << " fps"
+                  << "  yuv420p + 1 thread: " << fps_single << " fps"
+                  << "  yuv420p + all cores: " << fps_all << " fps" << std::endl;
+        std::cout << size.width << "x" << size.height
+                  << "  conversion alone, 1 thread: " << convert_only(size, 1) << " fps"
+                  << "  all cores: " << convert_only(size, 0) << " fps" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,44 @@
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include "../../single_include/ffmpegcv.hpp"
+
+
+std::vector<std::string> files(16, "../input.mp4");  // stands in for a list of clips
+
+
+// One clip after another, one ffmpeg at a time.
+double read_sequentially() {
+    auto t0 = std::chrono::steady_clock::now();
+    for (auto& file : files) {
+        ffmpegcv::VideoCapture cap(file, "bgr24", {0, 0, 0, 0}, {224, 224});
+        ffmpegcv::Frame frame;
+        while (cap.read(frame)) {
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+    return elapsed.count();
+}
+
+
+// At most one ffmpeg per core, frames tagged with (file, frame index).
+double read_pool() {
+    auto t0 = std::chrono::steady_clock::now();
+    ffmpegcv::CapturePool pool(files, 0, "bgr24", {0, 0, 0, 0}, {224, 224});
+    pool.max_bytes_in_flight = 64 << 20;
+    ffmpegcv::ClipFrame clip_frame;
+    while (pool.read(clip_frame)) {
+        // clip_frame.frame is frame clip_frame.iframe of files[clip_frame.file_index]
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+    return elapsed.count();
+}
+
+
+int main(int argc, char* argv[]) {
+    double t_sequential = read_sequentially();
+    double t_pool = read_pool();
+    std::cout << "VideoCapture, one by one: " << t_sequential << " s" << std::endl;
+    std::cout << "CapturePool, " << std::thread::hardware_concurrency() << " processes: " << t_pool << " s" << std::endl;
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include "../../single_include/ffmpegcv.hpp"
+
+
+// A local live source: ffmpeg sends 320x240 at 30 fps over UDP, paced to the wall clock by the
+// realtime filter (-re would send the first half second at once). The top 40 rows carry the
+// frame number N in 16 black/white blocks, so the receiver knows when each frame was sent.
+const char* sender_cmd =
+    "ffmpeg -loglevel error -f lavfi "
+    "-i \"nullsrc=s=320x240:r=30,geq=lum='if(lt(Y,40),255*mod(floor(N/pow(2,floor(X/20))),2),128)':cb=128:cr=128,realtime\" "
+    "-c:v libx264 -preset ultrafast -tune zerolatency -g 30 -x264-params repeat-headers=1 "
+    "-f h264 \"udp://127.0.0.1:23000?pkt_size=1316\"";
+const char* stream_url = "udp://127.0.0.1:23000";
+const double source_fps = 30;
+
+
+int frame_number(const ffmpegcv::Frame& frame, int width) {
+    int n = 0;
+    for (int bit = 0; bit < 16; ++bit) {
+        const uint8_t* pixel = frame.data() + (20 * width + bit * 20 + 10) * 3;  // block centre, bgr24
+        if (pixel[0] > 128) n |= 1 << bit;
+    }
+    return n;
+}
+
+
+// Reads for `seconds` with a consumer that needs 100 ms per frame, slower than the camera.
+// Glass-to-frame latency of frame N: now - (sender start + N / fps).
+void run(bool latest_only, double seconds) {
+    std::shared_ptr<ffmpegcv::PipeProcess> sender = ffmpegcv::open_pipe_process(sender_cmd, "r");
+    auto t_send = std::chrono::steady_clock::now();
+
+    ffmpegcv::VideoCaptureStreamRT cap(stream_url);
+    cap.latest_only = latest_only;
+    std::vector<double> latency_ms;
+    ffmpegcv::Frame frame;
+    auto t_end = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+    while (std::chrono::steady_clock::now() < t_end && cap.read(frame)) {
+        double now = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_send).count();
+        latency_ms.push_back((now - frame_number(frame, cap.width) / source_fps) * 1e3);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));  // the "model"
+    }
+    sender->terminate();
+    cap.release();
+    sender->close();
+
+    std::vector<double> sorted = latency_ms;
+    std::sort(sorted.begin(), sorted.end());
+    std::cout << (latest_only ? "latest_only" : "in order   ") << "  frames read: " << latency_ms.size()
+              << "  dropped: " << cap.dropped_frames
+              << "  latency median: " << (sorted.empty() ? 0 : sorted[sorted.size() / 2]) << " ms"
+              << "  last: " << (latency_ms.empty() ? 0 : latency_ms.back()) << " ms" << std::endl;
+}
+
+
+int main(int argc, char* argv[]) {
+    run(false, 5);
+    run(true, 5);
+    return 0;
+}
@@ -0,0 +1,58 @@
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include "../../single_include/ffmpegcv.hpp"
+
+
+// A live 1280x720 30 fps source: testsrc2 frames, handed to the writer on the wall clock. The encoder
+// gets one thread ("-threads 1"), an artificial CPU limit that the medium preset cannot keep up with.
+const int width = 1280, height = 720;
+const double fps = 30;
+const double seconds = 30;
+const char* source_cmd =
+    "ffmpeg -loglevel error -f lavfi -i testsrc2=s=1280x720:r=30 -f rawvideo -pix_fmt bgr24 pipe:";
+
+
+// Feeds `seconds` of frames in real time. A writer that cannot keep up makes write() block,
+// and the last frame goes out late.
+double feed(ffmpegcv::VideoWriter& writer) {
+    std::shared_ptr<ffmpegcv::PipeProcess> source = ffmpegcv::open_pipe_process(source_cmd, "r");
+    ffmpegcv::Frame frame = writer.getFramePool().acquire();
+    auto t_start = std::chrono::steady_clock::now();
+    const int nframes = int(seconds * fps);
+    for (int i = 0; i < nframes; ++i) {
+        source->read(frame.data(), frame.size());
+        std::this_thread::sleep_until(t_start + std::chrono::duration<double>(i / fps));
+        writer.write(frame.data());
+    }
+    double late = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count() - seconds;
+    source->terminate();
+    source->close();
+    return late;
+}
+
+
+int main(int argc, char* argv[]) {
+    {
+        ffmpegcv::VideoWriter writer("fixed.mp4", "h264", fps, {width, height}, true, " -preset medium -threads 1");
+        writer.track_progress = true;
+        double late = feed(writer);
+        ffmpegcv::EncoderProgress progress = writer.get_progress();
+        writer.release();
+        std::cout << "fixed medium: speed " << progress.speed << "x, " << progress.fps << " fps, last frame "
+                  << late << " s late" << std::endl;
+    }
+    {
+        ffmpegcv::AdaptiveVideoWriter writer("adaptive.mp4", "h264", fps, {width, height}, "medium", true,
+            " -threads 1");
+        double late = feed(writer);
+        writer.release();
+        std::cout << "adaptive:     last frame " << late << " s late" << std::endl;
+        for (size_t k = 0; k < writer.segments.size(); ++k) {
+            const ffmpegcv::AdaptiveVideoWriter::Segment& segment = writer.segments[k];
+            std::cout << "  segment " << k << ": " << writer.ladder[segment.rung] << ", speed " << segment.speed
+                      << "x, write() blocked " << int(segment.blocked_fraction * 100) << "% of the time" << std::endl;
+        }
+    }
+    return 0;
+}
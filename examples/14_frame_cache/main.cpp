@@ -0,0 +1,25 @@
+#include <iostream>
+#include <chrono>
+#include "../../single_include/ffmpegcv.hpp"
+
+
+int main(int argc, char* argv[]) {
+    ffmpegcv::FrameCache cache("frame_cache", 1LL << 30);  // at most 1 GiB of decoded frames
+    for (int epoch = 0; epoch < 3; epoch++) {
+        auto t0 = std::chrono::steady_clock::now();
+        ffmpegcv::VideoCaptureCached cap("../input.mp4", cache, "rgb24", {0, 0, 0, 0}, {224, 224});
+        int nframes = 0;
+        bool ret = true;
+        void* frame = NULL;
+        while (true) {
+            std::tie(ret, frame) = cap.read();  // from the cache: points into the mapped file
+            if (!ret) break;
+            nframes++;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+        std::cout << "epoch " << epoch << (cap.cached ? " (cached): " : " (decoded): ") << nframes
+                  << " frames, " << nframes / elapsed.count() << " fps" << std::endl;
+    }
+    std::cout << "cache size: " << cache.used_bytes() / (1 << 20) << " MiB" << std::endl;
+    return 0;
+}
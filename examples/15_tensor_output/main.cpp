@@ -0,0 +1,65 @@
+#include <iostream>
+#include <chrono>
+#include "../../single_include/ffmpegcv.hpp"
+
+
+const std::vector<float> MEAN = {0.485f, 0.456f, 0.406f};
+const std::vector<float> STD = {0.229f, 0.224f, 0.225f};
+
+
+// Read bgr24 frames and build the normalized rgb CHW float tensor by hand, return frames/s.
+double read_manual(ffmpegcv::Size_wh size) {
+    ffmpegcv::VideoCapture cap("../input.mp4", "bgr24", {0, 0, 0, 0}, size);
+    std::vector<float> tensor(3 * cap.width * cap.height);
+    ffmpegcv::Frame frame;
+    const int npix = cap.width * cap.height;
+
+    auto t0 = std::chrono::steady_clock::now();
+    int nframe = 0;
+    while (cap.read(frame)) {
+        const uint8_t* bgr = frame.data();
+        for (int c = 0; c < 3; ++c) {
+            float* plane = tensor.data() + c * npix;
+            for (int i = 0; i < npix; ++i) {
+                plane[i] = (bgr[3 * i + 2 - c] / 255.0f - MEAN[c]) / STD[c];
+            }
+        }
+        nframe++;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+    return nframe / elapsed.count();
+}
+
+
+// Read the same tensors straight from VideoCapture in batches, return frames/s.
+double read_tensor(ffmpegcv::Size_wh size, const std::string& pix_fmt) {
+    ffmpegcv::VideoCapture cap("../input.mp4", pix_fmt, {0, 0, 0, 0}, size);
+    cap.set_normalization(MEAN, STD);
+    const int batch_size = 8;
+    std::vector<uint8_t> batch(batch_size * cap.bytes_per_frame);
+
+    auto t0 = std::chrono::steady_clock::now();
+    int nframe = 0, n;
+    while ((n = cap.read_batch(batch.data(), batch_size)) > 0) {
+        nframe += n;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+    return nframe / elapsed.count();
+}
+
+
+int main(int argc, char* argv[]) {
+    ffmpegcv::VideoCapture cap("../input.mp4", "rgb_chw_f16", {0, 0, 0, 0}, {224, 224});
+    std::cout << "shape: [" << cap.outnumpyshape[0] << ", " << cap.outnumpyshape[1] << ", "
+              << cap.outnumpyshape[2] << "]  dtype: " << cap.outdtype << std::endl;
+    cap.release();
+
+    std::vector<ffmpegcv::Size_wh> sizes = {{224, 224}, {1920, 1080}};
+    for (auto size : sizes) {
+        std::cout << size.width << "x" << size.height
+                  << "  bgr24 + manual loop: " << read_manual(size) << " fps"
+                  << "  rgb_chw_f32: " << read_tensor(size, "rgb_chw_f32") << " fps"
+                  << "  rgb_chw_f16: " << read_tensor(size, "rgb_chw_f16") << " fps" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,45 @@
+#include <iostream>
+#include "../../single_include/ffmpegcv.hpp"
+
+
+std::string cpu_list(const std::vector<int>& cpus) {
+    std::string list;
+    for (size_t i = 0; i < cpus.size(); ++i) list += (i ? "," : "") + std::to_string(cpus[i]);
+    return list;
+}
+
+
+int main(int argc, char* argv[]) {
+    const int ncaptures = argc > 1 ? atoi(argv[1]) : 4;
+    ffmpegcv::CpuSchedulerConfig config;
+    config.enabled = true;
+    config.threads = 2;
+    ffmpegcv::set_cpu_scheduler(config);
+    std::vector<int> cpus;
+    ffmpegcv::get_thread_affinity(cpus);
+    std::cout << "scheduler cpus: " << cpu_list(ffmpegcv::get_cpu_scheduler().cpus)
+              << "  main thread: " << cpu_list(cpus) << std::endl;
+
+    // each capture starts its ffmpeg on the first read, on its own cpus
+    std::vector<std::shared_ptr<ffmpegcv::VideoCapture>> captures;
+    for (int i = 0; i < ncaptures; ++i) {
+        captures.push_back(std::make_shared<ffmpegcv::VideoCapture>("../input.mp4"));
+        captures.back()->prefetch_frames = 4;  // the prefetcher thread reads, and is pinned
+        ffmpegcv::Frame frame;
+        captures.back()->read(frame);
+    }
+    for (const ffmpegcv::CpuAssignment& assignment : ffmpegcv::get_cpu_assignments()) {
+        std::cout << assignment.to_json() << std::endl;
+    }
+
+    // read the captures to the end, one after another
+    for (auto& cap : captures) {
+        ffmpegcv::Frame frame;
+        while (cap->read(frame)) {}
+    }
+    captures.clear();
+    ffmpegcv::get_thread_affinity(cpus);
+    std::cout << "released: " << ffmpegcv::get_cpu_assignments().size() << " running"
+              << "  main thread: " << cpu_list(cpus) << std::endl;
+    return 0;
+}
@@ -0,0 +1,35 @@
+#include <iostream>
+#include <chrono>
+#include "../../single_include/ffmpegcv.hpp"
+
+
+// Read the whole video upscaled to `size`, return the throughput in frames/s.
+double read_all(ffmpegcv::Size_wh size, bool use_popen) {
+    ffmpegcv::VideoCapture cap("../input.mp4", "bgr24", {0, 0, 0, 0}, size);
+    cap.use_popen = use_popen;
+    uint8_t* frame = cap.getBuffer();
+
+    auto t0 = std::chrono::steady_clock::now();
+    int nframe = 0;
+    while (cap.read(frame)) {
+        nframe++;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+    cap.release();
+    return nframe / elapsed.count();
+}
+
+
+int main(int argc, char* argv[]) {
+    std::vector<ffmpegcv::Size_wh> sizes = {{640, 480}, {1920, 1080}, {3840, 2160}};
+    for (auto size : sizes) {
+        double fps_popen = read_all(size, true);
+        double fps_spawn = read_all(size, false);
+        double mb_per_frame = size.width * size.height * 3 / 1e6;
+        std::cout << size.width << "x" << size.height
+                  << "  popen: " << fps_popen << " fps (" << fps_popen * mb_per_frame << " MB/s)"
+                  << "  spawn: " << fps_spawn << " fps (" << fps_spawn * mb_per_frame << " MB/s)"
+                  << std::endl;
+    }
+    return 0;
+}
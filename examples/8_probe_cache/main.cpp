@@ -0,0 +1,24 @@
+#include <iostream>
+#include <chrono>
+#include "../../single_include/ffmpegcv.hpp"
+
+
+// Open the same file `n` times, return opens per second.
+double opens_per_second(int n, bool cold) {
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) {
+        if (cold) ffmpegcv::clear_info_cache();
+        ffmpegcv::VideoInfo info = ffmpegcv::get_info("../input.mp4");
+        if (info.width == 0) return 0;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+    return n / elapsed.count();
+}
+
+
+int main(int argc, char* argv[]) {
+    ffmpegcv::set_info_cache_file("probe_cache.txt");  // optional, survives restarts
+    std::cout << "cold: " << opens_per_second(20, true) << " opens/s" << std::endl;
+    std::cout << "warm: " << opens_per_second(20000, false) << " opens/s" << std::endl;
+    return 0;
+}
@@ -0,0 +1,50 @@
+#include <iostream>
+#include <chrono>
+#include "../../single_include/ffmpegcv.hpp"
+
+
+std::vector<ffmpegcv::VideoOutput> outputs = {
+    ffmpegcv::VideoOutput({0, 0, 0, 0}, {320, 240}, "bgr24"),       // downscaled full frame
+    ffmpegcv::VideoOutput({0, 0, 320, 240}, {0, 0}, "bgr24"),       // full-res crop, top left
+    ffmpegcv::VideoOutput({320, 240, 320, 240}, {0, 0}, "gray"),    // full-res crop, bottom right
+};
+
+
+// One ffmpeg for all the views.
+double read_multi() {
+    auto t0 = std::chrono::steady_clock::now();
+    ffmpegcv::VideoCaptureMulti cap("../input.mp4", outputs);
+    std::vector<ffmpegcv::Frame> views;
+    while (cap.read(views)) {
+        // views[0], views[1] and views[2] all come from frame cap.iframe
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+    return elapsed.count();
+}
+
+
+// One ffmpeg per view, each decoding the whole file.
+double read_separately() {
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<std::shared_ptr<ffmpegcv::VideoCapture>> caps;
+    for (auto& output : outputs) {
+        caps.push_back(std::make_shared<ffmpegcv::VideoCapture>(
+            "../input.mp4", output.pix_fmt, output.crop_xywh, output.resize));
+    }
+    ffmpegcv::Frame frame;
+    bool running = true;
+    while (running) {
+        for (auto& cap : caps) running = cap->read(frame) && running;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+    return elapsed.count();
+}
+
+
+int main(int argc, char* argv[]) {
+    double t_separately = read_separately();
+    double t_multi = read_multi();
+    std::cout << "3 VideoCapture: " << t_separately << " s" << std::endl;
+    std::cout << "VideoCaptureMulti: " << t_multi << " s" << std::endl;
+    return 0;
+}
@@ -15,12 +15,103 @@
 
 #include <cstdint>
 #include <utility>
+#include <map>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cerrno>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <cmath>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+#if defined(__AVX2__) || defined(__SSE4_1__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <signal.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sched.h>
+#include <sys/syscall.h>
+extern char** environ;
+#endif
+#ifdef FFMPEGCV_USE_LIBAV
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/imgutils.h>
+#include <libswscale/swscale.h>
+}
+#endif
 
 namespace ffmpegcv {
 
 
 //================ End interface function ===============
 
+//================ Begin CPU scheduler ==================
+
+// Host-wide placement of the ffmpeg processes that captures and writers start. When enabled, each
+// one is launched with -threads/-filter_threads and its own set of cpus, taken from the least loaded
+// slot of a NUMA node. The thread that reads a capture's frames (its prefetcher, or the caller) is
+// pinned to the same cpus while the capture is open, so frame buffers are first touched on that node;
+// its previous mask is restored when the capture stops. The thread that opens a capture or writer
+// keeps its mask, and writer threads are not moved.
+struct CpuSchedulerConfig {
+    bool enabled = false;
+    int threads = 2;            // -threads of each process
+    int filter_threads = 0;     // -filter_threads, 0: same as threads
+    int cpus_per_process = 0;   // size of each cpu set, 0: same as threads
+    bool pin_reader = true;     // pin the thread that reads a capture's frames to its cpus, until it stops
+    bool numa_local = true;     // keep each cpu set within one node
+    std::vector<int> cpus;      // cpus to use, empty: the process's affinity at its first scheduler call
+};
+
+struct CpuAssignment {
+    int id = 0;
+    int pid = -1;               // the ffmpeg process, once started
+    int node = 0;
+    std::vector<int> cpus;
+    int threads = 0;
+    int filter_threads = 0;
+    bool encoder = false;       // a writer's ffmpeg, otherwise a capture's
+    bool pin_thread = false;    // the reading thread stays on cpus while the capture is open
+    std::string command;        // as launched
+
+    std::string to_json() const;
+};
+
+// FFMPEGCV_CPU_THREADS=N in the environment enables the scheduler with N threads per process.
+void set_cpu_scheduler(const CpuSchedulerConfig& config);
+CpuSchedulerConfig get_cpu_scheduler();
+std::vector<CpuAssignment> get_cpu_assignments();  // the processes running now
+// Reserve a cpu set for one ffmpeg process: NULL when the scheduler is off. Released with the last copy.
+std::shared_ptr<CpuAssignment> acquire_cpu_assignment(const std::string& command, bool encoder);
+// Add -filter_threads, and -threads on the decoder (capture) or encoder (writer) side. Options the
+// command already has are kept.
+std::string apply_thread_options(const std::string& command, int threads, int filter_threads, bool encoder);
+// tid 0: the calling thread, otherwise a thread id of this process; false where unsupported
+bool set_thread_affinity(const std::vector<int>& cpus, int tid = 0);
+bool get_thread_affinity(std::vector<int>& cpus);
+
+//================ End CPU scheduler ==================
+
 //================ Begin Video info ==================
 FILE* POPEN_R(const char* command) {
 #ifdef _WIN32
@@ -46,8 +137,56 @@ int PCLOSE(FILE* fp) {
 #endif
 }
 
+// Child process whose stdout ("r") or stdin ("w") is connected to us through a pipe.
+// On Linux the command is split into argv and started with posix_spawnp (no shell),
+// and data moves with raw read()/write() on a pipe enlarged to pipe_size bytes.
+// Elsewhere, with use_popen, or when the command needs a shell, it uses popen + stdio.
+// capture_stderr (spawn transport only) gives the child's stderr its own pipe.
+// extra_outputs (spawn transport only) connects fds 3, 4, ... of a reading child as
+// outputs 1, 2, ... next to stdout (output 0), e.g. for ffmpeg's pipe:3.
+class PipeProcess {
+public:
+    PipeProcess() {}
+    ~PipeProcess();
+    bool open(const std::string& command, const char* mode, int pipe_size = 0, bool use_popen = false,
+        bool capture_stderr = false, int extra_outputs = 0);
+    size_t read(void* buffer, size_t nbytes, int output = 0);  // loops until nbytes or EOF
+    size_t write(const void* buffer, size_t nbytes);
+    void flush();
+    int close();
+    void terminate();  // kill the child, every output then reaches EOF
+    void set_pipe_size(int pipe_size);
+    bool read_stderr_line(std::string& line);  // false at EOF
+    // Hand every further stderr line to `handler` on a background thread, until the child exits.
+    void forward_stderr(std::function<void(const std::string&)> handler);
+    int child_pid() const { return pid; }  // -1 with popen
+
+    std::shared_ptr<CpuAssignment> cpu_assignment;  // from the CPU scheduler, released on close()
+
+private:
+    void pin_reader();  // the first thread that reads moves to cpu_assignment's cpus until close()
+
+    FILE* stream = NULL;
+    int fd = -1;
+    int err_fd = -1;
+    std::vector<int> extra_fds;
+    int pid = -1;
+    std::string err_buffer;
+    std::thread err_thread;
+    int pinned_tid = 0;
+    std::vector<int> unpinned_cpus;  // the pinned thread's mask before, restored on close()
+};
+
+std::shared_ptr<PipeProcess> open_pipe_process(const std::string& command, const char* mode,
+    int pipe_size = 0, bool use_popen = false, bool capture_stderr = false, int extra_outputs = 0);
+bool split_command(const std::string& command, std::vector<std::string>& args, bool& merge_stderr);
+int get_pipe_max_size();
+
 std::string get_file_extension(const std::string& filename);
 std::string execute_command(const std::string& command);
+// "-fps_mode passthrough" (ffmpeg >= 5.1) or "-vsync passthrough": output the frames a select
+// filter or -skip_frame leaves, without duplicating them back to a constant rate.
+std::string get_passthrough_opt();
 
 struct VideoInfo {
     std::string codec;
@@ -61,8 +200,371 @@ struct VideoInfo {
 
 VideoInfo get_info(const std::string& filename);
 
+// get_info() results are kept in memory, keyed by path, size and mtime, so reopening an
+// unchanged file skips ffprobe. Set a cache file (or FFMPEGCV_INFO_CACHE) to keep them across runs.
+void set_info_cache_file(const std::string& cache_file);
+void clear_info_cache();
+std::string json_field(const std::string& json, const std::string& key);
+
+// Presentation timestamps of every video packet and which frames are keyframes,
+// from `ffprobe -show_packets`. Frame i is the i-th smallest timestamp.
+struct KeyframeIndex {
+    std::vector<double> pts;      // seconds, ascending
+    std::vector<int> keyframes;   // frame indices, ascending
+    double start_time = 0;        // container start time, the origin of -ss
+
+    int keyframe_before(int iframe) const;
+    int frame_at(double seconds) const;
+    double seek_time(int keyframe) const;
+};
+
+// Built once per file and shared by every capture of it (rebuilt if the file changes).
+std::shared_ptr<const KeyframeIndex> get_keyframe_index(const std::string& filename);
+bool file_signature(const std::string& filename, long long& size, long long& mtime);
+
 //================ End Video info ==================
 
+//================ Begin Frame pool ==================
+
+// Reference-counted handle to a pooled frame buffer. Copies share the memory,
+// which goes back to its FramePool when the last copy is dropped.
+class Frame {
+public:
+    Frame() {}
+    uint8_t* data() const { return buffer.get(); }
+    size_t size() const { return nbytes; }
+    bool empty() const { return !buffer; }
+    long use_count() const { return buffer.use_count(); }
+    explicit operator bool() const { return !empty(); }
+
+private:
+    friend class FramePool;
+    std::shared_ptr<uint8_t> buffer;
+    size_t nbytes = 0;
+};
+
+// Recycles fixed-size, 64-byte aligned frame buffers (optionally backed by
+// transparent hugepages on Linux). Grows to the number of frames in flight.
+class FramePool {
+public:
+    FramePool(size_t bytes_per_frame = 0, bool hugepage = false);
+    Frame acquire();
+    void reserve(size_t nframes);
+    size_t bytes_per_frame() const;
+    size_t allocated() const;
+
+private:
+    struct State {
+        std::mutex mutex;
+        std::vector<uint8_t*> free_slots;
+        size_t bytes_per_frame = 0;
+        size_t slot_bytes = 0;
+        size_t allocated = 0;
+        bool hugepage = false;
+        uint8_t* allocate();
+        ~State();
+    };
+    std::shared_ptr<State> state;
+};
+
+//================ End Frame pool ==================
+
+//================ Begin I/O stats ==================
+
+// Latency histogram with four log-spaced buckets per power of two nanoseconds (about
+// +-6%). The buckets are a fixed array, so add() never allocates.
+struct LatencyHistogram {
+    static const int nbuckets = 4 * 48;
+    uint32_t buckets[nbuckets] = {};
+    uint64_t samples = 0;
+
+    void add(int64_t nanoseconds);
+    double percentile(double p) const;  // seconds, p in [0, 100]
+};
+
+// Where the time of a capture or writer goes. Cheap enough to leave on: two clock reads
+// per frame and no allocation. Updated by the thread that reads/writes, without locking;
+// take snapshots from that thread.
+struct IOStats {
+    typedef std::chrono::steady_clock Clock;
+
+    double probe_seconds = 0;        // ffprobe, or the stream header for VideoCaptureNoProbe
+    double spawn_seconds = 0;        // starting ffmpeg, summed over restarts
+    int spawns = 0;
+    double first_frame_seconds = 0;  // from opening to the first frame read or written
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    double blocked_seconds = 0;      // waiting in pipe reads (capture) or writes (writer)
+    LatencyHistogram blocked;        // the same, per frame
+    double fps = 0;                  // recent frame rate, smoothed over about 8 frames
+
+    Clock::time_point open_time = Clock::now();
+    Clock::time_point last_frame_time;
+    double frame_interval = 0;
+
+    void add_frames(int n, size_t bytes_per_frame, Clock::time_point start, Clock::time_point end);
+    void reset_counters();  // frames, bytes, blocked time and fps; keeps the open costs
+    double blocked_p50() const;
+    double blocked_p99() const;
+    std::string to_json() const;
+};
+
+double seconds_since(IOStats::Clock::time_point start);
+
+// Appends {"<kind>": filename, ...stats} as one line to stats_file ("-": stderr). An
+// empty stats_file means $FFMPEGCV_STATS, and nothing is written if that is unset too.
+void dump_stats(const std::string& stats_file, const std::string& kind, const std::string& filename,
+    const IOStats& stats);
+
+//================ End I/O stats ==================
+
+//================ Begin Color conversion ==================
+
+enum ColorMatrix {
+    COLOR_BT601 = 0,
+    COLOR_BT709 = 1
+};
+
+enum ColorRange {
+    COLOR_RANGE_LIMITED = 0,  // Y in [16, 235], as most video is coded
+    COLOR_RANGE_FULL = 1      // Y in [0, 255], e.g. yuvj420p
+};
+
+// Fixed set of worker threads. run() splits a job into bands and also works on it
+// from the calling thread; it returns when every band is done.
+class ThreadPool {
+public:
+    explicit ThreadPool(int nthreads = 0);  // 0: one per core
+    ~ThreadPool();
+    void run(int nbands, const std::function<void(int)>& fn);
+    int size() const;
+
+private:
+    void work();
+
+    std::vector<std::thread> workers;
+    std::mutex run_mutex;  // one job at a time
+    std::mutex mutex;
+    std::condition_variable start;
+    std::condition_variable done;
+    const std::function<void(int)>* job = NULL;
+    int nbands = 0;
+    int next_band = 0;
+    int unfinished = 0;
+    bool stopping = false;
+};
+
+// yuv420p -> RGB in 6-bit fixed point, coefficients scaled by 64.
+struct YUVCoefficients {
+    int16_t y_offset = 16;
+    int16_t y = 75;
+    int16_t vr = 102;
+    int16_t ug = 25;
+    int16_t vg = 52;
+    int16_t ub = 129;
+};
+
+YUVCoefficients get_yuv_coefficients(int matrix, int range);
+void yuv420p_to_rgb_rows(const uint8_t* yuv, uint8_t* dst, int width, int height,
+    int row_begin, int row_end, const YUVCoefficients& coef, bool bgr);
+
+// Turns the frames ffmpeg sends (input_pix_fmt) into the frames read() returns, in this process.
+class FrameConverter {
+public:
+    virtual ~FrameConverter() {}
+    virtual void convert(const uint8_t* src, uint8_t* dst) = 0;
+    virtual size_t input_size() const = 0;   // bytes of one input frame
+    virtual size_t output_size() const = 0;  // bytes of one output frame
+    virtual std::string input_pix_fmt() const = 0;
+};
+
+// Converts yuv420p frames to bgr24, rgb24 or gray inside the process, in row bands
+// spread over a thread pool. The row kernels use AVX2, SSE4.1 or NEON when the
+// compiler targets them (e.g. -march=native, ARM64) and scalar code otherwise.
+class YUVConverter: public FrameConverter {
+public:
+    YUVConverter(int width, int height, const std::string& pix_fmt, int nthreads = 0,
+        int matrix = COLOR_BT601, int range = COLOR_RANGE_LIMITED);
+    void convert(const uint8_t* yuv, uint8_t* dst) override;
+    size_t input_size() const override;   // bytes of one yuv420p frame
+    size_t output_size() const override;  // bytes of one pix_fmt frame
+    std::string input_pix_fmt() const override;
+    static bool supports(const std::string& pix_fmt);
+
+    int width;
+    int height;
+    std::string pix_fmt;
+
+private:
+    YUVCoefficients coef;
+    std::shared_ptr<ThreadPool> pool;
+};
+
+uint16_t float_to_half(float value);  // IEEE binary16, round to nearest even
+void rgb24_to_planar_rows(const uint8_t* src, uint8_t* dst, int width, int height, int row_begin, int row_end,
+    const float scale[3], const float offset[3], bool bgr, bool half);
+
+// Tensor pix_fmts for inference: "rgb_chw_f32", "bgr_chw_f32", "rgb_chw_f16" and "bgr_chw_f16".
+// ffmpeg sends rgb24 and one pass per frame reorders the channels, transposes HWC to CHW, converts
+// to float32 or float16 and normalizes: out = (in * scale - mean) / std, per output channel.
+// The kernels use AVX2 (F16C for float16), SSE4.1 or NEON where the compiler targets them.
+class TensorConverter: public FrameConverter {
+public:
+    TensorConverter(int width, int height, const std::string& pix_fmt,
+        const std::vector<float>& mean = {0, 0, 0}, const std::vector<float>& stddev = {1, 1, 1},
+        float scale = 1.0f / 255);
+    void convert(const uint8_t* rgb, uint8_t* dst) override;
+    size_t input_size() const override;   // bytes of one rgb24 frame
+    size_t output_size() const override;  // bytes of one [3, H, W] tensor
+    std::string input_pix_fmt() const override;
+    static bool supports(const std::string& pix_fmt);
+    // 1 or 3 values each, and every stddev finite and non-zero
+    static bool valid_normalization(const std::vector<float>& mean, const std::vector<float>& stddev);
+
+    int width;
+    int height;
+    std::string pix_fmt;
+
+private:
+    float scale[3];
+    float offset[3];
+};
+
+//================ End Color conversion ==================
+
+//================ Begin Frame queue ==================
+
+// Blocking FIFO with a fixed capacity, shared by a producer and a consumer thread.
+// close() wakes both sides; pop() still drains the remaining items after close.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity = 1) : capacity(capacity) {}
+
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return closed || items.size() < capacity; });
+        if (closed) return false;
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    bool try_push(T item) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (closed || items.size() >= capacity) return false;
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Never blocks: when full, the oldest item is discarded to make room.
+    bool push_drop_oldest(T item, bool& dropped) {
+        std::lock_guard<std::mutex> lock(mutex);
+        dropped = false;
+        if (closed) return false;
+        if (items.size() >= capacity) {
+            items.pop_front();
+            dropped = true;
+        }
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty()) return false;
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_full.notify_all();
+        not_empty.notify_all();
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return items.size();
+    }
+
+private:
+    size_t capacity;
+    bool closed = false;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+};
+
+// Reader thread that drains a decoder pipe into up to N pooled frames ahead of the consumer.
+// With a converter the pipe carries its input_pix_fmt, converted on this thread into the pool frames.
+// With latest_only it never waits for the consumer and keeps only the newest frame (triple
+// buffered: one being read, one waiting, one with the consumer). The frames it overwrites unread
+// are counted in skipped.
+class FramePrefetcher {
+public:
+    FramePrefetcher(PipeProcess* process, FramePool pool, int nframes, int output = 0,
+        std::shared_ptr<FrameConverter> converter = nullptr, bool latest_only = false);
+    ~FramePrefetcher();
+    bool next(Frame& frame);  // false at EOF
+    void stop();
+    long long skipped = 0;    // updated by next()
+
+private:
+    void run();
+
+    PipeProcess* process;
+    FramePool pool;
+    int output;
+    std::shared_ptr<FrameConverter> converter;
+    BoundedQueue<Frame> ready_frames;
+    bool latest_only;
+    std::mutex latest_mutex;
+    std::condition_variable latest_ready;
+    Frame latest;
+    long long latest_index = -1;
+    long long taken_index = -1;
+    bool finished = false;
+    std::thread worker;
+};
+
+enum WriterBackpressure {
+    WRITE_BLOCK = 0,        // wait for room in the queue
+    WRITE_DROP_OLDEST = 1,  // discard the oldest queued frame
+    WRITE_FAIL = 2          // reject the new frame, write() returns false
+};
+
+// Writer thread that feeds queued frames into an encoder pipe.
+class FrameFeeder {
+public:
+    FrameFeeder(PipeProcess* process, int nframes);
+    ~FrameFeeder();
+    bool push(const Frame& frame, int backpressure);
+    void flush();  // wait until every accepted frame has reached the pipe
+    void stop();
+    int dropped = 0;
+
+private:
+    void run();
+
+    PipeProcess* process;
+    BoundedQueue<Frame> queue;
+    std::mutex mutex;
+    std::condition_variable drained;
+    size_t pending = 0;
+    bool failed = false;
+    std::thread worker;
+};
+
+//================ End Frame queue ==================
+
 //================ Begin Video Writer ==================
 
 struct Size_wh {
@@ -82,6 +584,33 @@ struct Size_wh {
 };
 
 std::vector<int> get_outnumpyshape(Size_wh size_wh, std::string pix_fmt);
+std::string get_outdtype(const std::string& pix_fmt);  // "uint8", "float32" or "float16"
+int get_dtype_bytes(const std::string& dtype);
+
+// One report of ffmpeg -progress. speed is ffmpeg's own figure, media seconds encoded per wall second
+// since the encoder started; recent_speed is the same since its first report, so without the startup.
+struct EncoderProgress {
+    long long frames = 0;
+    double fps = 0;
+    double speed = 0;
+    double recent_speed = 0;
+    double out_seconds = 0;
+    bool ended = false;  // progress=end, the encoder is done
+};
+
+// Collects the key=value blocks of -progress from the encoder's stderr, other lines go to std::cerr.
+class ProgressTracker {
+public:
+    void parse_line(const std::string& line);
+    EncoderProgress get() const;
+
+private:
+    mutable std::mutex mutex;
+    EncoderProgress latest;
+    EncoderProgress block;
+    double first_out_seconds = -1;
+    std::chrono::steady_clock::time_point first_report;
+};
 
 class VideoWriter {
 public:
@@ -92,13 +621,23 @@ public:
         std::string ffmpeg_output_opt = "");
     ~VideoWriter();
     virtual void initializer();
-    void release();
+    virtual void release();
     void close();
-    bool write(const void* frame);
+    void flush();
+    virtual bool write(const void* frame);
+    virtual bool write(const Frame& frame);
 #ifdef OPENCV_CORE_TYPES_HPP
     bool write(cv::Mat& frame);
 #endif
-    bool isOpened() const;
+    virtual bool isOpened() const;
+    FramePool& getFramePool();
+    IOStats get_stats() const;  // snapshot, from the writing thread
+    void reset_stats();
+    EncoderProgress get_progress() const;  // latest report, needs track_progress
+
+protected:
+    std::string compose_cmd(const std::string& output, const std::string& extra_opt = "");
+    void open_process();
 
 public:
     std::string filename = "";
@@ -111,19 +650,212 @@ public:
     std::string output_pix_fmt = "yuv420p";
     std::string ffmpeg_output_opt = "";
     bool waitInit = true;
-    FILE* process;
+    std::shared_ptr<PipeProcess> process;
+    int pipe_size = 0;        // 0: one frame, capped by /proc/sys/fs/pipe-max-size
+    bool use_popen = false;   // force the popen/stdio transport
+    int async_frames = 0;     // >0: queue up to N frames for a writer thread, set before the first write
+    int backpressure = WRITE_BLOCK;  // what write() does when the queue is full
+    int dropped_frames = 0;   // frames discarded by WRITE_DROP_OLDEST / WRITE_FAIL
+    std::shared_ptr<FrameFeeder> feeder;
+    FramePool frame_pool;
     std::vector<int> innumpyshape;
     int bytes_per_frame;
     std::string ffmpeg_cmd = "";
+    IOStats io_stats;
+    std::string stats_file = "";  // release() appends io_stats as JSON here, see dump_stats()
+    bool track_progress = false;  // read -progress from the encoder's stderr (spawn transport), set before the first write
+    std::shared_ptr<ProgressTracker> progress;
+};
+
+// Writers that encode in pieces put them next to the output as filename.partNNNNN.ext, then join
+// them with the concat demuxer and -c copy.
+std::string segment_path(const std::string& filename, int index);
+bool concat_segments(const std::string& filename, int nsegments);
+// The concat demuxer's list of the paths' file names, which it resolves relative to the list.
+bool write_concat_list(const std::string& list_path, const std::vector<std::string>& paths);
+
+// Encodes in chunks of chunk_frames frames, nencoders chunks at a time, each in its own ffmpeg
+// writing a temporary segment next to filename. Every chunk starts with a keyframe. release()
+// waits for the encoders and joins the segments losslessly with the concat demuxer (-c copy).
+// write() blocks while chunks_in_flight chunks are filling or encoding, which bounds memory at
+// chunks_in_flight * chunk_frames frames. The settings left at 0 are derived from max_buffered_bytes.
+// A Frame passed to write() is kept by reference.
+class ParallelVideoWriter: public VideoWriter {
+public:
+    ParallelVideoWriter();
+    ParallelVideoWriter(const std::string& filename, const std::string& codec, double fps, Size_wh size_wh,
+        int nencoders, int isColor = true, std::string ffmpeg_output_opt = "");
+    ParallelVideoWriter(const std::string& filename, const std::string& codec, double fps, Size_wh size_wh,
+        int nencoders, std::string pix_fmt, std::string ffmpeg_output_opt = "");
+    ~ParallelVideoWriter();
+    void initializer() override;
+    void release() override;
+    bool write(const void* frame) override;
+    bool write(const Frame& frame) override;
+    bool isOpened() const override;
+
+protected:
+    struct Chunk {
+        int index = 0;
+        std::vector<Frame> frames;
+    };
+    void start_encoders();
+    void encode_chunks();
+    bool encode_chunk(const Chunk& chunk);
+
+public:
+    // Raw frames held at once: chunks_in_flight * chunk_frames * bytes_per_frame. The defaults keep it
+    // within max_buffered_bytes, or two chunks of one second when the budget is smaller than that;
+    // values set before the first write are used as they are.
+    long long max_buffered_bytes = 1LL << 30;
+    int nencoders = 0;         // 0: one per core, at most chunks_in_flight
+    int chunk_frames = 0;      // 0: 10 seconds of frames, down to 1 second to fit the budget
+    int chunks_in_flight = 0;  // 0: nencoders + 1 (one filling while the others encode), as many as fit the budget
+    bool failed = false;       // an encoder or the concat step failed
+
+private:
+    std::shared_ptr<BoundedQueue<std::shared_ptr<Chunk>>> chunks;
+    std::shared_ptr<Chunk> filling;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable chunk_done;
+    int in_flight = 0;
+    int nchunks = 0;
+    bool released = false;
+};
+
+// Live encoding that keeps up with real time. The stream is cut every segment_frames frames, and at each
+// cut the encoder restarts one rung faster on `ladder` when the last segment fell behind (recent encoder
+// speed below min_speed while write() waited on it), or one rung slower once it has headroom again.
+// Needs the spawn transport for -progress. A file output is joined from its segments on release(),
+// a network output is published again at each cut.
+class AdaptiveVideoWriter: public VideoWriter {
+public:
+    AdaptiveVideoWriter();
+    AdaptiveVideoWriter(const std::string& filename, const std::string& codec, double fps, Size_wh size_wh,
+        const std::string& preset = "medium", int isColor = true, std::string ffmpeg_output_opt = "");
+    ~AdaptiveVideoWriter();
+    void initializer() override;
+    void release() override;
+    bool write(const void* frame) override;
+    bool write(const Frame& frame) override;
+
+    struct Segment {
+        int rung = 0;
+        long long frames = 0;
+        double speed = 0;             // recent_speed of its encoder at the cut
+        double blocked_fraction = 0;  // share of the segment's wall time spent in write()
+    };
+
+protected:
+    bool begin_frame();  // opens the first segment, or cuts to the next one when this one is full
+    void start_segment();
+    void finish_segment();  // records it and picks the rung of the next one
+    void join_closing();    // waits for the previous segment's encoder, failed if it did not exit cleanly
+
+public:
+    std::vector<std::string> ladder;  // encoder options, fastest first; default: x264/x265 presets up to `preset`
+    int rung = 0;                     // current rung, starts at the top of the ladder
+    int segment_frames = 0;           // 0: 5 seconds of frames
+    double min_speed = 1.0;           // below this with write() blocked most of the time: one rung faster
+    double max_speed = 1.5;           // above this: one rung slower
+    double idle_fraction = 0.1;       // write() blocked less than this share of the time: one rung slower
+    int cooldown_segments = 3;        // segments to wait after stepping down before stepping up
+    std::vector<Segment> segments;    // the finished ones
+    bool failed = false;
 
+private:
+    bool is_file = true;
+    bool released = false;
+    int cooldown = 0;
+    long long segment_written = 0;
+    double segment_blocked = 0;
+    IOStats::Clock::time_point segment_start;
+    std::thread closing;  // the previous segment's encoder draining, for file outputs
+    int closing_status = 0;  // its exit status, read only after closing.join()
 };
 
 //================End Video Writer==================
 
+//================ Begin Stream copy ==================
+
+// Rewraps the video and audio streams of input in output's container (-c copy), no decoding.
+bool remux(const std::string& input, const std::string& output);
+
+// Cuts [start_seconds, end_seconds) out of input without decoding it (end_seconds <= 0: to the end).
+// By default whole GOPs are copied: the output starts at the keyframe at or before start_seconds and
+// ends before the first keyframe at or after end_seconds. With accurate = true it holds exactly the
+// frames in the range: only the partial GOPs at both cuts are re-encoded (same codec, plus
+// reencode_opt, e.g. "-crf 18"), and the GOPs in between are copied. Audio is copied for the range.
+bool trim(const std::string& input, const std::string& output, double start_seconds, double end_seconds = 0,
+    bool accurate = false, const std::string& reencode_opt = "");
+
+std::string codec_to_encoder(const std::string& codec);
+
+//================ End Stream copy ==================
+
+//================ Begin Image resize ==================
+
+enum InterpolationFlags {
+    INTER_LINEAR = 1,  // bilinear, as OpenCV's
+    INTER_AREA = 3     // pixel-area average for shrinking, bilinear for enlarging
+};
+
+// Where plane k of a pix_fmt frame lives: yuv420p has Y, U, V; nv12 has Y and interleaved UV.
+struct PlaneLayout {
+    size_t offset;
+    int width;
+    int height;
+    int channels;
+    int subsample;  // 2 for the chroma planes of yuv420p/nv12
+};
+
+std::vector<PlaneLayout> get_plane_layout(Size_wh size_wh, const std::string& pix_fmt);
+
+// One output of crop_resize: the region crop_xywh ({0, 0, 0, 0}: whole frame) scaled
+// to size (empty: the crop size) and written to dst, laid out as the source pix_fmt.
+struct ResizeTarget {
+    std::tuple<int, int, int, int> crop_xywh;
+    Size_wh size;
+    uint8_t* dst;
+
+    ResizeTarget(std::tuple<int, int, int, int> crop_xywh, Size_wh size, uint8_t* dst):
+        crop_xywh(crop_xywh), size(size), dst(dst) {}
+};
+
+// Crop and resize frames already read, in any VideoCapture pix_fmt, e.g. to follow a
+// moving ROI or build a pyramid without restarting ffmpeg. Several targets are done in
+// one call, their row bands spread over `pool` if given. yuv420p/yuvj420p/nv12 need even
+// crops and sizes. The vertical passes use AVX2, SSE2 or NEON.
+void crop_resize(const uint8_t* src, Size_wh src_size, const std::string& pix_fmt,
+    const std::vector<ResizeTarget>& targets, int interpolation = INTER_LINEAR, ThreadPool* pool = NULL);
+void crop_resize(const uint8_t* src, Size_wh src_size, const std::string& pix_fmt,
+    std::tuple<int, int, int, int> crop_xywh, uint8_t* dst, Size_wh dst_size = Size_wh(0,0),
+    int interpolation = INTER_LINEAR, ThreadPool* pool = NULL);
+
+// One plane: src points at the top-left of the region, src_stride is in bytes.
+void resize_plane(const uint8_t* src, int src_stride, Size_wh src_size, int channels,
+    uint8_t* dst, Size_wh dst_size, int interpolation, int row_begin, int row_end);
+void resize_plane_linear(const uint8_t* src, int src_stride, Size_wh src_size, int channels,
+    uint8_t* dst, Size_wh dst_size, int row_begin, int row_end);
+void resize_plane_area(const uint8_t* src, int src_stride, Size_wh src_size, int channels,
+    uint8_t* dst, Size_wh dst_size, int row_begin, int row_end);
+
+//================ End Image resize ==================
+
 //================Begin Video Reader==================
 std::tuple<Size_wh, Size_wh, std::string> get_videofilter_cpu(
     Size_wh originsize, std::string pix_fmt, std::tuple<int, int, int, int> crop_xywh, Size_wh resize);
 
+enum VideoCaptureProperties {
+    CAP_PROP_POS_MSEC = 0,
+    CAP_PROP_POS_FRAMES = 1,
+    CAP_PROP_FRAME_WIDTH = 3,
+    CAP_PROP_FRAME_HEIGHT = 4,
+    CAP_PROP_FPS = 5,
+    CAP_PROP_FRAME_COUNT = 7
+};
+
 class VideoCapture {
 public:
     VideoCapture();
@@ -138,21 +870,70 @@ public:
     virtual void release();
     void close();
     uint8_t* getBuffer();
+    FramePool& getFramePool();
     virtual bool read(void * frame);
     virtual std::tuple<bool, void *> read();
+    virtual bool read(Frame& frame);
 #ifdef OPENCV_CORE_TYPES_HPP
     virtual bool read(cv::Mat& frame);
 #endif
-    bool isOpened();
+    // Read up to n frames into one contiguous [n, H, W, C] buffer, each frame shaped as
+    // outnumpyshape. Returns the number of frames read, less than n only at the end.
+    virtual int read_batch(void* dst, int n);
+    int read_batch(Frame& batch, int n);  // batch comes from a pool of n-frame buffers
+    virtual bool isOpened();
     const int size();
     const int len();
+    virtual bool seek(int frame_index);
+    bool seek_time(double seconds);
+    bool set(int propId, double value);
+    double get(int propId);
+    // Return only every n-th frame, about target_fps frames per second, or only keyframes
+    // (skipped by the decoder, can be combined with the other two). Frames are dropped
+    // before cropping, scaling and color conversion. count, fps and iframe then count
+    // returned frames, source_iframe the source video frames.
+    virtual bool set_subsample(int every_nth_frame, float target_fps = 0, bool keyframes_only = false);
+    // Read only source frames [start_frame, end_frame) (end_frame 0: to the end), or the frames
+    // shown in [start_time, end_time) seconds. ffmpeg seeks to the keyframe before the window and
+    // drops the frames up to it, and stops after the last one. count, duration, iframe and seek()
+    // are then relative to the window; subsampling applies within it.
+    virtual bool set_range(int start_frame, int end_frame = 0);
+    bool set_time_range(double start_time, double end_time = 0);
+    // Pull yuv420p over the pipe and convert to bgr24/rgb24 in this process on nthreads
+    // threads (0: one per core), instead of in ffmpeg. nthreads < 0 switches back.
+    virtual bool set_yuv_conversion(int nthreads, int matrix = COLOR_BT601, int range = COLOR_RANGE_LIMITED);
+    // For a tensor pix_fmt ("rgb_chw_f32", ...): out = (in * scale - mean) / stddev per output channel,
+    // e.g. mean {0.485, 0.456, 0.406} and stddev {0.229, 0.224, 0.225}. Set before the first read.
+    // Returns false for other pix_fmts, sizes other than 1 or 3, and a zero or non-finite stddev.
+    virtual bool set_normalization(const std::vector<float>& mean, const std::vector<float>& stddev,
+        float scale = 1.0f / 255);
+    int source_frame(int iframe) const;         // source index of returned frame iframe
+    int output_frame(int source_iframe) const;  // first returned frame at or after a source frame
+    IOStats get_stats() const;                  // snapshot, from the reading thread
+    void reset_stats();
+
+protected:
+    virtual std::string compose_cmd();
+    virtual void open_process();
+    int stop_process();  // exit status of ffmpeg, 0 if none was running
+    virtual bool next_prefetched(Frame& frame);
+    void window_frames(int& decoded_count, float& decoded_fps) const;  // decoded by the window
+    std::string window_seek_opt() const;  // accurate seek to the first frame of the window
+    void restart_window();
 
 public:
     std::string filename = "";
     std::string pix_fmt = "bgr24";
     std::tuple<int, int, int, int> crop_xywh = {0, 0, 0, 0};
     Size_wh resize = Size_wh(0, 0);
-    FILE* process = NULL;
+    std::shared_ptr<PipeProcess> process;
+    int pipe_size = 0;        // 0: one frame, capped by /proc/sys/fs/pipe-max-size
+    bool use_popen = false;   // force the popen/stdio transport
+    int prefetch_frames = 0;  // >0: decode ahead into a ring of N frames, set before the first read
+    std::shared_ptr<FramePrefetcher> prefetcher;
+    FramePool frame_pool;
+    FramePool batch_pool;
+    Frame held_frame;
     int bytes_per_frame = 0;
     int width = 0;
     int height = 0;
@@ -160,6 +941,7 @@ public:
     int origin_height = 0;
     int count = 0;
     int iframe = -1;
+    int dropped_frames = 0;      // frames a latest-only reader skipped, iframe counts them
     float fps = 0;
     float duration = 0;
     bool waitInit = true;
@@ -167,7 +949,25 @@ public:
     std::string codec = "";
     Size_wh size_wh = Size_wh(0, 0);
     std::vector<int> outnumpyshape;
+    std::string outdtype = "uint8";  // element type of outnumpyshape
     std::string ffmpeg_cmd = "";
+    std::string filterstr = "";
+    std::string seek_opt = "";   // input-side seek options before -i, set by seek()
+    std::string loglevel_opt = "-loglevel warning";
+    int source_iframe = -1;      // index in the source video of the last frame read
+    double frame_step = 1;       // decoded frames per returned frame, set by set_subsample()
+    bool keyframes_only = false;
+    int select_offset = 0;       // decoded frames before the restart point, set by seek()
+    float source_fps = 0;
+    int source_count = 0;
+    float source_duration = 0;
+    int range_start = 0;         // source frames of the window, set by set_range()
+    int range_end = 0;           // 0: to the end
+    std::shared_ptr<const KeyframeIndex> keyframe_index;
+    std::shared_ptr<FrameConverter> converter;  // set by set_yuv_conversion(), or for a tensor pix_fmt
+    std::vector<uint8_t> yuv_buffer;
+    IOStats io_stats;
+    std::string stats_file = "";  // release() appends io_stats as JSON here, see dump_stats()
 };
 
 
@@ -186,7 +986,211 @@ public:
     VideoCaptureStreamRT(const std::string& filename, std::string pix_fmt,
         std::tuple<int, int, int, int> crop_xywh = {0, 0, 0, 0}, Size_wh resize = Size_wh(0,0));
 
+    ~VideoCaptureStreamRT();
+    void initializer() override;
+    void release() override;
+    bool seek(int frame_index) override;
+    bool set_subsample(int every_nth_frame, float target_fps = 0, bool keyframes_only = false) override;
+    bool set_range(int start_frame, int end_frame = 0) override;
+
+protected:
+    std::string compose_cmd() override;
+    void open_process() override;
+
+public:
+    // Set before the first read: ffmpeg runs with low-delay flags and a background thread keeps
+    // only the newest frame. read() returns the freshest frame and skips the older ones, counting
+    // them in dropped_frames; iframe stays the frame index in the stream.
+    bool latest_only = false;
+};
+
+// Opens with the decoding ffmpeg alone, no ffprobe: codec, fps, duration and the
+// source/output geometry are parsed from that process's own stream header on stderr.
+// count is unknown (0). Falls back to probing where stderr cannot be captured.
+class VideoCaptureNoProbe: public VideoCapture {
+public:
+    VideoCaptureNoProbe();
+    VideoCaptureNoProbe(const std::string& filename, int isColor = true,
+        std::tuple<int, int, int, int> crop_xywh = {0, 0, 0, 0}, Size_wh resize = Size_wh(0,0));
+
+    VideoCaptureNoProbe(const std::string& filename, std::string pix_fmt,
+        std::tuple<int, int, int, int> crop_xywh = {0, 0, 0, 0}, Size_wh resize = Size_wh(0,0));
+
+    void initializer() override;
+};
+
+bool parse_ffmpeg_header(PipeProcess& process, VideoInfo& input, Size_wh& output);
+
+// One view of VideoCaptureMulti; crop_xywh, resize and pix_fmt mean the same as for VideoCapture.
+struct VideoOutput {
+    std::tuple<int, int, int, int> crop_xywh;
+    Size_wh resize;
+    std::string pix_fmt;
+    Size_wh size_wh;          // filled when opened
+    int bytes_per_frame = 0;  // filled when opened
+
+    VideoOutput(std::tuple<int, int, int, int> crop_xywh = {0, 0, 0, 0}, Size_wh resize = Size_wh(0,0),
+        std::string pix_fmt = "bgr24"): crop_xywh(crop_xywh), resize(resize), pix_fmt(pix_fmt) {}
+};
+
+// "-filter_complex [0:v]split=N... -map [vK] -f rawvideo -pix_fmt X pipe:M" for all views:
+// output 0 goes to pipe:1 (stdout), output k to pipe:k+2. Fills size_wh and bytes_per_frame.
+std::string get_filtergraph_cpu(Size_wh originsize, std::vector<VideoOutput>& outputs);
+
+// Decodes the file once and fans every frame out to several crop/resize/pix_fmt views,
+// each streamed over its own pipe. read() returns all views of frame i together.
+class VideoCaptureMulti {
+public:
+    VideoCaptureMulti();
+    VideoCaptureMulti(const std::string& filename, const std::vector<VideoOutput>& outputs);
+    ~VideoCaptureMulti();
+    void initializer();
+    void release();
+    void close();
+    bool read(std::vector<Frame>& frames);         // frames[k] is view k
+    bool read(const std::vector<void*>& buffers);  // buffers[k] holds outputs[k].bytes_per_frame
+    bool isOpened();
+
+protected:
+    std::string compose_cmd();
+    void open_process();
+
+public:
+    std::string filename = "";
+    std::vector<VideoOutput> outputs;
+    std::shared_ptr<PipeProcess> process;
+    std::vector<std::shared_ptr<FramePrefetcher>> prefetchers;  // one reader per view
+    std::vector<std::shared_ptr<VideoCapture>> fallback_caps;   // one decode per view, without spawn
+    std::vector<Frame> held_frames;
+    int prefetch_frames = 2;
+    bool use_popen = false;   // popen has a single pipe: decodes once per view instead
+    int origin_width = 0;
+    int origin_height = 0;
+    int count = 0;
+    int iframe = -1;
+    float fps = 0;
+    float duration = 0;
+    bool waitInit = true;
+    std::string codec = "";
+    std::string ffmpeg_cmd = "";
+    std::string filterstr = "";
+};
+
+// Decodes one file as N segments at once, each in its own ffmpeg started at a keyframe
+// and stopped at the next segment's first frame. read() returns the frames in order; a
+// later segment decodes ahead only as far as prefetch_frames. With ordered = false,
+// read_unordered() returns frames from all segments as they are decoded, each with its frame index.
+class ParallelVideoCapture: public VideoCapture {
+public:
+    ParallelVideoCapture();
+    ParallelVideoCapture(const std::string& filename, int nsegments, int isColor = true,
+        std::tuple<int, int, int, int> crop_xywh = {0, 0, 0, 0}, Size_wh resize = Size_wh(0,0));
+
+    ParallelVideoCapture(const std::string& filename, int nsegments, std::string pix_fmt,
+        std::tuple<int, int, int, int> crop_xywh = {0, 0, 0, 0}, Size_wh resize = Size_wh(0,0));
+
+    ~ParallelVideoCapture();
     void initializer() override;
+    void release() override;
+    bool read(void * frame) override;
+    std::tuple<bool, void *> read() override;
+    bool read(Frame& frame) override;
+    bool read_unordered(Frame& frame, int& frame_index);
+    bool isOpened() override;
+    bool seek(int frame_index) override;
+    bool set_subsample(int every_nth_frame, float target_fps = 0, bool keyframes_only = false) override;
+    bool set_range(int start_frame, int end_frame = 0) override;
+    bool set_yuv_conversion(int nthreads, int matrix = COLOR_BT601, int range = COLOR_RANGE_LIMITED) override;
+
+protected:
+    void start_segments();
+    void decode_segment(int k);
+
+public:
+    int nsegments = 1;
+    bool ordered = true;              // set before the first read
+    std::vector<int> segment_starts;  // first frame of each segment, then the frame count
+
+private:
+    struct IndexedFrame {
+        int iframe = -1;
+        Frame frame;
+    };
+    std::vector<std::shared_ptr<VideoCapture>> segments;
+    std::vector<std::shared_ptr<BoundedQueue<IndexedFrame>>> queues;  // one per segment, or one shared
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    int running = 0;
+    size_t current_segment = 0;
+};
+
+// One frame from a CapturePool: frame iframe of files[file_index], width x height pixels.
+struct ClipFrame {
+    int file_index = -1;
+    int iframe = -1;
+    int width = 0;
+    int height = 0;
+    Frame frame;
+};
+
+// Decodes a list of files with at most max_processes ffmpeg processes at a time, one per
+// worker thread. A worker takes the next file when its clip ends. Once no file is left, it
+// takes the back half of the longest clip still decoding, cut at a keyframe. Frames are either
+// queued for read(), or passed to a callback on the worker threads by run(). Either way, at most
+// max_bytes_in_flight bytes of decoded frames wait at a time.
+class CapturePool {
+public:
+    CapturePool();
+    CapturePool(const std::vector<std::string>& files, int max_processes = 0, std::string pix_fmt = "bgr24",
+        std::tuple<int, int, int, int> crop_xywh = {0, 0, 0, 0}, Size_wh resize = Size_wh(0,0));
+    ~CapturePool();
+    void start();                                             // called by the first read()
+    bool read(ClipFrame& frame);                              // false once every file is done
+    void run(const std::function<void(ClipFrame&)>& callback);  // blocks until every file is done
+    void release();
+    bool isOpened();
+
+protected:
+    struct Clip {
+        int file_index = -1;
+        int begin = 0;        // first frame
+        int end = -1;         // one past the last frame, -1: end of file
+        int position = 0;     // next frame to decode
+        int length = 0;       // frames in the file, from the probe
+        bool probed = false;
+        bool splittable = true;
+    };
+    void work();
+    std::shared_ptr<Clip> next_clip();
+    void decode_clip(Clip& clip);
+    void deliver(ClipFrame& frame);
+    void reserve_bytes(size_t nbytes);
+    void release_bytes(size_t nbytes);
+
+public:
+    std::vector<std::string> files;
+    int max_processes = 0;             // 0: one per core
+    size_t max_bytes_in_flight = 256 << 20;  // decoded, not yet consumed
+    int min_steal_frames = 64;         // split a running clip only if this many frames remain
+    std::string pix_fmt = "bgr24";
+    std::tuple<int, int, int, int> crop_xywh = {0, 0, 0, 0};
+    Size_wh resize = Size_wh(0, 0);
+    std::vector<int> failed_files;     // indices of files that could not be opened
+
+private:
+    std::function<void(ClipFrame&)> callback;
+    std::vector<std::thread> workers;
+    std::vector<std::shared_ptr<Clip>> active_clips;
+    std::deque<ClipFrame> ready_frames;
+    std::mutex mutex;
+    std::condition_variable frame_ready;
+    std::condition_variable clips_changed;
+    std::condition_variable bytes_freed;
+    size_t next_file = 0;
+    size_t bytes_in_flight = 0;
+    int running = 0;
+    bool started = false;
+    bool stopping = false;
 };
 
 std::tuple<Size_wh, Size_wh, std::string, std::string> get_videofilter_gpu(
@@ -205,9 +1209,15 @@ public:
         Size_wh resize = Size_wh(0,0), int gpu = 0);
 
     void initializer() override;
+    bool set_subsample(int every_nth_frame, float target_fps = 0, bool keyframes_only = false) override;
+    bool set_yuv_conversion(int nthreads, int matrix = COLOR_BT601, int range = COLOR_RANGE_LIMITED) override;
+
+protected:
+    std::string compose_cmd() override;
 
 private:
     int gpu = 0;
+    std::string inputstr = "";
 };
 
 class VideoWriterNV: public VideoWriter {
@@ -224,303 +1234,4178 @@ private:
     int gpu = 0;
 };
 
-} //END NAMESPACE FFMPEGCV
+//================ Begin Frame cache ==================
 
+// A directory of decoded-frame files under a size budget (0: unlimited). Files are evicted in
+// least-recently-used order: opening a file refreshes its mtime, and make_room() deletes the
+// oldest ones until the new bytes fit.
+class FrameCache {
+public:
+    FrameCache(const std::string& directory = "", long long budget_bytes = 0);
+    std::string path_for(const std::string& key) const;
+    bool make_room(long long nbytes, const std::string& keep = "") const;  // false if over the budget alone
+    long long used_bytes() const;
+    void touch(const std::string& path) const;
+
+    std::string directory;
+    long long budget_bytes = 0;
+};
 
-void* operator>>(ffmpegcv::VideoCapture& cap, void* frame);
-void operator>>(void* frame, ffmpegcv::VideoWriter& writer);
-void operator<<(ffmpegcv::VideoWriter& writer, void* frame);
-void operator>>(ffmpegcv::VideoCapture& cap, ffmpegcv::VideoWriter& writer);
+// File layout: this header, the cache key, then `count` frames of bytes_per_frame from
+// data_offset (page aligned), so a frame is a pointer into the mapped file.
+struct FrameCacheHeader {
+    char magic[8];          // "FFCVRAW"
+    uint32_t version;       // FRAME_CACHE_VERSION
+    uint32_t key_bytes;
+    int32_t width;
+    int32_t height;
+    int32_t origin_width;
+    int32_t origin_height;
+    int32_t ndim;
+    int32_t shape[4];       // outnumpyshape
+    int64_t count;          // 0 until the file is complete
+    int64_t bytes_per_frame;
+    int64_t data_offset;
+    double fps;
+    double duration;
+};
+const uint32_t FRAME_CACHE_VERSION = 1;
 
+// Serves a video through a FrameCache. The first pass decodes it with ffmpeg and writes the frames,
+// after crop, resize and pix_fmt conversion, to the cache as they are read. The file is kept only if
+// that pass reads the video to its end. Later opens map the file, and read() and seek() are served
+// from the page cache without ffprobe or ffmpeg; `cached` tells which case it is.
+class VideoCaptureCached: public VideoCapture {
+public:
+    VideoCaptureCached();
+    VideoCaptureCached(const std::string& filename, const FrameCache& cache, int isColor = true,
+        std::tuple<int, int, int, int> crop_xywh = {0, 0, 0, 0}, Size_wh resize = Size_wh(0,0));
 
-// ================== cpp file ====================
-namespace ffmpegcv{
+    VideoCaptureCached(const std::string& filename, const FrameCache& cache, std::string pix_fmt,
+        std::tuple<int, int, int, int> crop_xywh = {0, 0, 0, 0}, Size_wh resize = Size_wh(0,0));
 
+    ~VideoCaptureCached();
+    void initializer() override;
+    void release() override;
+    bool read(void * frame) override;
+    std::tuple<bool, void *> read() override;  // from the cache: a pointer into the mapped file
+    bool read(Frame& frame) override;
+    int read_batch(void* dst, int n) override;
+    int read_batch(Frame& batch, int n);
+    bool isOpened() override;
+    bool seek(int frame_index) override;
+    bool set_subsample(int every_nth_frame, float target_fps = 0, bool keyframes_only = false) override;
+    bool set_range(int start_frame, int end_frame = 0) override;
+    bool set_normalization(const std::vector<float>& mean, const std::vector<float>& stddev,
+        float scale = 1.0f / 255) override;
+    const uint8_t* frame_data(int frame_index) const;  // in the mapped file, NULL if not cached
+
+protected:
+    bool open_cached();
+    void start_writing();
+    void append_frame(const void* frame);  // the first pass, one decoded frame into the cache file
+    void finish_writing(bool complete);
+    bool next_prefetched(Frame& frame) override;
 
-bool startsWith(const std::string& str, const std::string& prefix) {
-    return str.size() >= prefix.size() && str.compare(0, prefix.size(), prefix) == 0;
-}
-std::string decoder_to_nvidia(const std::string& codec);
-std::string encoder_to_nvidia(const std::string& codec);
+public:
+    FrameCache cache;
+    bool cached = false;      // frames come from the cache file
+    std::string cache_path = "";
 
-std::string get_file_extension(const std::string& filename) {
-    const size_t pos = filename.find_last_of('.');
-    if (pos != std::string::npos) {
-        std::string ext = filename.substr(pos + 1);
-        std::transform(ext.begin(), ext.end(), ext.begin(),
-                        [](unsigned char c) { return std::tolower(c); });
-        return ext;
-    }
-    return "";
-}
+private:
+    std::string cache_key;
+    FrameCacheHeader header;
+    const uint8_t* mapped = NULL;
+    size_t mapped_bytes = 0;
+    FILE* writer = NULL;      // the first pass, writing to cache_path + ".<pid>.tmp"
+    std::string writer_path;
+    int frames_written = 0;
+    bool reading = false;     // inside VideoCapture::read(), which releases the capture at EOF
+};
 
-std::string execute_command(const std::string& command) {
-    std::string result;
-    FILE* stream = POPEN_R(command.c_str());
-    if (!stream) return result;
+//================ End Frame cache ==================
 
-    char buffer[1024];
-    while (fgets(buffer, sizeof(buffer), stream) != nullptr) {
-        result += buffer;
-    }
-    PCLOSE(stream);
-    return result;
-}
+//================ Begin LibAV backend ==================
+#ifdef FFMPEGCV_USE_LIBAV
+// Opt-in in-process backend: build with -DFFMPEGCV_USE_LIBAV and link libavformat, libavcodec,
+// libswscale and libavutil. The classes keep the VideoCapture/VideoWriter interface, but there is
+// no ffprobe or ffmpeg process: frames are decoded in this process and sws_scale converts them
+// straight into the caller's buffer (or pooled Frame), and back for the writer.
 
-bool file_exsits(const std::string& filename) {
-    std::ifstream file(filename);
-    return file.good();
-}
+VideoInfo get_info_libav(const std::string& filename);
 
-VideoInfo get_info(const std::string& filename) {
-    assert (file_exsits(filename) && "File does not exist");
-    static const std::vector<std::string> complex_formats = {"mkv", "flv", "ts"};
-    const bool is_complex = std::find(complex_formats.begin(), complex_formats.end(),
-        get_file_extension(filename)) != complex_formats.end();
+class VideoCaptureLibav: public VideoCapture {
+public:
+    VideoCaptureLibav();
+    VideoCaptureLibav(const std::string& filename, int isColor = true,
+        std::tuple<int, int, int, int> crop_xywh = {0, 0, 0, 0}, Size_wh resize = Size_wh(0,0));
+    VideoCaptureLibav(const std::string& filename, std::string pix_fmt,
+        std::tuple<int, int, int, int> crop_xywh = {0, 0, 0, 0}, Size_wh resize = Size_wh(0,0));
+    ~VideoCaptureLibav();
 
-    std::ostringstream cmd;
-    cmd << "ffprobe -v quiet -print_format json=compact=1 -select_streams v:0";
-    if (is_complex) cmd << " -count_packets";
-    cmd << " -show_streams \"" << filename << "\"";
+    void initializer() override;
+    void release() override;
+    bool read(void* frame) override;
+    std::tuple<bool, void *> read() override;
+    bool read(Frame& frame) override;
+    bool isOpened() override;
+    bool seek(int frame_index) override;
+    bool set_subsample(int every_nth_frame, float target_fps = 0, bool keyframes_only = false) override;
+    bool set_range(int start_frame, int end_frame = 0) override;
+    bool set_yuv_conversion(int nthreads, int matrix = COLOR_BT601, int range = COLOR_RANGE_LIMITED) override;
+
+protected:
+    void open_process() override;  // opens the decoder
+    bool decode_next();            // the next frame into `decoded`, false at the end
 
-    const std::string json_output = execute_command(cmd.str());
-    VideoInfo info;
-    info.is_complex = is_complex;
+public:
+    int decoder_threads = 0;  // 0: libavcodec picks, one per core; set before the first read
+
+private:
+    AVFormatContext* format_context = NULL;
+    AVCodecContext* decoder = NULL;
+    SwsContext* sws = NULL;
+    AVPacket* packet = NULL;
+    AVFrame* decoded = NULL;
+    AVPixelFormat out_format = AV_PIX_FMT_NONE;
+    int stream_index = -1;
+    bool draining = false;  // the demuxer is at EOF, the decoder returns what it holds
+    bool finished = false;
+    bool pending = false;   // seek() left the target frame in `decoded`
+};
+
+class VideoWriterLibav: public VideoWriter {
+public:
+    VideoWriterLibav();
+    VideoWriterLibav(const std::string& filename, const std::string& codec, double fps, Size_wh size_wh,
+        int isColor = true, std::string ffmpeg_output_opt = "");
+    VideoWriterLibav(const std::string& filename, const std::string& codec, double fps, Size_wh size_wh,
+        std::string pix_fmt, std::string ffmpeg_output_opt = "");
+    ~VideoWriterLibav();
+
+    void initializer() override;
+    void release() override;
+    bool write(const void* frame) override;
+    bool write(const Frame& frame) override;
+    bool isOpened() const override;
+
+protected:
+    bool open_encoder();
+    bool encode(AVFrame* input);  // NULL drains the encoder
+
+public:
+    int encoder_threads = 0;  // 0: libavcodec picks; set before the first write
+    bool failed = false;
+
+private:
+    AVFormatContext* format_context = NULL;
+    AVCodecContext* encoder = NULL;
+    AVStream* stream = NULL;
+    SwsContext* sws = NULL;
+    AVFrame* picture = NULL;
+    AVPacket* packet = NULL;
+    AVPixelFormat in_format = AV_PIX_FMT_NONE;
+    int64_t next_pts = 0;
+    bool header_written = false;
+};
+
+#endif
+//================ End LibAV backend ==================
 
-    static const std::regex codec_re( "codec_name.: .(\\w+)");
-    static const std::regex width_re( "width.: (\\d+)");
-    static const std::regex height_re( "height.: (\\d+)");
-    static const std::regex frames_re( "nb_frames.: .(\\d+)");
-    static const std::regex nb_read_packets_re( "nb_read_packets.: .(\\d+)");
-    static const std::regex duration_re( "duration.: .([0-9]*\\.?[0-9]+)");
-    static const std::regex rate_re( "r_frame_rate.: .(\\d+)/(\\d+)");
+} //END NAMESPACE FFMPEGCV
+
+
+void* operator>>(ffmpegcv::VideoCapture& cap, void* frame);
+void operator>>(void* frame, ffmpegcv::VideoWriter& writer);
+void operator<<(ffmpegcv::VideoWriter& writer, void* frame);
+void operator>>(ffmpegcv::VideoCapture& cap, ffmpegcv::VideoWriter& writer);
+ffmpegcv::Frame& operator>>(ffmpegcv::VideoCapture& cap, ffmpegcv::Frame& frame);
+void operator<<(ffmpegcv::VideoWriter& writer, const ffmpegcv::Frame& frame);
+
+
+// ================== cpp file ====================
+namespace ffmpegcv{
+
+
+bool startsWith(const std::string& str, const std::string& prefix) {
+    return str.size() >= prefix.size() && str.compare(0, prefix.size(), prefix) == 0;
+}
 
-    std::smatch match;
-    auto count_re = is_complex? nb_read_packets_re : frames_re;
+//================ Begin CPU scheduler ==================
 
-    if (std::regex_search(json_output, match, codec_re) && match.size() > 1) {
-        info.codec = match[1];
+std::string CpuAssignment::to_json() const {
+    std::ostringstream json;
+    json << "{\"id\": " << id << ", \"pid\": " << pid << ", \"node\": " << node << ", \"cpus\": [";
+    for (size_t i = 0; i < cpus.size(); i++) json << (i ? ", " : "") << cpus[i];
+    json << "], \"threads\": " << threads << ", \"filter_threads\": " << filter_threads
+         << ", \"encoder\": " << (encoder ? "true" : "false")
+         << ", \"pin_thread\": " << (pin_thread ? "true" : "false") << "}";
+    return json.str();
+}
+
+bool set_thread_affinity(const std::vector<int>& cpus, int tid) {
+#ifdef __linux__
+    if (cpus.empty()) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
     }
+    return sched_setaffinity(tid, sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    (void)tid;
+    return false;
+#endif
+}
 
-    if (std::regex_search(json_output, match, width_re) && match.size() > 1) {
-        info.width = std::stoi(match[1]);
+bool get_thread_affinity(std::vector<int>& cpus) {
+    cpus.clear();
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) return false;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
     }
+#endif
+    return !cpus.empty();
+}
 
-    if (std::regex_search(json_output, match, height_re) && match.size() > 1) {
-        info.height = std::stoi(match[1]);
+std::vector<int> parse_cpu_list(const std::string& list);
+
+// Cpus this process may use: the main thread's affinity, which our own pinning never changes
+// before the scheduler exists, then the online cpus.
+std::vector<int> process_cpus() {
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(getpid(), sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+        }
     }
+    if (cpus.empty()) {
+        std::ifstream file("/sys/devices/system/cpu/online");
+        std::string list;
+        if (std::getline(file, list)) cpus = parse_cpu_list(list);
+    }
+#endif
+    if (cpus.empty()) {
+        for (int cpu = 0; cpu < (int)std::thread::hardware_concurrency(); cpu++) cpus.push_back(cpu);
+    }
+    return cpus;
+}
 
-    if (std::regex_search(json_output, match, count_re) && match.size() > 1) {
-        info.count = std::stoi(match[1]);
+std::vector<int> parse_cpu_list(const std::string& list) {
+    // "0-3,8-11" as in /sys/devices/system/node/node0/cpulist
+    std::vector<int> cpus;
+    std::istringstream ranges(list);
+    std::string range;
+    while (std::getline(ranges, range, ',')) {
+        int first = 0, last = 0;
+        const int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (n < 1) continue;
+        if (n == 1) last = first;
+        for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
     }
+    return cpus;
+}
 
-    if (std::regex_search(json_output, match, duration_re) && match.size() > 1) {
-        info.duration = strtof(match[1].str().c_str(), nullptr);
+struct CpuScheduler {
+    std::mutex mutex;
+    CpuSchedulerConfig config;
+    std::vector<int> allowed; // the process's cpus, read once before anything is pinned
+    std::vector<int> cpus;    // usable cpus, grouped by node
+    std::vector<int> nodes;   // node of cpus[i]
+    std::vector<int> load;    // running processes on cpus[i]
+    std::map<int, CpuAssignment> active;
+    int next_id = 1;
+
+    static CpuScheduler& instance() {
+        static CpuScheduler scheduler;
+        return scheduler;
     }
 
-    if (std::regex_search(json_output, match, rate_re) && match.size() > 2) {
-        float num = std::stof(match[1]);
-        float den = std::stof(match[2]);
-        if (den != 0) info.fps = float(num) / den;
+    CpuScheduler(): allowed(process_cpus()) {
+        const char* env = getenv("FFMPEGCV_CPU_THREADS");
+        if (env && atoi(env) > 0) {
+            CpuSchedulerConfig env_config;
+            env_config.enabled = true;
+            env_config.threads = atoi(env);
+            configure(env_config);
+        }
     }
 
-    return info;
+    void configure(const CpuSchedulerConfig& new_config) {
+        config = new_config;
+        std::vector<int> usable = config.cpus.empty() ? allowed : config.cpus;
+        std::sort(usable.begin(), usable.end());
+        usable.erase(std::unique(usable.begin(), usable.end()), usable.end());
+
+        std::map<int, int> node_of;  // cpu -> node, all on node 0 without sysfs
+        for (int node = 0; node < 1024; node++) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string list;
+            if (!std::getline(file, list)) continue;  // node ids may have gaps
+            for (int cpu : parse_cpu_list(list)) node_of[cpu] = node;
+        }
+        std::vector<std::pair<int, int>> placed;  // (node, cpu)
+        for (int cpu : usable) placed.push_back(std::make_pair(node_of.count(cpu) ? node_of[cpu] : 0, cpu));
+        std::sort(placed.begin(), placed.end());
+        cpus.clear();
+        nodes.clear();
+        for (const std::pair<int, int>& p : placed) {
+            nodes.push_back(p.first);
+            cpus.push_back(p.second);
+        }
+        load.assign(cpus.size(), 0);
+        for (const auto& entry : active) add_load(entry.second.cpus, 1);
+    }
+
+    void add_load(const std::vector<int>& assigned, int delta) {
+        for (int cpu : assigned) {
+            const size_t i = std::find(cpus.begin(), cpus.end(), cpu) - cpus.begin();
+            if (i < cpus.size()) load[i] += delta;
+        }
+    }
+
+    // First index of the least loaded run of k cpus: runs are aligned to k within each node
+    // (the whole list without numa_local), plus one ending at the last cpu of the group.
+    int least_loaded(int k, bool numa_local) const {
+        int best = -1;
+        long best_load = 0;
+        size_t begin = 0;
+        while (begin < cpus.size()) {
+            size_t end = begin + 1;
+            while (end < cpus.size() && (!numa_local || nodes[end] == nodes[begin])) end++;
+            std::vector<size_t> starts;
+            for (size_t start = begin; start + k <= end; start += k) starts.push_back(start);
+            if (end - begin >= (size_t)k && (end - begin) % k != 0) starts.push_back(end - k);
+            for (size_t start : starts) {
+                long sum = 0;
+                for (size_t i = start; i < start + k; i++) sum += load[i];
+                if (best < 0 || sum < best_load) {
+                    best = (int)start;
+                    best_load = sum;
+                }
+            }
+            begin = end;
+        }
+        return best;
+    }
+
+    std::shared_ptr<CpuAssignment> acquire(const std::string& command, bool encoder) {
+        if (!config.enabled || cpus.empty()) return nullptr;
+        CpuAssignment assignment;
+        assignment.threads = std::max(config.threads, 1);
+        assignment.filter_threads = config.filter_threads > 0 ? config.filter_threads : assignment.threads;
+        assignment.encoder = encoder;
+        assignment.pin_thread = config.pin_reader && !encoder;
+        assignment.command = command;
+        const int k = std::min(config.cpus_per_process > 0 ? config.cpus_per_process : assignment.threads,
+            (int)cpus.size());
+        int start = config.numa_local ? least_loaded(k, true) : -1;
+        if (start < 0) start = least_loaded(k, false);  // larger than any node
+        assignment.cpus.assign(cpus.begin() + start, cpus.begin() + start + k);
+        assignment.node = nodes[start];
+        assignment.id = next_id++;
+        add_load(assignment.cpus, 1);
+        active[assignment.id] = assignment;
+        const int id = assignment.id;
+        return std::shared_ptr<CpuAssignment>(new CpuAssignment(assignment), [id](CpuAssignment* released) {
+            CpuScheduler& scheduler = CpuScheduler::instance();
+            std::lock_guard<std::mutex> lock(scheduler.mutex);
+            auto it = scheduler.active.find(id);
+            if (it != scheduler.active.end()) {
+                scheduler.add_load(it->second.cpus, -1);
+                scheduler.active.erase(it);
+            }
+            delete released;
+        });
+    }
+};
+
+void set_cpu_scheduler(const CpuSchedulerConfig& config) {
+    CpuScheduler& scheduler = CpuScheduler::instance();
+    std::lock_guard<std::mutex> lock(scheduler.mutex);
+    scheduler.configure(config);
 }
 
-VideoInfo get_info_stream(const std::string& filename, int timeout=0, int duration_ms=100){
-    std::string rtsp_opt = startsWith(filename, "rtsp://") ? "-rtsp_flags prefer_tcp -pkt_size 736 " : "";
-    std::string analyze_duration = " -analyzeduration " + std::to_string(duration_ms) + "000 ";
-    std::ostringstream cmd;
-    cmd << "ffprobe -v quiet -print_format json=compact=1 "
-        << rtsp_opt << analyze_duration
-        << " -select_streams v:0 -show_format -show_streams \""
-        << filename << "\"";
+CpuSchedulerConfig get_cpu_scheduler() {
+    CpuScheduler& scheduler = CpuScheduler::instance();
+    std::lock_guard<std::mutex> lock(scheduler.mutex);
+    CpuSchedulerConfig config = scheduler.config;
+    config.cpus = scheduler.cpus;
+    return config;
+}
 
-    const std::string json_output = execute_command(cmd.str());
-    VideoInfo info;
+std::vector<CpuAssignment> get_cpu_assignments() {
+    CpuScheduler& scheduler = CpuScheduler::instance();
+    std::lock_guard<std::mutex> lock(scheduler.mutex);
+    std::vector<CpuAssignment> assignments;
+    for (const auto& entry : scheduler.active) assignments.push_back(entry.second);
+    return assignments;
+}
 
-    static const std::regex codec_re( "codec_name.: .(\\w+)");
-    static const std::regex width_re( "width.: (\\d+)");
-    static const std::regex height_re( "height.: (\\d+)");
-    static const std::regex rate_re( "r_frame_rate.: .(\\d+)/(\\d+)");
+std::shared_ptr<CpuAssignment> acquire_cpu_assignment(const std::string& command, bool encoder) {
+    CpuScheduler& scheduler = CpuScheduler::instance();
+    std::lock_guard<std::mutex> lock(scheduler.mutex);
+    return scheduler.acquire(command, encoder);
+}
 
-    std::smatch match;
+void update_cpu_assignment(CpuAssignment& assignment, int pid, const std::string& command) {
+    CpuScheduler& scheduler = CpuScheduler::instance();
+    std::lock_guard<std::mutex> lock(scheduler.mutex);
+    assignment.pid = pid;
+    assignment.command = command;
+    auto it = scheduler.active.find(assignment.id);
+    if (it != scheduler.active.end()) it->second = assignment;
+}
 
-    if (std::regex_search(json_output, match, codec_re) && match.size() > 1) {
-        info.codec = match[1];
+std::string apply_thread_options(const std::string& command, int threads, int filter_threads, bool encoder) {
+    std::string cmd = command;
+    const size_t program_end = cmd.find(' ');
+    if (program_end == std::string::npos) return cmd;
+    const bool has_threads = cmd.find(" -threads ") != std::string::npos;
+    if (encoder && !has_threads && threads > 0) {
+        // an output option: just before the output file, the last argument
+        const size_t output = cmd.back() == '"' ? cmd.rfind('"', cmd.size() - 2) : cmd.rfind(' ') + 1;
+        if (output != std::string::npos && output > program_end) {
+            cmd.insert(output, "-threads " + std::to_string(threads) + " ");
+        }
+    }
+    std::string global_opt;
+    if (filter_threads > 0 && cmd.find(" -filter_threads ") == std::string::npos) {
+        global_opt += " -filter_threads " + std::to_string(filter_threads);
     }
+    if (!encoder && !has_threads && threads > 0) {
+        global_opt += " -threads " + std::to_string(threads);  // before -i: the decoder's threads
+    }
+    cmd.insert(program_end, global_opt);
+    return cmd;
+}
+
+//================ End CPU scheduler ==================
+
+std::string decoder_to_nvidia(const std::string& codec);
+std::string encoder_to_nvidia(const std::string& codec);
 
-    if (std::regex_search(json_output, match, width_re) && match.size() > 1) {
-        info.width = std::stoi(match[1]);
+std::string get_file_extension(const std::string& filename) {
+    const size_t pos = filename.find_last_of('.');
+    if (pos != std::string::npos) {
+        std::string ext = filename.substr(pos + 1);
+        std::transform(ext.begin(), ext.end(), ext.begin(),
+                        [](unsigned char c) { return std::tolower(c); });
+        return ext;
     }
+    return "";
+}
 
-    if (std::regex_search(json_output, match, height_re) && match.size() > 1) {
-        info.height = std::stoi(match[1]);
+bool split_command(const std::string& command, std::vector<std::string>& args, bool& merge_stderr) {
+    // Shell-like word splitting of our own ffmpeg/ffprobe commands: whitespace,
+    // '...' and "..." quoting, backslash escapes and a trailing "2>&1".
+    // Returns false if an unquoted shell operator needs a real shell.
+    std::string arg;
+    bool in_arg = false;
+    bool has_operator = false;
+    char quote = 0;
+    args.clear();
+    merge_stderr = false;
+    for (size_t i = 0; i <= command.size(); ++i) {
+        const char c = i < command.size() ? command[i] : ' ';
+        if (quote) {
+            if (c == quote) {
+                quote = 0;
+            } else if (quote == '"' && c == '\\' && i + 1 < command.size() &&
+                    std::strchr("\"\\$`", command[i + 1])) {
+                arg += command[++i];
+            } else {
+                arg += c;
+            }
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+            in_arg = true;
+        } else if (c == '\\' && i + 1 < command.size()) {
+            arg += command[++i];
+            in_arg = true;
+        } else if (std::isspace(static_cast<unsigned char>(c))) {
+            if (in_arg) {
+                if (has_operator && arg == "2>&1") {
+                    merge_stderr = true;
+                } else if (has_operator) {
+                    return false;
+                } else {
+                    args.push_back(arg);
+                }
+            }
+            arg.clear();
+            in_arg = false;
+            has_operator = false;
+        } else {
+            if (std::strchr("|&;<>()$`*?", c)) has_operator = true;
+            arg += c;
+            in_arg = true;
+        }
     }
+    return quote == 0;
+}
 
-    if (std::regex_search(json_output, match, rate_re) && match.size() > 2) {
-        float num = std::stof(match[1]);
-        float den = std::stof(match[2]);
-        if (den != 0) info.fps = float(num) / den;
+int get_pipe_max_size() {
+    static int max_size = -1;
+    if (max_size < 0) {
+        max_size = 1 << 20;
+        std::ifstream file("/proc/sys/fs/pipe-max-size");
+        int value = 0;
+        if (file >> value && value > 0) max_size = value;
     }
+    return max_size;
+}
 
-    return info;
+PipeProcess::~PipeProcess() {
+    close();
 }
-//================ End Video info ==================
 
-//================ Begin Video Writer ==================
+bool PipeProcess::open(const std::string& command, const char* mode, int pipe_size, bool use_popen,
+    bool capture_stderr, int extra_outputs) {
+    const bool reading = mode[0] == 'r';
+#ifdef __linux__
+    std::vector<std::string> args;
+    bool merge_stderr = false;
+    if (!use_popen && split_command(command, args, merge_stderr) && !args.empty()) {
+        int fds[2];
+        int err_fds[2] = {-1, -1};
+        if (pipe2(fds, O_CLOEXEC) != 0) return false;
+        if (capture_stderr && pipe2(err_fds, O_CLOEXEC) != 0) {
+            ::close(fds[0]);
+            ::close(fds[1]);
+            return false;
+        }
+        const int parent_fd = reading ? fds[0] : fds[1];
+        const int child_fd = reading ? fds[1] : fds[0];
+        fd = parent_fd;
+        set_pipe_size(pipe_size);
+
+        // Write ends of the extra outputs are moved to fds >= 3 + extra_outputs, so
+        // dup2-ing them onto 3, 4, ... in the child never clobbers one another.
+        std::vector<int> extra_child_fds;
+        for (int k = 0; reading && k < extra_outputs; ++k) {
+            int extra[2];
+            if (pipe2(extra, O_CLOEXEC) != 0) break;
+            const int moved = fcntl(extra[1], F_DUPFD_CLOEXEC, 3 + extra_outputs);
+            ::close(extra[1]);
+            if (moved < 0) {
+                ::close(extra[0]);
+                break;
+            }
+            extra_fds.push_back(extra[0]);
+            extra_child_fds.push_back(moved);
+#ifdef F_SETPIPE_SZ
+            if (pipe_size > 0) fcntl(extra[0], F_SETPIPE_SZ, std::min(pipe_size, get_pipe_max_size()));
+#endif
+        }
 
-std::vector<int> get_outnumpyshape(Size_wh size_wh, std::string pix_fmt) {
-    if (pix_fmt == "bgr24" || pix_fmt == "rgb24") {
-        return {size_wh.height, size_wh.width, 3};
-    } else if (pix_fmt == "gray") {
-        return {size_wh.height, size_wh.width};
-    } else if (pix_fmt == "yuv420p" || pix_fmt == "yuvj420p" || pix_fmt == "nv12") {
-        return {size_wh.height * 3 / 2, size_wh.width};
-    } else {
-        assert(false && "pix_fmt not supported");
-        return {0, 0};
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if (reading) {
+            posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+            posix_spawn_file_actions_adddup2(&actions, child_fd, 1);
+            if (merge_stderr) posix_spawn_file_actions_adddup2(&actions, 1, 2);
+        } else {
+            posix_spawn_file_actions_adddup2(&actions, child_fd, 0);
+        }
+        if (capture_stderr) posix_spawn_file_actions_adddup2(&actions, err_fds[1], 2);
+        for (size_t k = 0; k < extra_child_fds.size(); ++k) {
+            posix_spawn_file_actions_adddup2(&actions, extra_child_fds[k], 3 + k);
+        }
+        std::vector<char*> argv;
+        for (auto& arg : args) argv.push_back(&arg[0]);
+        argv.push_back(NULL);
+
+        pid_t child = -1;
+        const int err = posix_spawnp(&child, argv[0], &actions, NULL, argv.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+        ::close(child_fd);
+        if (capture_stderr) ::close(err_fds[1]);
+        for (int extra_fd : extra_child_fds) ::close(extra_fd);
+        if (err != 0 || (int)extra_fds.size() != (reading ? extra_outputs : 0)) {
+            if (err == 0) {
+                ::kill(child, SIGKILL);
+                while (waitpid(child, NULL, 0) < 0 && errno == EINTR) {}
+            }
+            ::close(parent_fd);
+            if (capture_stderr) ::close(err_fds[0]);
+            for (int extra_fd : extra_fds) ::close(extra_fd);
+            extra_fds.clear();
+            fd = -1;
+            return false;
+        }
+        err_fd = err_fds[0];
+        pid = child;
+        return true;
     }
+#endif
+    (void)pipe_size;
+    (void)use_popen;
+    if (capture_stderr || extra_outputs > 0) return false;  // popen has stdout only
+    stream = reading ? POPEN_R(command.c_str()) : POPEN_W(command.c_str());
+    return stream != NULL;
 }
 
-VideoWriter::VideoWriter(){;}
+void PipeProcess::set_pipe_size(int pipe_size) {
+#if defined(__linux__) && defined(F_SETPIPE_SZ)
+    if (fd >= 0 && pipe_size > 0) {
+        fcntl(fd, F_SETPIPE_SZ, std::min(pipe_size, get_pipe_max_size()));
+    }
+#endif
+    (void)pipe_size;
+}
 
-VideoWriter::VideoWriter(const std::string& filename, const std::string& codec, double fps, Size_wh size_wh, int isColor,
-    std::string ffmpeg_output_opt):
-    filename(filename), codec(codec), fps(fps), size_wh(size_wh), pix_fmt(isColor ? "bgr24" : "gray"), ffmpeg_output_opt(ffmpeg_output_opt)
-    {
-    initializer();
+bool PipeProcess::read_stderr_line(std::string& line) {
+#ifdef __linux__
+    while (err_fd >= 0) {
+        const size_t eol = err_buffer.find_first_of("\r\n");
+        if (eol != std::string::npos) {
+            line = err_buffer.substr(0, eol);
+            err_buffer.erase(0, eol + 1);
+            return true;
+        }
+        char chunk[4096];
+        const ssize_t n = ::read(err_fd, chunk, sizeof(chunk));
+        if (n > 0) {
+            err_buffer.append(chunk, n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            break;
+        }
+    }
+#endif
+    line.swap(err_buffer);
+    err_buffer.clear();
+    return !line.empty();
 }
 
+void PipeProcess::forward_stderr(std::function<void(const std::string&)> handler) {
+    if (err_fd < 0 || err_thread.joinable()) return;
+    err_thread = std::thread([this, handler]() {
+        std::string line;
+        while (read_stderr_line(line)) {
+            if (handler) handler(line);
+        }
+    });
+}
 
-VideoWriter::VideoWriter(const std::string& filename, const std::string& codec, double fps, Size_wh size_wh, std::string pix_fmt,
-    std::string ffmpeg_output_opt):
-    filename(filename), codec(codec), fps(fps), size_wh(size_wh), pix_fmt(pix_fmt), ffmpeg_output_opt(ffmpeg_output_opt)
-    {
-    initializer();
+size_t PipeProcess::read(void* buffer, size_t nbytes, int output) {
+    if (cpu_assignment && pinned_tid == 0) pin_reader();
+    if (stream) return output == 0 ? fread(buffer, sizeof(char), nbytes, stream) : 0;
+    size_t done = 0;
+#ifdef __linux__
+    if (output < 0 || output > (int)extra_fds.size()) return 0;
+    const int read_fd = output == 0 ? fd : extra_fds[output - 1];
+    char* dst = static_cast<char*>(buffer);
+    while (done < nbytes) {
+        const ssize_t n = ::read(read_fd, dst + done, nbytes - done);
+        if (n > 0) done += n;
+        else if (n < 0 && errno == EINTR) continue;
+        else break;
+    }
+#endif
+    return done;
 }
 
-void VideoWriter::initializer(){
-    codec = codec.empty() ? "h264" : codec;
-    width = size_wh.width;
-    height = size_wh.height;
-    process = 0;
-    std::string rtsp_str = startsWith(filename, "rtsp://") ? " -f rtsp -rtsp_transport tcp " : " ";
+void PipeProcess::pin_reader() {
+#ifdef __linux__
+    pinned_tid = (int)syscall(SYS_gettid);  // also when not pinned, so it is tried once
+    if (!cpu_assignment->pin_thread || !get_thread_affinity(unpinned_cpus) ||
+        !set_thread_affinity(cpu_assignment->cpus)) {
+        unpinned_cpus.clear();
+    }
+#endif
+}
 
-    std::ostringstream oss;
-    oss << "ffmpeg -y -loglevel warning -f rawvideo -pix_fmt " << pix_fmt
-        << " -s " << width << "x" << height << " -r " << fps
-        << " -i pipe: -c:v " << codec << " -pix_fmt " << output_pix_fmt
-        << ffmpeg_output_opt << rtsp_str << " \"" << filename << "\"";
-    ffmpeg_cmd = oss.str();
-    std::cout << "ffmpeg_cmd: " << ffmpeg_cmd << std::endl;
+void PipeProcess::flush() {
+    if (stream) fflush(stream);  // raw fds are unbuffered
+}
 
-    innumpyshape = get_outnumpyshape(size_wh, pix_fmt);
-    bytes_per_frame = 1;
-    for (int num : innumpyshape) {
-        bytes_per_frame *= num;
+size_t PipeProcess::write(const void* buffer, size_t nbytes) {
+    if (stream) return fwrite(buffer, sizeof(char), nbytes, stream);
+    size_t done = 0;
+#ifdef __linux__
+    const char* src = static_cast<const char*>(buffer);
+    while (done < nbytes) {
+        const ssize_t n = ::write(fd, src + done, nbytes - done);
+        if (n > 0) done += n;
+        else if (n < 0 && errno == EINTR) continue;
+        else break;
     }
+#endif
+    return done;
 }
 
+int PipeProcess::close() {
+    int status = 0;
+    if (stream) {
+        status = PCLOSE(stream);
+        stream = NULL;
+    }
+#ifdef __linux__
+    if (fd >= 0) {
+        ::close(fd);  // EOF for a writer, EPIPE for a reader
+        fd = -1;
+    }
+    for (int extra_fd : extra_fds) ::close(extra_fd);
+    extra_fds.clear();
+    if (err_fd >= 0 && !err_thread.joinable()) {
+        ::close(err_fd);  // nobody drains it, do not let the child block on it
+        err_fd = -1;
+    }
+    if (pid > 0) {
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+        pid = -1;
+    }
+    if (err_thread.joinable()) err_thread.join();  // the child is gone, stderr is at EOF
+    if (err_fd >= 0) {
+        ::close(err_fd);
+        err_fd = -1;
+    }
+#endif
+#ifdef __linux__
+    if (!unpinned_cpus.empty()) {
+        // a prefetcher thread may have exited already, then there is nothing to restore
+        const bool same_thread = (int)syscall(SYS_gettid) == pinned_tid;
+        if (same_thread || access(("/proc/self/task/" + std::to_string(pinned_tid)).c_str(), F_OK) == 0) {
+            set_thread_affinity(unpinned_cpus, same_thread ? 0 : pinned_tid);
+        }
+        unpinned_cpus.clear();
+    }
+    pinned_tid = 0;
+#endif
+    cpu_assignment.reset();  // the child is gone
+    return status;
+}
 
-VideoWriter::~VideoWriter() {
-    release();
+void PipeProcess::terminate() {
+#ifdef __linux__
+    if (pid > 0) ::kill(pid, SIGKILL);  // not reaped yet, so pid cannot have been reused
+#endif
 }
 
-void VideoWriter::release() {
-    if (process) {
-        PCLOSE(process);
-        process = NULL;
+std::shared_ptr<PipeProcess> open_pipe_process(const std::string& command, const char* mode,
+    int pipe_size, bool use_popen, bool capture_stderr, int extra_outputs) {
+    std::shared_ptr<PipeProcess> process = std::make_shared<PipeProcess>();
+    const bool encoder = mode[0] == 'w';
+    std::shared_ptr<CpuAssignment> cpu;
+    if (startsWith(command, "ffmpeg ")) cpu = acquire_cpu_assignment(command, encoder);
+    if (!cpu) {
+        if (!process->open(command, mode, pipe_size, use_popen, capture_stderr, extra_outputs)) process.reset();
+        return process;
     }
+
+    // the child inherits the affinity of the thread that starts it, which then gets its own back;
+    // a capture's reading thread is pinned by its first read()
+    const std::string scheduled = apply_thread_options(command, cpu->threads, cpu->filter_threads, encoder);
+    std::vector<int> previous;
+    const bool restore = get_thread_affinity(previous);
+    set_thread_affinity(cpu->cpus);
+    const bool success = process->open(scheduled, mode, pipe_size, use_popen, capture_stderr, extra_outputs);
+    if (restore) set_thread_affinity(previous);
+    if (!success) return nullptr;
+    update_cpu_assignment(*cpu, process->child_pid(), scheduled);
+    process->cpu_assignment = cpu;
+    return process;
 }
 
-void VideoWriter::close() {
-    release();
+std::string execute_command(const std::string& command) {
+    std::string result;
+    PipeProcess stream;
+    if (!stream.open(command, "r")) return result;
+
+    char buffer[4096];
+    size_t nbytes = 0;
+    while ((nbytes = stream.read(buffer, sizeof(buffer))) > 0) {
+        result.append(buffer, nbytes);
+    }
+    stream.close();
+    return result;
 }
 
-bool VideoWriter::write(const void* frame) {
-    if (waitInit){
-        process = POPEN_W(ffmpeg_cmd.c_str());
-        waitInit = false;
+std::string get_passthrough_opt() {
+    static std::string passthrough_opt;
+    if (passthrough_opt.empty()) {
+        // "ffmpeg version 4.4.2-0ubuntu0.22.04.1 ..."; git builds ("N-...") are new enough
+        const std::string version = execute_command("ffmpeg -version");
+        int major = 0, minor = 0;
+        const size_t pos = version.find("ffmpeg version ");
+        const bool old = pos != std::string::npos &&
+            sscanf(version.c_str() + pos + 15, "%d.%d", &major, &minor) == 2 &&
+            (major < 5 || (major == 5 && minor < 1));
+        passthrough_opt = old ? "-vsync passthrough" : "-fps_mode passthrough";
     }
-    if (frame == NULL) return false;
-    if (!process) {
-        std::cerr << "Failed to open video writer";
-        return false;
+    return passthrough_opt;
+}
+
+bool file_exsits(const std::string& filename) {
+    std::ifstream file(filename);
+    return file.good();
+}
+
+std::string json_field(const std::string& json, const std::string& key) {
+    // Value of the first `"key": value` pair, without quotes; "" if absent.
+    const std::string quoted = "\"" + key + "\"";
+    size_t pos = 0;
+    while ((pos = json.find(quoted, pos)) != std::string::npos) {
+        pos += quoted.size();
+        size_t i = json.find_first_not_of(" \t\r\n", pos);
+        if (i == std::string::npos || json[i] != ':') continue;
+        i = json.find_first_not_of(" \t\r\n", i + 1);
+        if (i == std::string::npos) break;
+        if (json[i] == '"') {
+            const size_t end = json.find('"', i + 1);
+            return end == std::string::npos ? "" : json.substr(i + 1, end - i - 1);
+        }
+        const size_t end = json.find_first_of(",}] \t\r\n", i);
+        return json.substr(i, end == std::string::npos ? std::string::npos : end - i);
     }
-    fwrite(frame, sizeof(char), bytes_per_frame, process);
-    return true;
+    return "";
 }
 
-#ifdef OPENCV_CORE_TYPES_HPP
-bool VideoWriter::write(cv::Mat& frame) {
-    return write(frame.data);
+float parse_frame_rate(const std::string& rate) {
+    // "30000/1001" or "25"
+    char* end = NULL;
+    const double num = strtod(rate.c_str(), &end);
+    const double den = (*end == '/') ? strtod(end + 1, NULL) : 1;
+    return den != 0 ? float(num / den) : 0;
 }
+
+struct InfoCache {
+    struct Entry {
+        long long size;
+        long long mtime;
+        VideoInfo info;
+    };
+    std::mutex mutex;
+    std::map<std::string, Entry> entries;
+    std::string cache_file;
+    bool loaded = false;
+
+    static InfoCache& instance() {
+        static InfoCache cache;
+        return cache;
+    }
+
+    InfoCache() {
+        const char* env = getenv("FFMPEGCV_INFO_CACHE");
+        if (env) cache_file = env;
+    }
+
+    void load() {
+        // one entry per line: size mtime codec duration fps width height count is_complex path
+        loaded = true;
+        if (cache_file.empty()) return;
+        std::ifstream file(cache_file);
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            Entry entry;
+            VideoInfo& info = entry.info;
+            std::string path;
+            if (fields >> entry.size >> entry.mtime >> info.codec >> info.duration >> info.fps
+                    >> info.width >> info.height >> info.count >> info.is_complex
+                    && std::getline(fields >> std::ws, path)) {
+                if (info.codec == "-") info.codec = "";
+                entries[path] = entry;
+            }
+        }
+    }
+
+    void append(const std::string& path, const Entry& entry) {
+        if (cache_file.empty()) return;
+        const VideoInfo& info = entry.info;
+        std::ostringstream line;
+        line.precision(10);
+        line << entry.size << ' ' << entry.mtime << ' ' << (info.codec.empty() ? "-" : info.codec) << ' '
+             << info.duration << ' ' << info.fps << ' ' << info.width << ' ' << info.height << ' '
+             << info.count << ' ' << info.is_complex << ' ' << path << '\n';
+        std::ofstream file(cache_file, std::ios::app);
+        file << line.str();
+    }
+};
+
+std::string absolute_path(const std::string& filename) {
+#ifdef _WIN32
+    char resolved[_MAX_PATH];
+    if (_fullpath(resolved, filename.c_str(), _MAX_PATH)) return resolved;
+#else
+    char* resolved = realpath(filename.c_str(), NULL);
+    if (resolved) {
+        std::string path(resolved);
+        free(resolved);
+        return path;
+    }
 #endif
+    return filename;
+}
 
-bool VideoWriter::isOpened() const {
-    return process || waitInit;
+void set_info_cache_file(const std::string& cache_file) {
+    InfoCache& cache = InfoCache::instance();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.cache_file = cache_file;
+    cache.loaded = false;
 }
 
-VideoWriterNV::VideoWriterNV(): VideoWriter(){;}
+void clear_info_cache() {
+    InfoCache& cache = InfoCache::instance();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.entries.clear();
+    cache.loaded = true;  // keep the cache file, but do not read it back
+}
 
-VideoWriterNV::VideoWriterNV(const std::string& filename, const std::string& codec, double fps, Size_wh size_wh, int isColor,
-        std::string ffmpeg_output_opt, int gpu){
-    this->filename = filename;
-    this->codec = codec;
-    this->fps = fps;
-    this->size_wh = size_wh;
-    this->pix_fmt = isColor ? "bgr24" : "gray";
-    this->ffmpeg_output_opt = ffmpeg_output_opt;
-    this->gpu = gpu;
-    initializer();
+VideoInfo get_info(const std::string& filename) {
+    assert (file_exsits(filename) && "File does not exist");
+    long long size = 0, mtime = 0;
+    const bool cacheable = file_signature(filename, size, mtime);
+    const std::string path = cacheable ? absolute_path(filename) : filename;
+    InfoCache& cache = InfoCache::instance();
+    if (cacheable) {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        if (!cache.loaded) cache.load();
+        auto it = cache.entries.find(path);
+        if (it != cache.entries.end() && it->second.size == size && it->second.mtime == mtime) {
+            return it->second.info;
+        }
+    }
+
+    static const std::vector<std::string> complex_formats = {"mkv", "flv", "ts"};
+    const bool is_complex = std::find(complex_formats.begin(), complex_formats.end(),
+        get_file_extension(filename)) != complex_formats.end();
+
+    std::ostringstream cmd;
+    cmd << "ffprobe -v quiet -print_format json=compact=1 -select_streams v:0";
+    if (is_complex) cmd << " -count_packets";
+    cmd << " -show_streams \"" << filename << "\"";
+
+    const std::string json_output = execute_command(cmd.str());
+    VideoInfo info;
+    info.is_complex = is_complex;
+    info.codec = json_field(json_output, "codec_name");
+    info.width = atoi(json_field(json_output, "width").c_str());
+    info.height = atoi(json_field(json_output, "height").c_str());
+    info.count = atoi(json_field(json_output, is_complex ? "nb_read_packets" : "nb_frames").c_str());
+    info.duration = strtof(json_field(json_output, "duration").c_str(), nullptr);
+    info.fps = parse_frame_rate(json_field(json_output, "r_frame_rate"));
+
+    if (cacheable && info.width > 0) {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        InfoCache::Entry entry = {size, mtime, info};
+        cache.entries[path] = entry;
+        cache.append(path, entry);
+    }
+    return info;
+}
+
+VideoInfo get_info_stream(const std::string& filename, int timeout=0, int duration_ms=100){
+    std::string rtsp_opt = startsWith(filename, "rtsp://") ? "-rtsp_flags prefer_tcp -pkt_size 736 " : "";
+    std::string analyze_duration = " -analyzeduration " + std::to_string(duration_ms) + "000 ";
+    std::ostringstream cmd;
+    cmd << "ffprobe -v quiet -print_format json=compact=1 "
+        << rtsp_opt << analyze_duration
+        << " -select_streams v:0 -show_format -show_streams \""
+        << filename << "\"";
+
+    const std::string json_output = execute_command(cmd.str());
+    VideoInfo info;
+    info.codec = json_field(json_output, "codec_name");
+    info.width = atoi(json_field(json_output, "width").c_str());
+    info.height = atoi(json_field(json_output, "height").c_str());
+    info.fps = parse_frame_rate(json_field(json_output, "r_frame_rate"));
+    return info;
+}
+
+bool file_signature(const std::string& filename, long long& size, long long& mtime) {
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) return false;
+    size = (long long)st.st_size;
+    mtime = (long long)st.st_mtime;
+    return true;
+}
+
+int KeyframeIndex::keyframe_before(int iframe) const {
+    auto it = std::upper_bound(keyframes.begin(), keyframes.end(), iframe);
+    return it == keyframes.begin() ? 0 : *(it - 1);
+}
+
+int KeyframeIndex::frame_at(double seconds) const {
+    const double t = start_time + seconds - 1e-6;
+    return int(std::lower_bound(pts.begin(), pts.end(), t) - pts.begin());
+}
+
+double KeyframeIndex::seek_time(int keyframe) const {
+    // Aim half a frame past the keyframe: the demuxer lands on this keyframe
+    // and not on the previous one, whatever the rounding of pts_time.
+    const double half = keyframe + 1 < (int)pts.size() ? (pts[keyframe + 1] - pts[keyframe]) / 2 : 0.001;
+    return pts[keyframe] - start_time + half;
+}
+
+std::shared_ptr<const KeyframeIndex> get_keyframe_index(const std::string& filename) {
+    struct Entry {
+        long long size;
+        long long mtime;
+        std::shared_ptr<const KeyframeIndex> index;
+    };
+    static std::mutex mutex;
+    static std::map<std::string, Entry> cache;
+
+    long long size = 0, mtime = 0;
+    if (!file_signature(filename, size, mtime)) return nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = cache.find(filename);
+        if (it != cache.end() && it->second.size == size && it->second.mtime == mtime) {
+            return it->second.index;
+        }
+    }
+
+    std::ostringstream cmd;
+    cmd << "ffprobe -v quiet -select_streams v:0 -show_entries packet=pts_time,flags:format=start_time"
+        << " -of csv=p=0 \"" << filename << "\"";
+    std::istringstream lines(execute_command(cmd.str()));
+
+    // packet lines are "pts_time,flags", the format line is "start_time"
+    std::shared_ptr<KeyframeIndex> index = std::make_shared<KeyframeIndex>();
+    std::vector<std::pair<double, bool>> packets;
+    std::string line;
+    while (std::getline(lines, line)) {
+        const size_t comma = line.find(',');
+        char* end = NULL;
+        const double value = strtod(line.c_str(), &end);
+        if (end == line.c_str()) continue;  // N/A
+        if (comma == std::string::npos) {
+            index->start_time = value;
+        } else {
+            packets.push_back(std::make_pair(value, line.find('K', comma) != std::string::npos));
+        }
+    }
+    if (packets.empty()) return nullptr;
+    std::sort(packets.begin(), packets.end());
+    for (size_t i = 0; i < packets.size(); ++i) {
+        index->pts.push_back(packets[i].first);
+        if (packets[i].second) index->keyframes.push_back((int)i);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    cache[filename] = Entry{size, mtime, index};
+    return index;
+}
+//================ End Video info ==================
+
+//================ Begin Frame pool ==================
+
+FramePool::FramePool(size_t bytes_per_frame, bool hugepage): state(std::make_shared<State>()) {
+    const size_t align = hugepage ? (2 << 20) : 64;
+    state->bytes_per_frame = bytes_per_frame;
+    state->slot_bytes = (bytes_per_frame + align - 1) / align * align;
+    state->hugepage = hugepage;
+}
+
+uint8_t* FramePool::State::allocate() {
+    const size_t align = hugepage ? (2 << 20) : 64;
+    void* ptr = NULL;
+#ifdef _WIN32
+    ptr = _aligned_malloc(slot_bytes, align);
+#else
+    if (posix_memalign(&ptr, align, slot_bytes) != 0) ptr = NULL;
+#endif
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (ptr && hugepage) madvise(ptr, slot_bytes, MADV_HUGEPAGE);
+#endif
+    if (!ptr) throw std::bad_alloc();
+    allocated += 1;
+    return static_cast<uint8_t*>(ptr);
+}
+
+FramePool::State::~State() {
+    for (uint8_t* slot : free_slots) {
+#ifdef _WIN32
+        _aligned_free(slot);
+#else
+        free(slot);
+#endif
+    }
+}
+
+Frame FramePool::acquire() {
+    uint8_t* slot = NULL;
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (!state->free_slots.empty()) {
+            slot = state->free_slots.back();
+            state->free_slots.pop_back();
+        } else {
+            slot = state->allocate();
+        }
+    }
+    std::shared_ptr<State> owner = state;  // keeps the pool alive while frames are out
+    Frame frame;
+    frame.buffer = std::shared_ptr<uint8_t>(slot, [owner](uint8_t* ptr) {
+        std::lock_guard<std::mutex> lock(owner->mutex);
+        owner->free_slots.push_back(ptr);
+    });
+    frame.nbytes = state->bytes_per_frame;
+    return frame;
+}
+
+void FramePool::reserve(size_t nframes) {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    while (state->allocated < nframes) {
+        state->free_slots.push_back(state->allocate());
+    }
+}
+
+size_t FramePool::bytes_per_frame() const {
+    return state->bytes_per_frame;
+}
+
+size_t FramePool::allocated() const {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    return state->allocated;
+}
+
+//================ End Frame pool ==================
+
+//================ Begin I/O stats ==================
+
+void LatencyHistogram::add(int64_t nanoseconds) {
+    int index = 0;
+    if (nanoseconds > 0) {
+        int exponent;
+        double mantissa = std::frexp((double)nanoseconds, &exponent);  // [0.5, 1)
+        index = std::min(exponent * 4 + int((mantissa - 0.5) * 8), nbuckets - 1);
+    }
+    buckets[index]++;
+    samples++;
+}
+
+double LatencyHistogram::percentile(double p) const {
+    if (samples == 0) return 0;
+    const double rank = std::max(1.0, std::ceil(p / 100 * samples));
+    uint64_t seen = 0;
+    for (int index = 0; index < nbuckets; ++index) {
+        seen += buckets[index];
+        if (seen >= rank) {  // middle of the bucket
+            return std::ldexp(0.5 + (index % 4 + 0.5) / 8, index / 4) * 1e-9;
+        }
+    }
+    return 0;
+}
+
+void IOStats::add_frames(int n, size_t bytes_per_frame, Clock::time_point start, Clock::time_point end) {
+    if (n <= 0) return;
+    const int64_t blocked_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    if (frames == 0 && first_frame_seconds == 0) {
+        first_frame_seconds = std::chrono::duration<double>(end - open_time).count();
+    }
+    if (last_frame_time != Clock::time_point()) {
+        const double interval = std::chrono::duration<double>(end - last_frame_time).count() / n;
+        frame_interval = frame_interval > 0 ? frame_interval + (interval - frame_interval) / 8 : interval;
+        fps = frame_interval > 0 ? 1 / frame_interval : 0;
+    }
+    last_frame_time = end;
+    frames += n;
+    bytes += (uint64_t)n * bytes_per_frame;
+    blocked_seconds += blocked_ns * 1e-9;
+    for (int i = 0; i < n; ++i) blocked.add(blocked_ns / n);
+}
+
+void IOStats::reset_counters() {
+    frames = 0;
+    bytes = 0;
+    blocked_seconds = 0;
+    blocked = LatencyHistogram();
+    fps = 0;
+    frame_interval = 0;
+    last_frame_time = Clock::time_point();
+}
+
+double IOStats::blocked_p50() const {
+    return blocked.percentile(50);
+}
+
+double IOStats::blocked_p99() const {
+    return blocked.percentile(99);
+}
+
+std::string IOStats::to_json() const {
+    std::ostringstream json;
+    json << "\"probe_seconds\": " << probe_seconds << ", \"spawn_seconds\": " << spawn_seconds
+         << ", \"spawns\": " << spawns << ", \"first_frame_seconds\": " << first_frame_seconds
+         << ", \"frames\": " << frames << ", \"bytes\": " << bytes
+         << ", \"blocked_seconds\": " << blocked_seconds << ", \"blocked_p50_seconds\": " << blocked_p50()
+         << ", \"blocked_p99_seconds\": " << blocked_p99() << ", \"fps\": " << fps;
+    return json.str();
+}
+
+double seconds_since(IOStats::Clock::time_point start) {
+    return std::chrono::duration<double>(IOStats::Clock::now() - start).count();
+}
+
+void dump_stats(const std::string& stats_file, const std::string& kind, const std::string& filename,
+    const IOStats& stats) {
+    std::string path = stats_file;
+    if (path.empty()) {
+        const char* env = getenv("FFMPEGCV_STATS");
+        if (!env || !*env) return;
+        path = env;
+    }
+    std::string quoted;
+    for (char c : filename) {
+        if (c == '"' || c == '\\') quoted += '\\';
+        quoted += c;
+    }
+    const std::string line = "{\"" + kind + "\": \"" + quoted + "\", " + stats.to_json() + "}\n";
+    if (path == "-") {
+        std::cerr << line;
+    } else {
+        std::ofstream file(path, std::ios::app);
+        file << line;
+    }
+}
+
+//================ End I/O stats ==================
+
+//================ Begin Color conversion ==================
+
+ThreadPool::ThreadPool(int nthreads) {
+    if (nthreads <= 0) nthreads = std::max(1, (int)std::thread::hardware_concurrency());
+    for (int i = 1; i < nthreads; ++i) {
+        workers.push_back(std::thread(&ThreadPool::work, this));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    start.notify_all();
+    for (auto& worker : workers) worker.join();
+}
+
+int ThreadPool::size() const {
+    return (int)workers.size() + 1;
+}
+
+void ThreadPool::run(int nbands, const std::function<void(int)>& fn) {
+    if (workers.empty() || nbands <= 1) {
+        for (int band = 0; band < nbands; ++band) fn(band);
+        return;
+    }
+    std::lock_guard<std::mutex> run_lock(run_mutex);
+    std::unique_lock<std::mutex> lock(mutex);
+    job = &fn;
+    this->nbands = nbands;
+    next_band = 0;
+    unfinished = nbands;
+    start.notify_all();
+    while (next_band < this->nbands) {
+        const int band = next_band++;
+        lock.unlock();
+        fn(band);
+        lock.lock();
+        unfinished--;
+    }
+    done.wait(lock, [this] { return unfinished == 0; });
+    job = NULL;
+}
+
+void ThreadPool::work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        start.wait(lock, [this] { return stopping || next_band < nbands; });
+        if (stopping) return;
+        const int band = next_band++;
+        const std::function<void(int)>& fn = *job;
+        lock.unlock();
+        fn(band);
+        lock.lock();
+        if (--unfinished == 0) done.notify_all();
+    }
+}
+
+YUVCoefficients get_yuv_coefficients(int matrix, int range) {
+    const double kr = matrix == COLOR_BT709 ? 0.2126 : 0.299;
+    const double kb = matrix == COLOR_BT709 ? 0.0722 : 0.114;
+    const double kg = 1 - kr - kb;
+    const bool full = range == COLOR_RANGE_FULL;
+    const double y_scale = full ? 1.0 : 255.0 / 219.0;
+    const double uv_scale = full ? 1.0 : 255.0 / 224.0;
+    YUVCoefficients coef;
+    coef.y_offset = full ? 0 : 16;
+    coef.y = (int16_t)std::lround(64 * y_scale);
+    coef.vr = (int16_t)std::lround(64 * uv_scale * 2 * (1 - kr));
+    coef.ug = (int16_t)std::lround(64 * uv_scale * 2 * (1 - kb) * kb / kg);
+    coef.vg = (int16_t)std::lround(64 * uv_scale * 2 * (1 - kr) * kr / kg);
+    coef.ub = (int16_t)std::lround(64 * uv_scale * 2 * (1 - kb));
+    return coef;
+}
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+// Interleaves 16 pixels of three planes into 48 bytes c0 c1 c2 c0 c1 c2 ...
+void store_interleaved_sse(uint8_t* out, __m128i c0, __m128i c1, __m128i c2) {
+    struct Masks {
+        alignas(16) int8_t m[3][3][16];  // [output block][channel][byte]
+        Masks() {
+            for (int i = 0; i < 48; ++i) {
+                for (int c = 0; c < 3; ++c) {
+                    m[i / 16][c][i % 16] = i % 3 == c ? (int8_t)(i / 3) : (int8_t)0x80;
+                }
+            }
+        }
+    };
+    static const Masks masks;
+    const __m128i planes[3] = {c0, c1, c2};
+    for (int k = 0; k < 3; ++k) {
+        __m128i block = _mm_setzero_si128();
+        for (int c = 0; c < 3; ++c) {
+            const __m128i mask = _mm_load_si128(reinterpret_cast<const __m128i*>(masks.m[k][c]));
+            block = _mm_or_si128(block, _mm_shuffle_epi8(planes[c], mask));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 16 * k), block);
+    }
+}
+#endif
+
+void yuv420p_to_rgb_rows(const uint8_t* yuv, uint8_t* dst, int width, int height,
+    int row_begin, int row_end, const YUVCoefficients& coef, bool bgr) {
+    const uint8_t* u_plane = yuv + (size_t)width * height;
+    const uint8_t* v_plane = u_plane + (size_t)(width / 2) * (height / 2);
+    for (int row = row_begin; row < row_end; ++row) {
+        const uint8_t* y_row = yuv + (size_t)row * width;
+        const uint8_t* u_row = u_plane + (size_t)(row / 2) * (width / 2);
+        const uint8_t* v_row = v_plane + (size_t)(row / 2) * (width / 2);
+        uint8_t* out = dst + (size_t)row * width * 3;
+        int x = 0;
+#if defined(__AVX2__)
+        {
+            const __m256i y_offset = _mm256_set1_epi16(coef.y_offset), y_coef = _mm256_set1_epi16(coef.y);
+            const __m256i vr = _mm256_set1_epi16(coef.vr), ug = _mm256_set1_epi16(coef.ug);
+            const __m256i vg = _mm256_set1_epi16(coef.vg), ub = _mm256_set1_epi16(coef.ub);
+            const __m256i c128 = _mm256_set1_epi16(128), c32 = _mm256_set1_epi16(32);
+            for (; x + 32 <= width; x += 32) {
+                const __m128i* y_src = reinterpret_cast<const __m128i*>(y_row + x);
+                const __m256i u = _mm256_sub_epi16(_mm256_cvtepu8_epi16(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(u_row + x / 2))), c128);
+                const __m256i v = _mm256_sub_epi16(_mm256_cvtepu8_epi16(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(v_row + x / 2))), c128);
+                // each chroma sample covers two pixels; unpack works per 128-bit lane
+                const __m256i u_a = _mm256_unpacklo_epi16(u, u), u_b = _mm256_unpackhi_epi16(u, u);
+                const __m256i v_a = _mm256_unpacklo_epi16(v, v), v_b = _mm256_unpackhi_epi16(v, v);
+                const __m256i us[2] = {_mm256_permute2x128_si256(u_a, u_b, 0x20),
+                                       _mm256_permute2x128_si256(u_a, u_b, 0x31)};
+                const __m256i vs[2] = {_mm256_permute2x128_si256(v_a, v_b, 0x20),
+                                       _mm256_permute2x128_si256(v_a, v_b, 0x31)};
+                __m256i r[2], g[2], b[2];
+                for (int h = 0; h < 2; ++h) {
+                    const __m256i y = _mm256_cvtepu8_epi16(_mm_loadu_si128(y_src + h));
+                    const __m256i yy = _mm256_add_epi16(
+                        _mm256_mullo_epi16(_mm256_sub_epi16(y, y_offset), y_coef), c32);
+                    r[h] = _mm256_srai_epi16(_mm256_adds_epi16(yy, _mm256_mullo_epi16(vs[h], vr)), 6);
+                    g[h] = _mm256_srai_epi16(_mm256_subs_epi16(_mm256_subs_epi16(
+                        yy, _mm256_mullo_epi16(us[h], ug)), _mm256_mullo_epi16(vs[h], vg)), 6);
+                    b[h] = _mm256_srai_epi16(_mm256_adds_epi16(yy, _mm256_mullo_epi16(us[h], ub)), 6);
+                }
+                // packus also works per lane, restore the pixel order afterwards
+                const __m256i R = _mm256_permute4x64_epi64(_mm256_packus_epi16(r[0], r[1]), 0xD8);
+                const __m256i G = _mm256_permute4x64_epi64(_mm256_packus_epi16(g[0], g[1]), 0xD8);
+                const __m256i B = _mm256_permute4x64_epi64(_mm256_packus_epi16(b[0], b[1]), 0xD8);
+                const __m256i first = bgr ? B : R, third = bgr ? R : B;
+                store_interleaved_sse(out + 3 * x, _mm256_castsi256_si128(first),
+                    _mm256_castsi256_si128(G), _mm256_castsi256_si128(third));
+                store_interleaved_sse(out + 3 * x + 48, _mm256_extracti128_si256(first, 1),
+                    _mm256_extracti128_si256(G, 1), _mm256_extracti128_si256(third, 1));
+            }
+        }
+#endif
+#if defined(__AVX2__) || defined(__SSE4_1__)
+        {
+            const __m128i y_offset = _mm_set1_epi16(coef.y_offset), y_coef = _mm_set1_epi16(coef.y);
+            const __m128i vr = _mm_set1_epi16(coef.vr), ug = _mm_set1_epi16(coef.ug);
+            const __m128i vg = _mm_set1_epi16(coef.vg), ub = _mm_set1_epi16(coef.ub);
+            const __m128i c128 = _mm_set1_epi16(128), c32 = _mm_set1_epi16(32);
+            for (; x + 16 <= width; x += 16) {
+                const __m128i y8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y_row + x));
+                const __m128i u = _mm_sub_epi16(_mm_cvtepu8_epi16(
+                    _mm_loadl_epi64(reinterpret_cast<const __m128i*>(u_row + x / 2))), c128);
+                const __m128i v = _mm_sub_epi16(_mm_cvtepu8_epi16(
+                    _mm_loadl_epi64(reinterpret_cast<const __m128i*>(v_row + x / 2))), c128);
+                const __m128i us[2] = {_mm_unpacklo_epi16(u, u), _mm_unpackhi_epi16(u, u)};
+                const __m128i vs[2] = {_mm_unpacklo_epi16(v, v), _mm_unpackhi_epi16(v, v)};
+                const __m128i ys[2] = {_mm_cvtepu8_epi16(y8), _mm_cvtepu8_epi16(_mm_srli_si128(y8, 8))};
+                __m128i r[2], g[2], b[2];
+                for (int h = 0; h < 2; ++h) {
+                    const __m128i yy = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(ys[h], y_offset), y_coef), c32);
+                    r[h] = _mm_srai_epi16(_mm_adds_epi16(yy, _mm_mullo_epi16(vs[h], vr)), 6);
+                    g[h] = _mm_srai_epi16(_mm_subs_epi16(_mm_subs_epi16(
+                        yy, _mm_mullo_epi16(us[h], ug)), _mm_mullo_epi16(vs[h], vg)), 6);
+                    b[h] = _mm_srai_epi16(_mm_adds_epi16(yy, _mm_mullo_epi16(us[h], ub)), 6);
+                }
+                const __m128i R = _mm_packus_epi16(r[0], r[1]);
+                const __m128i G = _mm_packus_epi16(g[0], g[1]);
+                const __m128i B = _mm_packus_epi16(b[0], b[1]);
+                store_interleaved_sse(out + 3 * x, bgr ? B : R, G, bgr ? R : B);
+            }
+        }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+        {
+            const int16x8_t y_offset = vdupq_n_s16(coef.y_offset), y_coef = vdupq_n_s16(coef.y);
+            const int16x8_t vr = vdupq_n_s16(coef.vr), ug = vdupq_n_s16(coef.ug);
+            const int16x8_t vg = vdupq_n_s16(coef.vg), ub = vdupq_n_s16(coef.ub);
+            const int16x8_t c128 = vdupq_n_s16(128), c32 = vdupq_n_s16(32);
+            for (; x + 16 <= width; x += 16) {
+                const uint8x16_t y8 = vld1q_u8(y_row + x);
+                const int16x8_t u = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(u_row + x / 2))), c128);
+                const int16x8_t v = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(v_row + x / 2))), c128);
+                const int16x8x2_t us = vzipq_s16(u, u);
+                const int16x8x2_t vs = vzipq_s16(v, v);
+                const int16x8_t ys[2] = {vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(y8))),
+                                         vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(y8)))};
+                uint8x8_t r[2], g[2], b[2];
+                for (int h = 0; h < 2; ++h) {
+                    const int16x8_t yy = vaddq_s16(vmulq_s16(vsubq_s16(ys[h], y_offset), y_coef), c32);
+                    r[h] = vqshrun_n_s16(vqaddq_s16(yy, vmulq_s16(vs.val[h], vr)), 6);
+                    g[h] = vqshrun_n_s16(vqsubq_s16(vqsubq_s16(
+                        yy, vmulq_s16(us.val[h], ug)), vmulq_s16(vs.val[h], vg)), 6);
+                    b[h] = vqshrun_n_s16(vqaddq_s16(yy, vmulq_s16(us.val[h], ub)), 6);
+                }
+                uint8x16x3_t pixels;
+                pixels.val[0] = bgr ? vcombine_u8(b[0], b[1]) : vcombine_u8(r[0], r[1]);
+                pixels.val[1] = vcombine_u8(g[0], g[1]);
+                pixels.val[2] = bgr ? vcombine_u8(r[0], r[1]) : vcombine_u8(b[0], b[1]);
+                vst3q_u8(out + 3 * x, pixels);
+            }
+        }
+#endif
+        for (; x < width; ++x) {
+            const int yy = (y_row[x] - coef.y_offset) * coef.y + 32;
+            const int u = u_row[x / 2] - 128;
+            const int v = v_row[x / 2] - 128;
+            const int r = std::min(255, std::max(0, (yy + coef.vr * v) >> 6));
+            const int g = std::min(255, std::max(0, (yy - coef.ug * u - coef.vg * v) >> 6));
+            const int b = std::min(255, std::max(0, (yy + coef.ub * u) >> 6));
+            out[3 * x] = (uint8_t)(bgr ? b : r);
+            out[3 * x + 1] = (uint8_t)g;
+            out[3 * x + 2] = (uint8_t)(bgr ? r : b);
+        }
+    }
+}
+
+YUVConverter::YUVConverter(int width, int height, const std::string& pix_fmt, int nthreads,
+    int matrix, int range):
+    width(width), height(height), pix_fmt(pix_fmt),
+    coef(get_yuv_coefficients(matrix, range)), pool(std::make_shared<ThreadPool>(nthreads)) {
+    assert(supports(pix_fmt));
+    assert(width % 2 == 0 && height % 2 == 0);
+}
+
+bool YUVConverter::supports(const std::string& pix_fmt) {
+    return pix_fmt == "bgr24" || pix_fmt == "rgb24" || pix_fmt == "gray";
+}
+
+size_t YUVConverter::input_size() const {
+    return (size_t)width * height * 3 / 2;
+}
+
+std::string YUVConverter::input_pix_fmt() const {
+    return "yuv420p";
+}
+
+size_t YUVConverter::output_size() const {
+    return (size_t)width * height * (pix_fmt == "gray" ? 1 : 3);
+}
+
+void YUVConverter::convert(const uint8_t* yuv, uint8_t* dst) {
+    if (pix_fmt == "gray") {
+        memcpy(dst, yuv, (size_t)width * height);  // the Y plane, as extractplanes=y gives
+        return;
+    }
+    const bool bgr = pix_fmt == "bgr24";
+    const int nbands = std::min(pool->size(), height);
+    pool->run(nbands, [&](int band) {
+        yuv420p_to_rgb_rows(yuv, dst, width, height,
+            height * band / nbands, height * (band + 1) / nbands, coef, bgr);
+    });
+}
+
+uint16_t float_to_half(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    const uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    const int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+    if (((bits >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);  // inf, nan
+    if (exponent >= 31) return sign | 0x7c00;
+    if (exponent <= 0) {  // subnormal
+        if (exponent < -10) return sign;
+        mantissa |= 0x800000;
+        const int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        const uint32_t rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) half++;
+        return sign | (uint16_t)half;
+    }
+    uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+    const uint32_t rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;  // a carry rounds up the exponent
+    return sign | (uint16_t)half;
+}
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+// Channel c of 16 rgb24 pixels, gathered from the three 16-byte blocks that hold them.
+__m128i load_channel_sse(const __m128i blocks[3], int c) {
+    struct Masks {
+        alignas(16) int8_t m[3][3][16];  // [channel][input block][byte]
+        Masks() {
+            for (int ch = 0; ch < 3; ++ch) {
+                for (int i = 0; i < 48; ++i) {
+                    const int b = 3 * (i % 16) + ch;  // pixel i % 16 of block i / 16
+                    m[ch][i / 16][i % 16] = b / 16 == i / 16 ? (int8_t)(b % 16) : (int8_t)0x80;
+                }
+            }
+        }
+    };
+    static const Masks masks;
+    __m128i bytes = _mm_setzero_si128();
+    for (int k = 0; k < 3; ++k) {
+        const __m128i mask = _mm_load_si128(reinterpret_cast<const __m128i*>(masks.m[c][k]));
+        bytes = _mm_or_si128(bytes, _mm_shuffle_epi8(blocks[k], mask));
+    }
+    return bytes;
+}
+#endif
+
+void rgb24_to_planar_rows(const uint8_t* src, uint8_t* dst, int width, int height, int row_begin, int row_end,
+    const float scale[3], const float offset[3], bool bgr, bool half) {
+    const size_t plane = (size_t)width * height;
+    const size_t element = half ? 2 : 4;
+    for (int row = row_begin; row < row_end; ++row) {
+        const uint8_t* in = src + (size_t)row * width * 3;
+        float* out32[3];
+        uint16_t* out16[3];
+        for (int c = 0; c < 3; ++c) {
+            uint8_t* out = dst + (c * plane + (size_t)row * width) * element;
+            out32[c] = reinterpret_cast<float*>(out);
+            out16[c] = reinterpret_cast<uint16_t*>(out);
+        }
+        int x = 0;
+#if defined(__AVX2__)
+#if !defined(__F16C__)
+        if (!half)
+#endif
+        {
+            const __m256 scales[3] = {_mm256_set1_ps(scale[0]), _mm256_set1_ps(scale[1]), _mm256_set1_ps(scale[2])};
+            const __m256 offsets[3] = {_mm256_set1_ps(offset[0]), _mm256_set1_ps(offset[1]), _mm256_set1_ps(offset[2])};
+            for (; x + 16 <= width; x += 16) {
+                const __m128i* block = reinterpret_cast<const __m128i*>(in + 3 * x);
+                const __m128i blocks[3] = {_mm_loadu_si128(block), _mm_loadu_si128(block + 1), _mm_loadu_si128(block + 2)};
+                for (int c = 0; c < 3; ++c) {
+                    const __m128i bytes = load_channel_sse(blocks, bgr ? 2 - c : c);
+                    const __m128i halves[2] = {bytes, _mm_srli_si128(bytes, 8)};
+                    for (int h = 0; h < 2; ++h) {
+                        const __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(halves[h]));
+#ifdef __FMA__
+                        const __m256 y = _mm256_fmadd_ps(v, scales[c], offsets[c]);
+#else
+                        const __m256 y = _mm256_add_ps(_mm256_mul_ps(v, scales[c]), offsets[c]);
+#endif
+#ifdef __F16C__
+                        if (half) {
+                            _mm_storeu_si128(reinterpret_cast<__m128i*>(out16[c] + x + 8 * h),
+                                _mm256_cvtps_ph(y, _MM_FROUND_TO_NEAREST_INT));
+                            continue;
+                        }
+#endif
+                        _mm256_storeu_ps(out32[c] + x + 8 * h, y);
+                    }
+                }
+            }
+        }
+#elif defined(__SSE4_1__)
+        if (!half) {
+            for (; x + 16 <= width; x += 16) {
+                const __m128i* block = reinterpret_cast<const __m128i*>(in + 3 * x);
+                const __m128i blocks[3] = {_mm_loadu_si128(block), _mm_loadu_si128(block + 1), _mm_loadu_si128(block + 2)};
+                for (int c = 0; c < 3; ++c) {
+                    const __m128i bytes = load_channel_sse(blocks, bgr ? 2 - c : c);
+                    const __m128i quarters[4] = {bytes, _mm_srli_si128(bytes, 4), _mm_srli_si128(bytes, 8),
+                                                 _mm_srli_si128(bytes, 12)};
+                    const __m128 s = _mm_set1_ps(scale[c]), o = _mm_set1_ps(offset[c]);
+                    for (int q = 0; q < 4; ++q) {
+                        const __m128 v = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(quarters[q]));
+                        _mm_storeu_ps(out32[c] + x + 4 * q, _mm_add_ps(_mm_mul_ps(v, s), o));
+                    }
+                }
+            }
+        }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#if !defined(__aarch64__)
+        if (!half)
+#endif
+        {
+            for (; x + 16 <= width; x += 16) {
+                const uint8x16x3_t pixels = vld3q_u8(in + 3 * x);  // deinterleaves the channels
+                for (int c = 0; c < 3; ++c) {
+                    const uint8x16_t bytes = pixels.val[bgr ? 2 - c : c];
+                    const uint16x8_t words[2] = {vmovl_u8(vget_low_u8(bytes)), vmovl_u8(vget_high_u8(bytes))};
+                    const float32x4_t s = vdupq_n_f32(scale[c]), o = vdupq_n_f32(offset[c]);
+                    for (int q = 0; q < 4; ++q) {
+                        const uint16x4_t w = q % 2 ? vget_high_u16(words[q / 2]) : vget_low_u16(words[q / 2]);
+                        const float32x4_t y = vmlaq_f32(o, vcvtq_f32_u32(vmovl_u16(w)), s);
+#if defined(__aarch64__)
+                        if (half) {
+                            vst1_u16(out16[c] + x + 4 * q, vreinterpret_u16_f16(vcvt_f16_f32(y)));
+                            continue;
+                        }
+#endif
+                        vst1q_f32(out32[c] + x + 4 * q, y);
+                    }
+                }
+            }
+        }
+#endif
+        for (; x < width; ++x) {
+            for (int c = 0; c < 3; ++c) {
+                const float y = in[3 * x + (bgr ? 2 - c : c)] * scale[c] + offset[c];
+                if (half) {
+                    out16[c][x] = float_to_half(y);
+                } else {
+                    out32[c][x] = y;
+                }
+            }
+        }
+    }
+}
+
+TensorConverter::TensorConverter(int width, int height, const std::string& pix_fmt,
+    const std::vector<float>& mean, const std::vector<float>& stddev, float scale):
+    width(width), height(height), pix_fmt(pix_fmt) {
+    assert(supports(pix_fmt));
+    if (!valid_normalization(mean, stddev)) {
+        throw std::invalid_argument("TensorConverter: mean and stddev need 1 or 3 values, stddev finite and non-zero");
+    }
+    for (int c = 0; c < 3; ++c) {
+        // (in * scale - mean) / std as one multiply-add
+        const float m = mean[mean.size() == 3 ? c : 0];
+        const float s = stddev[stddev.size() == 3 ? c : 0];
+        this->scale[c] = scale / s;
+        offset[c] = -m / s;
+    }
+}
+
+bool TensorConverter::supports(const std::string& pix_fmt) {
+    return pix_fmt == "rgb_chw_f32" || pix_fmt == "bgr_chw_f32" || pix_fmt == "rgb_chw_f16" || pix_fmt == "bgr_chw_f16";
+}
+
+bool TensorConverter::valid_normalization(const std::vector<float>& mean, const std::vector<float>& stddev) {
+    if ((mean.size() != 1 && mean.size() != 3) || (stddev.size() != 1 && stddev.size() != 3)) return false;
+    for (float s : stddev) {
+        if (s == 0 || !std::isfinite(s)) return false;
+    }
+    return true;
+}
+
+size_t TensorConverter::input_size() const {
+    return (size_t)width * height * 3;
+}
+
+size_t TensorConverter::output_size() const {
+    return (size_t)width * height * 3 * (pix_fmt.compare(8, 3, "f16") == 0 ? 2 : 4);
+}
+
+std::string TensorConverter::input_pix_fmt() const {
+    return "rgb24";
+}
+
+void TensorConverter::convert(const uint8_t* rgb, uint8_t* dst) {
+    rgb24_to_planar_rows(rgb, dst, width, height, 0, height, scale, offset,
+        pix_fmt.compare(0, 3, "bgr") == 0, pix_fmt.compare(8, 3, "f16") == 0);
+}
+
+//================ End Color conversion ==================
+
+//================ Begin Frame queue ==================
+
+FramePrefetcher::FramePrefetcher(PipeProcess* process, FramePool pool, int nframes, int output,
+    std::shared_ptr<FrameConverter> converter, bool latest_only):
+    process(process), pool(pool), output(output), converter(converter), ready_frames(nframes),
+    latest_only(latest_only) {
+    this->pool.reserve(latest_only ? 3 : nframes + 1);
+    worker = std::thread(&FramePrefetcher::run, this);
+}
+
+FramePrefetcher::~FramePrefetcher() {
+    stop();
+}
+
+void FramePrefetcher::run() {
+    std::vector<uint8_t> yuv(converter ? converter->input_size() : 0);
+    while (true) {
+        Frame frame = pool.acquire();
+        if (converter) {
+            size_t bytesRead = process->read(yuv.data(), yuv.size(), output);
+            if (bytesRead != yuv.size()) break;
+            converter->convert(yuv.data(), frame.data());
+        } else {
+            size_t bytesRead = process->read(frame.data(), frame.size(), output);
+            if (bytesRead != frame.size()) break;
+        }
+        if (latest_only) {
+            std::lock_guard<std::mutex> lock(latest_mutex);
+            if (finished) break;
+            latest = frame;  // an unread older frame goes back to the pool
+            latest_index++;
+            latest_ready.notify_one();
+        } else if (!ready_frames.push(frame)) {
+            break;
+        }
+    }
+    ready_frames.close();
+    std::lock_guard<std::mutex> lock(latest_mutex);
+    finished = true;
+    latest_ready.notify_all();
+}
+
+bool FramePrefetcher::next(Frame& frame) {
+    if (!latest_only) {
+        return ready_frames.pop(frame);
+    }
+    std::unique_lock<std::mutex> lock(latest_mutex);
+    latest_ready.wait(lock, [this] { return finished || latest_index > taken_index; });
+    if (latest_index == taken_index) return false;
+    frame = latest;
+    latest = Frame();
+    skipped += latest_index - taken_index - 1;
+    taken_index = latest_index;
+    return true;
+}
+
+void FramePrefetcher::stop() {
+    ready_frames.close();
+    {
+        std::lock_guard<std::mutex> lock(latest_mutex);
+        finished = true;
+        latest_ready.notify_all();
+    }
+    if (worker.joinable()) worker.join();
+}
+
+FrameFeeder::FrameFeeder(PipeProcess* process, int nframes):
+    process(process), queue(nframes) {
+    worker = std::thread(&FrameFeeder::run, this);
+}
+
+FrameFeeder::~FrameFeeder() {
+    stop();
+}
+
+void FrameFeeder::run() {
+    Frame frame;
+    while (queue.pop(frame)) {
+        const bool ok = process->write(frame.data(), frame.size()) == frame.size();
+        frame = Frame();  // back to its pool before we report progress
+        std::lock_guard<std::mutex> lock(mutex);
+        pending -= 1;
+        if (!ok) {
+            failed = true;  // encoder is gone, stop accepting frames
+            queue.close();
+        }
+        drained.notify_all();
+        if (!ok) break;
+    }
+}
+
+bool FrameFeeder::push(const Frame& frame, int backpressure) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (failed) return false;
+        pending += 1;
+    }
+    bool dropped_oldest = false;
+    bool ok = false;
+    if (backpressure == WRITE_FAIL) {
+        ok = queue.try_push(frame);
+    } else if (backpressure == WRITE_DROP_OLDEST) {
+        ok = queue.push_drop_oldest(frame, dropped_oldest);
+    } else {
+        ok = queue.push(frame);
+    }
+    if (!ok || dropped_oldest) {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending -= 1;
+        dropped += 1;
+        drained.notify_all();
+    }
+    return ok;
+}
+
+void FrameFeeder::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    drained.wait(lock, [this] { return pending == 0 || failed; });
+    if (!failed) process->flush();
+}
+
+void FrameFeeder::stop() {
+    queue.close();
+    if (worker.joinable()) worker.join();
+}
+
+//================ End Frame queue ==================
+
+//================ Begin Video Writer ==================
+
+std::vector<int> get_outnumpyshape(Size_wh size_wh, std::string pix_fmt) {
+    if (pix_fmt == "bgr24" || pix_fmt == "rgb24") {
+        return {size_wh.height, size_wh.width, 3};
+    } else if (pix_fmt == "gray") {
+        return {size_wh.height, size_wh.width};
+    } else if (pix_fmt == "yuv420p" || pix_fmt == "yuvj420p" || pix_fmt == "nv12") {
+        return {size_wh.height * 3 / 2, size_wh.width};
+    } else if (TensorConverter::supports(pix_fmt)) {
+        return {3, size_wh.height, size_wh.width};
+    } else {
+        assert(false && "pix_fmt not supported");
+        return {0, 0};
+    }
+}
+
+std::string get_outdtype(const std::string& pix_fmt) {
+    if (TensorConverter::supports(pix_fmt)) return pix_fmt.compare(8, 3, "f16") == 0 ? "float16" : "float32";
+    return "uint8";
+}
+
+int get_dtype_bytes(const std::string& dtype) {
+    return dtype == "float32" ? 4 : dtype == "float16" ? 2 : 1;
+}
+
+void ProgressTracker::parse_line(const std::string& line) {
+    const size_t eq = line.find('=');
+    if (eq == std::string::npos || eq == 0 ||
+        line.find_first_not_of("abcdefghijklmnopqrstuvwxyz0123456789_") != eq) {
+        if (!line.empty()) std::cerr << line << std::endl;  // a warning, as -loglevel warning would show
+        return;
+    }
+    const std::string key = line.substr(0, eq);
+    const std::string value = line.substr(eq + 1);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (key == "frame") {
+        block.frames = atoll(value.c_str());
+    } else if (key == "fps") {
+        block.fps = atof(value.c_str());
+    } else if (key == "out_time_us") {
+        block.out_seconds = std::max(0.0, atof(value.c_str()) * 1e-6);  // "N/A" before the first packet
+    } else if (key == "speed") {
+        block.speed = atof(value.c_str());  // "1.23x"
+    } else if (key == "progress") {
+        // the block is complete
+        block.ended = value == "end";
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (first_out_seconds < 0) {
+            if (block.out_seconds > 0) {
+                first_out_seconds = block.out_seconds;
+                first_report = now;
+            }
+        } else {
+            const double elapsed = std::chrono::duration<double>(now - first_report).count();
+            if (elapsed > 0) block.recent_speed = (block.out_seconds - first_out_seconds) / elapsed;
+        }
+        latest = block;
+    }
+}
+
+EncoderProgress ProgressTracker::get() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return latest;
+}
+
+VideoWriter::VideoWriter(){;}
+
+VideoWriter::VideoWriter(const std::string& filename, const std::string& codec, double fps, Size_wh size_wh, int isColor,
+    std::string ffmpeg_output_opt):
+    filename(filename), codec(codec), fps(fps), size_wh(size_wh), pix_fmt(isColor ? "bgr24" : "gray"), ffmpeg_output_opt(ffmpeg_output_opt)
+    {
+    initializer();
+}
+
+
+VideoWriter::VideoWriter(const std::string& filename, const std::string& codec, double fps, Size_wh size_wh, std::string pix_fmt,
+    std::string ffmpeg_output_opt):
+    filename(filename), codec(codec), fps(fps), size_wh(size_wh), pix_fmt(pix_fmt), ffmpeg_output_opt(ffmpeg_output_opt)
+    {
+    initializer();
+}
+
+void VideoWriter::initializer(){
+    io_stats = IOStats();
+    codec = codec.empty() ? "h264" : codec;
+    width = size_wh.width;
+    height = size_wh.height;
+    process.reset();
+    ffmpeg_cmd = compose_cmd(filename);
+    std::cout << "ffmpeg_cmd: " << ffmpeg_cmd << std::endl;
+
+    innumpyshape = get_outnumpyshape(size_wh, pix_fmt);
+    bytes_per_frame = 1;
+    for (int num : innumpyshape) {
+        bytes_per_frame *= num;
+    }
+}
+
+std::string VideoWriter::compose_cmd(const std::string& output, const std::string& extra_opt) {
+    std::string rtsp_str = startsWith(output, "rtsp://") ? " -f rtsp -rtsp_transport tcp " : " ";
+    std::ostringstream oss;
+    oss << "ffmpeg -y -loglevel warning -f rawvideo -pix_fmt " << pix_fmt
+        << " -s " << width << "x" << height << " -r " << fps
+        << " -i pipe: -c:v " << codec << " -pix_fmt " << output_pix_fmt
+        << ffmpeg_output_opt << (extra_opt.empty() ? "" : " " + extra_opt) << rtsp_str << " \"" << output << "\"";
+    return oss.str();
+}
+
+VideoWriter::~VideoWriter() {
+    release();
+}
+
+void VideoWriter::release() {
+    if (feeder) {
+        feeder->flush();
+        feeder->stop();  // join the writer thread before its pipe is closed
+        feeder.reset();
+    }
+    if (process) {
+        process->close();
+        process.reset();
+        dump_stats(stats_file, "writer", filename, io_stats);
+    }
+}
+
+void VideoWriter::close() {
+    release();
+}
+
+void VideoWriter::flush() {
+    if (feeder) {
+        feeder->flush();
+    } else if (process) {
+        process->flush();
+    }
+}
+
+FramePool& VideoWriter::getFramePool() {
+    if (frame_pool.bytes_per_frame() != (size_t)bytes_per_frame) {
+        frame_pool = FramePool(bytes_per_frame);
+    }
+    return frame_pool;
+}
+
+void VideoWriter::open_process() {
+    IOStats::Clock::time_point start = IOStats::Clock::now();
+    std::string cmd = ffmpeg_cmd;
+    const bool with_progress = track_progress && !use_popen;
+    if (with_progress) cmd.insert(cmd.find(' '), " -progress pipe:2 -stats_period 0.5");
+    process = open_pipe_process(cmd, "w", pipe_size > 0 ? pipe_size : bytes_per_frame, use_popen, with_progress);
+    io_stats.spawn_seconds += seconds_since(start);
+    io_stats.spawns++;
+    waitInit = false;
+    if (process && with_progress) {
+        std::shared_ptr<ProgressTracker> tracker = std::make_shared<ProgressTracker>();
+        process->forward_stderr([tracker](const std::string& line) { tracker->parse_line(line); });
+        progress = tracker;
+    }
+    if (process && async_frames > 0) {
+        feeder = std::make_shared<FrameFeeder>(process.get(), async_frames);
+    }
+}
+
+bool VideoWriter::write(const Frame& frame) {
+    assert(frame.empty() || frame.size() == (size_t)bytes_per_frame);
+    if (waitInit){
+        open_process();
+    }
+    if (feeder && !frame.empty()) {
+        // queue a reference, the caller must not modify the frame afterwards
+        IOStats::Clock::time_point start = IOStats::Clock::now();
+        bool success = feeder->push(frame, backpressure);
+        if (success) io_stats.add_frames(1, bytes_per_frame, start, IOStats::Clock::now());
+        dropped_frames = feeder->dropped;
+        return success;
+    }
+    return write(static_cast<const void*>(frame.data()));
+}
+
+bool VideoWriter::write(const void* frame) {
+    if (waitInit){
+        open_process();
+    }
+    if (frame == NULL) return false;
+    if (!process) {
+        std::cerr << "Failed to open video writer";
+        return false;
+    }
+    if (feeder) {
+        Frame copy = getFramePool().acquire();
+        memcpy(copy.data(), frame, bytes_per_frame);
+        IOStats::Clock::time_point start = IOStats::Clock::now();
+        bool success = feeder->push(copy, backpressure);
+        if (success) io_stats.add_frames(1, bytes_per_frame, start, IOStats::Clock::now());
+        dropped_frames = feeder->dropped;
+        return success;
+    }
+    IOStats::Clock::time_point start = IOStats::Clock::now();
+    bool success = process->write(frame, bytes_per_frame) == (size_t)bytes_per_frame;
+    if (success) io_stats.add_frames(1, bytes_per_frame, start, IOStats::Clock::now());
+    return success;
+}
+
+#ifdef OPENCV_CORE_TYPES_HPP
+bool VideoWriter::write(cv::Mat& frame) {
+    return write(frame.data);
+}
+#endif
+
+bool VideoWriter::isOpened() const {
+    return process != nullptr || waitInit;
+}
+
+IOStats VideoWriter::get_stats() const {
+    return io_stats;
+}
+
+void VideoWriter::reset_stats() {
+    io_stats.reset_counters();
+}
+
+EncoderProgress VideoWriter::get_progress() const {
+    return progress ? progress->get() : EncoderProgress();
+}
+
+std::string segment_path(const std::string& filename, int index) {
+    char part[32];
+    snprintf(part, sizeof(part), ".part%05d.", index);
+    return filename + part + get_file_extension(filename);
+}
+
+bool write_concat_list(const std::string& list_path, const std::vector<std::string>& paths) {
+    std::ofstream list(list_path);
+    for (const std::string& path : paths) {
+        const size_t slash = path.find_last_of("/\\");
+        std::string quoted;
+        for (char c : slash == std::string::npos ? path : path.substr(slash + 1)) {
+            quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+        }
+        list << "file '" << quoted << "'\n";
+    }
+    return list.good();
+}
+
+bool concat_segments(const std::string& filename, int nsegments) {
+    // the list sits next to the segments
+    const std::string list_path = filename + ".parts.txt";
+    std::vector<std::string> names;
+    for (int k = 0; k < nsegments; ++k) names.push_back(segment_path(filename, k));
+    if (!write_concat_list(list_path, names)) return false;
+    std::remove(filename.c_str());
+    execute_command("ffmpeg -y -loglevel warning -f concat -safe 0 -i \"" + list_path +
+        "\" -map 0 -c copy \"" + filename + "\"");
+    std::remove(list_path.c_str());
+    return file_exsits(filename);
+}
+
+ParallelVideoWriter::ParallelVideoWriter(): VideoWriter(){;}
+
+ParallelVideoWriter::ParallelVideoWriter(const std::string& filename, const std::string& codec, double fps,
+    Size_wh size_wh, int nencoders, int isColor, std::string ffmpeg_output_opt){
+    this->filename = filename;
+    this->codec = codec;
+    this->fps = fps;
+    this->size_wh = size_wh;
+    this->nencoders = nencoders;
+    this->pix_fmt = isColor ? "bgr24" : "gray";
+    this->ffmpeg_output_opt = ffmpeg_output_opt;
+    initializer();
+}
+
+ParallelVideoWriter::ParallelVideoWriter(const std::string& filename, const std::string& codec, double fps,
+    Size_wh size_wh, int nencoders, std::string pix_fmt, std::string ffmpeg_output_opt){
+    this->filename = filename;
+    this->codec = codec;
+    this->fps = fps;
+    this->size_wh = size_wh;
+    this->nencoders = nencoders;
+    this->pix_fmt = pix_fmt;
+    this->ffmpeg_output_opt = ffmpeg_output_opt;
+    initializer();
+}
+
+ParallelVideoWriter::~ParallelVideoWriter() {
+    release();
+}
+
+void ParallelVideoWriter::initializer() {
+    VideoWriter::initializer();  // same command line, written per segment
+    released = false;
+}
+
+void ParallelVideoWriter::start_encoders() {
+    waitInit = false;
+    const bool default_encoders = nencoders <= 0;
+    if (default_encoders) nencoders = std::max(1, (int)std::thread::hardware_concurrency());
+    const long long budget_frames = std::max(2LL, max_buffered_bytes / std::max(1, bytes_per_frame));
+    const int second = std::max(1, (int)std::lround(fps));
+    if (chunk_frames <= 0) {
+        const long long fit = budget_frames / (chunks_in_flight > 0 ? chunks_in_flight : nencoders + 1);
+        chunk_frames = (int)std::max<long long>(second, std::min<long long>(10LL * second, fit));
+    }
+    if (chunks_in_flight <= 0) {
+        chunks_in_flight = (int)std::max(2LL, std::min<long long>(nencoders + 1, budget_frames / chunk_frames));
+    }
+    if (default_encoders) nencoders = std::min(nencoders, chunks_in_flight);
+    chunks = std::make_shared<BoundedQueue<std::shared_ptr<Chunk>>>(chunks_in_flight);
+    for (int k = 0; k < nencoders; ++k) {
+        workers.push_back(std::thread(&ParallelVideoWriter::encode_chunks, this));
+    }
+}
+
+bool ParallelVideoWriter::write(const void* frame) {
+    if (frame == NULL) return false;
+    Frame copy = getFramePool().acquire();
+    memcpy(copy.data(), frame, bytes_per_frame);
+    return write(copy);
+}
+
+bool ParallelVideoWriter::write(const Frame& frame) {
+    assert(frame.empty() || frame.size() == (size_t)bytes_per_frame);
+    if (released || frame.empty()) return false;
+    if (waitInit) {
+        start_encoders();
+    }
+    IOStats::Clock::time_point start = IOStats::Clock::now();
+    if (!filling) {
+        std::unique_lock<std::mutex> lock(mutex);
+        chunk_done.wait(lock, [this] { return in_flight < chunks_in_flight; });
+        in_flight++;
+        filling = std::make_shared<Chunk>();
+        filling->index = nchunks++;
+        filling->frames.reserve(chunk_frames);
+    }
+    filling->frames.push_back(frame);
+    if ((int)filling->frames.size() == chunk_frames) {
+        chunks->push(filling);  // never waits, in_flight bounds the queue
+        filling.reset();
+    }
+    io_stats.add_frames(1, bytes_per_frame, start, IOStats::Clock::now());
+    return true;
+}
+
+void ParallelVideoWriter::encode_chunks() {
+    std::shared_ptr<Chunk> chunk;
+    while (chunks->pop(chunk)) {
+        bool success = encode_chunk(*chunk);
+        chunk.reset();  // the frames go back to their pool
+        std::lock_guard<std::mutex> lock(mutex);
+        failed = failed || !success;
+        in_flight--;
+        chunk_done.notify_all();
+    }
+}
+
+bool ParallelVideoWriter::encode_chunk(const Chunk& chunk) {
+    std::shared_ptr<PipeProcess> encoder = open_pipe_process(compose_cmd(segment_path(filename, chunk.index)), "w",
+        pipe_size > 0 ? pipe_size : bytes_per_frame, use_popen);
+    if (!encoder) return false;
+    bool success = true;
+    for (const Frame& frame : chunk.frames) {
+        success = success && encoder->write(frame.data(), bytes_per_frame) == (size_t)bytes_per_frame;
+    }
+    return encoder->close() == 0 && success;
+}
+
+void ParallelVideoWriter::release() {
+    if (released) return;
+    released = true;
+    if (waitInit) return;  // nothing written
+    if (filling && !filling->frames.empty()) chunks->push(filling);
+    filling.reset();
+    chunks->close();  // the encoders drain the queue, then stop
+    for (auto& worker : workers) worker.join();
+    workers.clear();
+    if (failed || !concat_segments(filename, nchunks)) {
+        failed = true;
+        std::cerr << "ParallelVideoWriter: encoding " << filename << " failed" << std::endl;
+    }
+    for (int k = 0; k < nchunks; ++k) std::remove(segment_path(filename, k).c_str());
+    dump_stats(stats_file, "writer", filename, io_stats);
+}
+
+bool ParallelVideoWriter::isOpened() const {
+    return !released;
+}
+
+VideoWriterNV::VideoWriterNV(): VideoWriter(){;}
+
+VideoWriterNV::VideoWriterNV(const std::string& filename, const std::string& codec, double fps, Size_wh size_wh, int isColor,
+        std::string ffmpeg_output_opt, int gpu){
+    this->filename = filename;
+    this->codec = codec;
+    this->fps = fps;
+    this->size_wh = size_wh;
+    this->pix_fmt = isColor ? "bgr24" : "gray";
+    this->ffmpeg_output_opt = ffmpeg_output_opt;
+    this->gpu = gpu;
+    initializer();
+}
+
+VideoWriterNV::VideoWriterNV(const std::string& filename, const std::string& codec, double fps, Size_wh size_wh, std::string pix_fmt,
+        std::string ffmpeg_output_opt, int gpu){
+    this->filename = filename;
+    this->codec = codec;
+    this->fps = fps;
+    this->size_wh = size_wh;
+    this->pix_fmt = pix_fmt;
+    this->ffmpeg_output_opt = ffmpeg_output_opt;
+    this->gpu = gpu;
+    initializer();
+}
+
+
+void VideoWriterNV::initializer(){
+    int numGPU = get_num_NVIDIA_GPUs();
+    assert (numGPU > 0 && "No NVIDIA GPU found");
+    gpu = gpu % numGPU;
+
+    codec = codec.empty() ? "h264" : codec;
+    std::string codec_gpu = encoder_to_nvidia(codec);
+    width = size_wh.width;
+    height = size_wh.height;
+    process.reset();
+    std::string rtsp_str = startsWith(filename, "rtsp://") ? " -f rtsp -rtsp_transport tcp " : " ";
+
+    std::ostringstream oss;
+    oss << "ffmpeg -y -loglevel warning -f rawvideo -pix_fmt " << pix_fmt
+        << " -s " << width << "x" << height << " -r " << fps
+        << " -i pipe: -c:v " << codec_gpu << " -gpu " << gpu
+        << " -pix_fmt " << output_pix_fmt
+        << ffmpeg_output_opt << rtsp_str << " \"" << filename << "\"";
+    ffmpeg_cmd = oss.str();
+    std::cout << "ffmpeg_cmd: " << ffmpeg_cmd << std::endl;
+
+    innumpyshape = get_outnumpyshape(size_wh, pix_fmt);
+    bytes_per_frame = 1;
+    for (int num : innumpyshape) {
+        bytes_per_frame *= num;
+    }
+}
+
+AdaptiveVideoWriter::AdaptiveVideoWriter(): VideoWriter(){;}
+
+AdaptiveVideoWriter::AdaptiveVideoWriter(const std::string& filename, const std::string& codec, double fps,
+    Size_wh size_wh, const std::string& preset, int isColor, std::string ffmpeg_output_opt){
+    this->filename = filename;
+    this->codec = codec;
+    this->fps = fps;
+    this->size_wh = size_wh;
+    this->pix_fmt = isColor ? "bgr24" : "gray";
+    this->ffmpeg_output_opt = ffmpeg_output_opt;
+    const std::string encoder = codec_to_encoder(codec.empty() ? "h264" : codec);
+    if (encoder == "libx264" || encoder == "libx265") {
+        const char* presets[] = {"ultrafast", "superfast", "veryfast", "faster", "fast", "medium", "slow",
+            "slower", "veryslow"};
+        for (const char* name : presets) {
+            ladder.push_back(std::string("-preset ") + name);
+            if (preset == name) break;
+        }
+        if (ladder.back() != "-preset " + preset) ladder.assign(1, "-preset " + preset);  // unknown, keep it
+    } else {
+        ladder.assign(1, "");  // no presets to move along, progress is still reported
+    }
+    rung = (int)ladder.size() - 1;
+    initializer();
+}
+
+AdaptiveVideoWriter::~AdaptiveVideoWriter() {
+    release();
+}
+
+void AdaptiveVideoWriter::initializer() {
+    VideoWriter::initializer();
+    track_progress = true;
+    is_file = filename.find("://") == std::string::npos;
+    released = false;
+}
+
+void AdaptiveVideoWriter::start_segment() {
+    if (segment_frames <= 0) segment_frames = std::max(1, (int)std::lround(fps * 5));
+    rung = std::max(0, std::min(rung, (int)ladder.size() - 1));
+    const std::string output = is_file ? segment_path(filename, (int)segments.size()) : filename;
+    ffmpeg_cmd = compose_cmd(output, ladder.empty() ? "" : ladder[rung]);
+    open_process();
+    segment_written = 0;
+    segment_blocked = io_stats.blocked_seconds;
+    segment_start = IOStats::Clock::now();
+}
+
+void AdaptiveVideoWriter::finish_segment() {
+    Segment segment;
+    segment.rung = rung;
+    segment.frames = segment_written;
+    segment.speed = get_progress().recent_speed;
+    const double wall = seconds_since(segment_start);
+    segment.blocked_fraction = wall > 0 ? (io_stats.blocked_seconds - segment_blocked) / wall : 0;
+    segments.push_back(segment);
+
+    if (feeder) {
+        feeder->flush();
+        feeder->stop();
+        feeder.reset();
+    }
+    join_closing();
+    std::shared_ptr<PipeProcess> previous = process;
+    process.reset();
+    if (previous && is_file) {
+        // the encoder drains its lookahead while the next segment starts
+        closing = std::thread([this, previous]() {
+            closing_status = previous->close();
+        });
+    } else if (previous && previous->close() != 0) {
+        failed = true;  // a network output takes one publisher at a time
+    }
+
+    // behind: the encoder was slower than real time and write() waited on it;
+    // headroom: faster than needed, or write() hardly ever waited
+    const bool behind = segment.speed > 0 && segment.speed < min_speed && segment.blocked_fraction >= idle_fraction;
+    const bool headroom = segment.speed >= max_speed || segment.blocked_fraction < idle_fraction;
+    if (behind) {
+        rung = std::max(0, rung - 1);
+        cooldown = cooldown_segments;
+    } else if (cooldown > 0) {
+        cooldown--;
+    } else if (headroom) {
+        rung = std::min(rung + 1, (int)ladder.size() - 1);
+    }
+}
+
+void AdaptiveVideoWriter::join_closing() {
+    if (!closing.joinable()) return;
+    closing.join();
+    if (closing_status != 0) failed = true;
+    closing_status = 0;
+}
+
+bool AdaptiveVideoWriter::begin_frame() {
+    if (released) return false;
+    if (waitInit) {
+        start_segment();
+    } else if (segment_written >= segment_frames) {
+        finish_segment();
+        start_segment();
+    }
+    if (!process) {
+        failed = true;
+        return false;
+    }
+    return true;
+}
+
+bool AdaptiveVideoWriter::write(const void* frame) {
+    if (frame == NULL || !begin_frame()) return false;
+    bool success = VideoWriter::write(frame);
+    if (success) segment_written++;
+    return success;
+}
+
+bool AdaptiveVideoWriter::write(const Frame& frame) {
+    assert(frame.empty() || frame.size() == (size_t)bytes_per_frame);
+    if (frame.empty() || !begin_frame()) return false;
+    bool success = VideoWriter::write(frame);
+    if (success) segment_written++;
+    return success;
+}
+
+void AdaptiveVideoWriter::release() {
+    if (released) return;
+    released = true;
+    if (waitInit) return;  // nothing written
+    finish_segment();
+    join_closing();
+    if (is_file) {
+        const int nsegments = (int)segments.size();
+        bool joined = false;
+        if (!failed && nsegments == 1) {
+            std::remove(filename.c_str());
+            joined = std::rename(segment_path(filename, 0).c_str(), filename.c_str()) == 0;
+        } else if (!failed) {
+            joined = concat_segments(filename, nsegments);
+        }
+        for (int k = 0; k < nsegments; ++k) std::remove(segment_path(filename, k).c_str());
+        if (!joined) failed = true;
+    }
+    if (failed) std::cerr << "AdaptiveVideoWriter: encoding " << filename << " failed" << std::endl;
+    dump_stats(stats_file, "writer", filename, io_stats);
+}
+
+//================End Video Writer==================
+
+//================ Begin Stream copy ==================
+
+std::string codec_to_encoder(const std::string& codec) {
+    if (codec == "h264") return "libx264";
+    if (codec == "hevc") return "libx265";
+    if (codec == "vp8") return "libvpx";
+    if (codec == "vp9") return "libvpx-vp9";
+    if (codec == "av1") return "libaom-av1";
+    return codec;  // mpeg4, mjpeg, ...: decoder and encoder share the name
+}
+
+// Runs "ffmpeg <args>" and checks that it left a non-empty output.
+bool run_ffmpeg(const std::string& args, const std::string& output) {
+    std::remove(output.c_str());
+    execute_command("ffmpeg -y -loglevel warning " + args);
+    long long size = 0, mtime = 0;
+    return file_signature(output, size, mtime) && size > 0;
+}
+
+bool remux(const std::string& input, const std::string& output) {
+    if (!file_exsits(input)) return false;
+    return run_ffmpeg("-i \"" + input + "\" -map 0:v -map 0:a? -c copy \"" + output + "\"", output);
+}
+
+// Frames [first, first + nframes) of the video stream, copied when first is a keyframe and the
+// range ends on one, re-encoded otherwise. Timestamps start at 0.
+bool cut_video(const std::string& input, const std::string& output, const KeyframeIndex& index,
+    int first, int nframes, bool copy, const std::string& encoder_opt) {
+    const int keyframe = index.keyframe_before(first);
+    std::ostringstream args;
+    if (keyframe > 0) args << "-noaccurate_seek -ss " << index.seek_time(keyframe) << " ";
+    args << "-i \"" << input << "\" -map 0:v:0 -an -sn -dn -frames:v " << nframes << " ";
+    if (copy) {
+        args << "-c copy -avoid_negative_ts make_zero ";
+    } else {
+        // decode from the keyframe, keep frame first onwards
+        args << "-vf \"select='gte(n," << first - keyframe << ")',setpts=PTS-STARTPTS\" " << encoder_opt << " ";
+    }
+    args << "\"" << output << "\"";
+    return run_ffmpeg(args.str(), output);
+}
+
+bool trim(const std::string& input, const std::string& output, double start_seconds, double end_seconds,
+    bool accurate, const std::string& reencode_opt) {
+    if (!file_exsits(input)) return false;
+    VideoInfo info = get_info(input);
+    std::shared_ptr<const KeyframeIndex> index = get_keyframe_index(input);
+    if (!index || index->keyframes.empty()) return false;
+    const int nframes = (int)index->pts.size();
+    int first = index->frame_at(std::max(0.0, start_seconds));
+    int last = end_seconds > 0 ? std::min(index->frame_at(end_seconds), nframes) : nframes;  // one past
+    if (first >= last) return false;
+
+    // whole GOPs inside [first, last): from the first keyframe at or after first to the last one at or before last
+    const std::vector<int>& keyframes = index->keyframes;
+    std::vector<int>::const_iterator after_first = std::lower_bound(keyframes.begin(), keyframes.end(), first);
+    int copy_begin = after_first == keyframes.end() ? last : std::min(*after_first, last);
+    int copy_end = last == nframes ? nframes : index->keyframe_before(last);
+    if (copy_end < copy_begin) copy_begin = copy_end = last;  // no keyframe inside, re-encode it all
+    if (!accurate) {
+        std::vector<int>::const_iterator after_last = std::lower_bound(keyframes.begin(), keyframes.end(), last);
+        first = copy_begin = index->keyframe_before(first);
+        last = copy_end = after_last == keyframes.end() ? nframes : *after_last;
+    }
+
+    // pieces: re-encoded head, copied GOPs, re-encoded tail, in the output's container
+    std::ostringstream encoder_opt;
+    encoder_opt << "-c:v " << codec_to_encoder(info.codec) << " -r " << info.fps << " " << reencode_opt;
+    std::vector<std::pair<int, int>> ranges = {
+        std::make_pair(first, copy_begin), std::make_pair(copy_begin, copy_end), std::make_pair(copy_end, last)};
+    std::vector<std::string> pieces;
+    bool success = true;
+    for (size_t k = 0; k < ranges.size() && success; ++k) {
+        if (ranges[k].second <= ranges[k].first) continue;
+        const std::string piece = output + ".piece" + std::to_string(k) + "." + get_file_extension(output);
+        success = cut_video(input, piece, *index, ranges[k].first, ranges[k].second - ranges[k].first,
+            k == 1, encoder_opt.str());
+        pieces.push_back(piece);
+    }
+
+    // join the pieces, and copy the audio of the same time range next to them
+    const std::string list_path = output + ".pieces.txt";
+    if (success) success = write_concat_list(list_path, pieces);
+    if (success) {
+        const double audio_begin = index->pts[first] - index->start_time;
+        std::ostringstream args;
+        args << "-f concat -safe 0 -i \"" << list_path << "\" -ss " << audio_begin << " ";
+        if (last < nframes) args << "-t " << index->pts[last] - index->pts[first] << " ";
+        args << "-i \"" << input << "\" -map 0:v -map 1:a? -c copy -shortest \"" << output << "\"";
+        success = run_ffmpeg(args.str(), output);
+    }
+    std::remove(list_path.c_str());
+    for (auto& piece : pieces) std::remove(piece.c_str());
+    return success;
+}
+
+//================ End Stream copy ==================
+
+//================ Begin Image resize ==================
+
+std::vector<PlaneLayout> get_plane_layout(Size_wh size_wh, const std::string& pix_fmt) {
+    const int w = size_wh.width, h = size_wh.height;
+    const size_t luma = (size_t)w * h, chroma = (size_t)(w / 2) * (h / 2);
+    if (pix_fmt == "bgr24" || pix_fmt == "rgb24") {
+        return {{0, w, h, 3, 1}};
+    } else if (pix_fmt == "gray") {
+        return {{0, w, h, 1, 1}};
+    } else if (pix_fmt == "yuv420p" || pix_fmt == "yuvj420p") {
+        return {{0, w, h, 1, 1}, {luma, w / 2, h / 2, 1, 2}, {luma + chroma, w / 2, h / 2, 1, 2}};
+    } else if (pix_fmt == "nv12") {
+        return {{0, w, h, 1, 1}, {luma, w / 2, h / 2, 2, 2}};
+    } else {
+        assert(false && "pix_fmt not supported");
+        return {};
+    }
+}
+
+void crop_resize(const uint8_t* src, Size_wh src_size, const std::string& pix_fmt,
+    const std::vector<ResizeTarget>& targets, int interpolation, ThreadPool* pool) {
+    struct Task {
+        const uint8_t* src;
+        int src_stride;
+        Size_wh src_size;
+        int channels;
+        uint8_t* dst;
+        Size_wh dst_size;
+        int row_begin;
+        int row_end;
+    };
+    const bool planar = pix_fmt != "bgr24" && pix_fmt != "rgb24" && pix_fmt != "gray";
+    const std::vector<PlaneLayout> src_planes = get_plane_layout(src_size, pix_fmt);
+    const int nbands = pool ? pool->size() : 1;
+    std::vector<Task> tasks;
+    for (const ResizeTarget& target : targets) {
+        int crop_x = std::get<0>(target.crop_xywh), crop_y = std::get<1>(target.crop_xywh);
+        int crop_w = std::get<2>(target.crop_xywh), crop_h = std::get<3>(target.crop_xywh);
+        if (crop_w == 0 || crop_h == 0) {
+            crop_x = crop_y = 0;
+            crop_w = src_size.width;
+            crop_h = src_size.height;
+        }
+        const Size_wh dst_size = target.size.empty() ? Size_wh(crop_w, crop_h) : target.size;
+        assert(crop_x >= 0 && crop_y >= 0 && crop_x + crop_w <= src_size.width && crop_y + crop_h <= src_size.height);
+        assert(!planar || (crop_x % 2 == 0 && crop_y % 2 == 0 && crop_w % 2 == 0 && crop_h % 2 == 0 &&
+            dst_size.width % 2 == 0 && dst_size.height % 2 == 0));
+        const std::vector<PlaneLayout> dst_planes = get_plane_layout(dst_size, pix_fmt);
+        for (size_t k = 0; k < src_planes.size(); ++k) {
+            const PlaneLayout& plane = src_planes[k];
+            const int sub = plane.subsample;
+            const int src_stride = plane.width * plane.channels;
+            Task task;
+            task.src = src + plane.offset + (size_t)(crop_y / sub) * src_stride + (crop_x / sub) * plane.channels;
+            task.src_stride = src_stride;
+            task.src_size = Size_wh(crop_w / sub, crop_h / sub);
+            task.channels = plane.channels;
+            task.dst = target.dst + dst_planes[k].offset;
+            task.dst_size = Size_wh(dst_planes[k].width, dst_planes[k].height);
+            const int rows = task.dst_size.height;
+            const int bands = std::max(1, std::min(nbands, rows / 16));
+            for (int band = 0; band < bands; ++band) {
+                task.row_begin = rows * band / bands;
+                task.row_end = rows * (band + 1) / bands;
+                tasks.push_back(task);
+            }
+        }
+    }
+    auto run_task = [&](int i) {
+        const Task& task = tasks[i];
+        resize_plane(task.src, task.src_stride, task.src_size, task.channels,
+            task.dst, task.dst_size, interpolation, task.row_begin, task.row_end);
+    };
+    if (pool) {
+        pool->run((int)tasks.size(), run_task);
+    } else {
+        for (size_t i = 0; i < tasks.size(); ++i) run_task((int)i);
+    }
+}
+
+void crop_resize(const uint8_t* src, Size_wh src_size, const std::string& pix_fmt,
+    std::tuple<int, int, int, int> crop_xywh, uint8_t* dst, Size_wh dst_size,
+    int interpolation, ThreadPool* pool) {
+    crop_resize(src, src_size, pix_fmt, {ResizeTarget(crop_xywh, dst_size, dst)}, interpolation, pool);
+}
+
+void resize_plane(const uint8_t* src, int src_stride, Size_wh src_size, int channels,
+    uint8_t* dst, Size_wh dst_size, int interpolation, int row_begin, int row_end) {
+    if (src_size.width == dst_size.width && src_size.height == dst_size.height) {
+        const size_t row_bytes = (size_t)dst_size.width * channels;  // crop only
+        for (int row = row_begin; row < row_end; ++row) {
+            memcpy(dst + row * row_bytes, src + (size_t)row * src_stride, row_bytes);
+        }
+    } else if (interpolation == INTER_AREA && src_size.width >= dst_size.width && src_size.height >= dst_size.height) {
+        resize_plane_area(src, src_stride, src_size, channels, dst, dst_size, row_begin, row_end);
+    } else {
+        resize_plane_linear(src, src_stride, src_size, channels, dst, dst_size, row_begin, row_end);
+    }
+}
+
+void resize_plane_linear(const uint8_t* src, int src_stride, Size_wh src_size, int channels,
+    uint8_t* dst, Size_wh dst_size, int row_begin, int row_end) {
+    // Pixel centers are aligned as in OpenCV: sx = (dx + 0.5) * src / dst - 0.5.
+    // Weights have 7 bits, so a horizontally blended sample fits int16 and the
+    // vertical blend is one 16x16->32 multiply-add per output byte.
+    const int dst_w = dst_size.width, row_len = dst_w * channels;
+    std::vector<int> x0(row_len), x1(row_len);
+    std::vector<int16_t> wx(row_len);
+    const double scale_x = (double)src_size.width / dst_w;
+    for (int dx = 0; dx < dst_w; ++dx) {
+        const double fx = std::max(0.0, (dx + 0.5) * scale_x - 0.5);
+        int sx = std::min((int)fx, src_size.width - 1);
+        const int w = sx < src_size.width - 1 ? (int)std::lround((fx - sx) * 128) : 0;
+        for (int c = 0; c < channels; ++c) {
+            x0[dx * channels + c] = sx * channels + c;
+            x1[dx * channels + c] = std::min(sx + 1, src_size.width - 1) * channels + c;
+            wx[dx * channels + c] = (int16_t)w;
+        }
+    }
+    const double scale_y = (double)src_size.height / dst_size.height;
+    std::vector<int16_t> rows[2] = {std::vector<int16_t>(row_len + 16), std::vector<int16_t>(row_len + 16)};
+    int cached[2] = {-1, -1};
+    auto horizontal = [&](int sy) -> const int16_t* {
+        const int slot = sy & 1;
+        if (cached[slot] != sy) {
+            const uint8_t* in = src + (size_t)sy * src_stride;
+            int16_t* out = rows[slot].data();
+            for (int i = 0; i < row_len; ++i) {
+                out[i] = (int16_t)(in[x0[i]] * (128 - wx[i]) + in[x1[i]] * wx[i]);
+            }
+            cached[slot] = sy;
+        }
+        return rows[slot].data();
+    };
+
+    for (int dy = row_begin; dy < row_end; ++dy) {
+        const double fy = std::max(0.0, (dy + 0.5) * scale_y - 0.5);
+        const int sy = std::min((int)fy, src_size.height - 1);
+        const int sy1 = std::min(sy + 1, src_size.height - 1);
+        const int wy = sy < src_size.height - 1 ? (int)std::lround((fy - sy) * 128) : 0;
+        const int16_t* h0 = horizontal(sy);
+        const int16_t* h1 = sy1 == sy ? h0 : horizontal(sy1);
+        uint8_t* out = dst + (size_t)dy * row_len;
+        int i = 0;
+#if defined(__AVX2__)
+        {
+            const __m256i w = _mm256_set1_epi32((wy << 16) | (128 - wy));
+            const __m256i round = _mm256_set1_epi32(1 << 13);
+            for (; i + 16 <= row_len; i += 16) {
+                const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(h0 + i));
+                const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(h1 + i));
+                const __m256i lo = _mm256_srai_epi32(_mm256_add_epi32(
+                    _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w), round), 14);
+                const __m256i hi = _mm256_srai_epi32(_mm256_add_epi32(
+                    _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w), round), 14);
+                const __m256i words = _mm256_packs_epi32(lo, hi);  // lane order is kept
+                const __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0xD8);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm256_castsi256_si128(bytes));
+            }
+        }
+#endif
+#if defined(__AVX2__) || defined(__SSE4_1__) || defined(__SSE2__)
+        {
+            const __m128i w = _mm_set1_epi32((wy << 16) | (128 - wy));
+            const __m128i round = _mm_set1_epi32(1 << 13);
+            for (; i + 8 <= row_len; i += 8) {
+                const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(h0 + i));
+                const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(h1 + i));
+                const __m128i lo = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a, b), w), round), 14);
+                const __m128i hi = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a, b), w), round), 14);
+                const __m128i words = _mm_packs_epi32(lo, hi);
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(words, words));
+            }
+        }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+        {
+            const int16x4_t w0 = vdup_n_s16((int16_t)(128 - wy)), w1 = vdup_n_s16((int16_t)wy);
+            for (; i + 8 <= row_len; i += 8) {
+                const int16x8_t a = vld1q_s16(h0 + i), b = vld1q_s16(h1 + i);
+                const int32x4_t lo = vmlal_s16(vmull_s16(vget_low_s16(a), w0), vget_low_s16(b), w1);
+                const int32x4_t hi = vmlal_s16(vmull_s16(vget_high_s16(a), w0), vget_high_s16(b), w1);
+                vst1_u8(out + i, vqmovun_s16(vcombine_s16(vrshrn_n_s32(lo, 14), vrshrn_n_s32(hi, 14))));
+            }
+        }
+#endif
+        for (; i < row_len; ++i) {
+            out[i] = (uint8_t)((h0[i] * (128 - wy) + h1[i] * wy + (1 << 13)) >> 14);
+        }
+    }
+}
+
+void resize_plane_area(const uint8_t* src, int src_stride, Size_wh src_size, int channels,
+    uint8_t* dst, Size_wh dst_size, int row_begin, int row_end) {
+    // Each output pixel averages the source pixels its footprint covers, weighted by the
+    // covered fraction. Weights are in 8-bit fixed point and sum to 256 per output.
+    struct Taps {
+        std::vector<int> first;    // first source index per output
+        std::vector<int> count;    // number of source pixels per output
+        std::vector<int> weights;  // flattened
+    };
+    auto make_taps = [](int src_len, int dst_len) {
+        Taps taps;
+        const double scale = (double)src_len / dst_len;
+        for (int d = 0; d < dst_len; ++d) {
+            const double s0 = d * scale, s1 = std::min((d + 1) * scale, (double)src_len);
+            const int first = (int)s0;
+            const int last = std::min((int)std::ceil(s1) - 1, src_len - 1);
+            int total = 0, largest = 0;
+            const size_t start = taps.weights.size();
+            for (int sx = first; sx <= last; ++sx) {
+                const double cover = std::min(s1, sx + 1.0) - std::max(s0, (double)sx);
+                const int w = (int)std::lround(cover / scale * 256);
+                taps.weights.push_back(w);
+                total += w;
+                if (w > taps.weights[start + largest]) largest = sx - first;
+            }
+            taps.weights[start + largest] += 256 - total;  // exact sum after rounding
+            taps.first.push_back(first);
+            taps.count.push_back(last - first + 1);
+        }
+        return taps;
+    };
+    const Taps tx = make_taps(src_size.width, dst_size.width);
+    const Taps ty = make_taps(src_size.height, dst_size.height);
+    const int row_len = dst_size.width * channels;
+    std::vector<int> wy_start(dst_size.height + 1, 0);
+    for (int dy = 0; dy < dst_size.height; ++dy) wy_start[dy + 1] = wy_start[dy] + ty.count[dy];
+    std::vector<int> wx_start(dst_size.width + 1, 0);
+    for (int dx = 0; dx < dst_size.width; ++dx) wx_start[dx + 1] = wx_start[dx] + tx.count[dx];
+
+    // rows first, over contiguous source bytes, then the taps along the row once per output row
+    const int src_len = src_size.width * channels;
+    std::vector<int32_t> column_sum(src_len);
+    for (int dy = row_begin; dy < row_end; ++dy) {
+        std::fill(column_sum.begin(), column_sum.end(), 0);
+        for (int k = 0; k < ty.count[dy]; ++k) {
+            const uint8_t* in = src + (size_t)(ty.first[dy] + k) * src_stride;
+            const int32_t wy = ty.weights[wy_start[dy] + k];
+            int32_t* acc = column_sum.data();
+            int i = 0;
+#if defined(__AVX2__)
+            {
+                const __m256i w = _mm256_set1_epi32(wy);  // (wy, 0) pairs for madd
+                for (; i + 16 <= src_len; i += 16) {
+                    const __m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+                    const __m256i lo = _mm256_madd_epi16(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(x)), w);
+                    const __m256i hi = _mm256_madd_epi16(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(x, 1)), w);
+                    __m256i* out = reinterpret_cast<__m256i*>(acc + i);
+                    _mm256_storeu_si256(out, _mm256_add_epi32(_mm256_loadu_si256(out), lo));
+                    _mm256_storeu_si256(out + 1, _mm256_add_epi32(_mm256_loadu_si256(out + 1), hi));
+                }
+            }
+#endif
+#if defined(__AVX2__) || defined(__SSE4_1__) || defined(__SSE2__)
+            {
+                const __m128i w = _mm_set1_epi32(wy);
+                const __m128i zero = _mm_setzero_si128();
+                for (; i + 8 <= src_len; i += 8) {
+                    const __m128i x = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + i)), zero);
+                    __m128i* out = reinterpret_cast<__m128i*>(acc + i);
+                    _mm_storeu_si128(out, _mm_add_epi32(_mm_loadu_si128(out), _mm_madd_epi16(_mm_unpacklo_epi16(x, zero), w)));
+                    _mm_storeu_si128(out + 1, _mm_add_epi32(_mm_loadu_si128(out + 1), _mm_madd_epi16(_mm_unpackhi_epi16(x, zero), w)));
+                }
+            }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+            {
+                const uint16x4_t w = vdup_n_u16((uint16_t)wy);
+                for (; i + 8 <= src_len; i += 8) {
+                    const uint16x8_t x = vmovl_u8(vld1_u8(in + i));
+                    uint32x4_t lo = vreinterpretq_u32_s32(vld1q_s32(acc + i));
+                    uint32x4_t hi = vreinterpretq_u32_s32(vld1q_s32(acc + i + 4));
+                    lo = vmlal_u16(lo, vget_low_u16(x), w);
+                    hi = vmlal_u16(hi, vget_high_u16(x), w);
+                    vst1q_s32(acc + i, vreinterpretq_s32_u32(lo));
+                    vst1q_s32(acc + i + 4, vreinterpretq_s32_u32(hi));
+                }
+            }
+#endif
+            for (; i < src_len; ++i) acc[i] += in[i] * wy;
+        }
+        uint8_t* out = dst + (size_t)dy * row_len;
+        for (int dx = 0; dx < dst_size.width; ++dx) {
+            const int* w = &tx.weights[wx_start[dx]];
+            const int32_t* px = &column_sum[tx.first[dx] * channels];
+            for (int c = 0; c < channels; ++c) {
+                int32_t acc = 0;
+                for (int j = 0; j < tx.count[dx]; ++j) acc += px[j * channels + c] * w[j];
+                out[dx * channels + c] = (uint8_t)std::min(255, (acc + (1 << 15)) >> 16);
+            }
+        }
+    }
+}
+
+//================ End Image resize ==================
+
+//================Begin Video Reader==================
+std::tuple<Size_wh, Size_wh, std::string> get_videofilter_cpu(
+    Size_wh originsize, std::string pix_fmt, std::tuple<int, int, int, int> crop_xywh, Size_wh resize) {
+    static const std::vector<std::string> allowed_pix_fmts = {"rgb24", "bgr24", "yuv420p", "yuvj420p", "nv12", "gray"};
+    assert(std::find(allowed_pix_fmts.begin(), allowed_pix_fmts.end(), pix_fmt) != allowed_pix_fmts.end());
+    int origin_width = originsize.width;
+    int origin_height = originsize.height;
+    int crop_x = std::get<0>(crop_xywh);
+    int crop_y = std::get<1>(crop_xywh);
+    int crop_w = std::get<2>(crop_xywh);
+    int crop_h = std::get<3>(crop_xywh);
+    int resize_width = resize.width;
+    int resize_height = resize.height;
+
+    std::string cropopt;
+    if (crop_w != 0 && crop_h != 0) {
+        assert(crop_x % 2 == 0 && crop_y % 2 == 0 && crop_w % 2 == 0 && crop_h % 2 == 0);
+        assert(crop_w <= origin_width && crop_h <= origin_height);
+        cropopt = "crop=" + std::to_string(crop_w) + ":" + std::to_string(crop_h) +
+                    ":" + std::to_string(crop_x) + ":" + std::to_string(crop_y);
+    } else {
+        crop_w = origin_width;
+        crop_h = origin_height;
+        cropopt = "";
+    }
+    Size_wh cropsize = {crop_w, crop_h};
+    Size_wh final_size_wh = cropsize;
+
+    std::string scaleopt="";
+    std::string padopt="";
+    if (!resize.empty() && (resize_width != 0 || resize_height != 0)) {
+        assert (resize_width % 2 == 0 && resize_height % 2 == 0);
+        final_size_wh = resize;
+        scaleopt = "scale=" + std::to_string(resize_width) + "x" + std::to_string(resize_height);
+    }
+
+    std::string pix_fmt_opt = (pix_fmt == "gray") ? "extractplanes=y" : "";
+    std::string filterstr = "";
+    if (!cropopt.empty() || !scaleopt.empty() || !pix_fmt_opt.empty()) {
+        filterstr = "-vf ";
+        if (!cropopt.empty()) filterstr += cropopt + ",";
+        if (!scaleopt.empty()) filterstr += scaleopt + ",";
+        if (!pix_fmt_opt.empty()) filterstr += pix_fmt_opt + ",";
+        filterstr = filterstr.substr(0, filterstr.size() - 1);
+    }
+    return std::make_tuple(cropsize, final_size_wh, filterstr);
+}
+
+VideoCapture::VideoCapture(){;}
+
+VideoCapture::VideoCapture(const std::string& filename, int isColor,
+    std::tuple<int, int, int, int> crop_xywh, Size_wh resize):
+    filename(filename), pix_fmt(isColor ? "bgr24" : "gray"), crop_xywh(crop_xywh), resize(resize){
+    initializer();
+}
+
+VideoCapture::VideoCapture(const std::string& filename, std::string pix_fmt,
+    std::tuple<int, int, int, int> crop_xywh, Size_wh resize):
+    filename(filename), pix_fmt(pix_fmt), crop_xywh(crop_xywh), resize(resize){
+    initializer();
+}
+
+void VideoCapture::initializer(){
+    io_stats = IOStats();
+    VideoInfo videoinfo = get_info(filename);
+    io_stats.probe_seconds = seconds_since(io_stats.open_time);
+    origin_width = width = videoinfo.width;
+    origin_height = height = videoinfo.height;
+    codec = videoinfo.codec;
+    fps = videoinfo.fps;
+    duration = videoinfo.duration;
+    count = videoinfo.count;
+    iframe = -1;
+    default_buffer = NULL;
+    waitInit = true;
+
+    assert(width % 2 == 0 && "Height must be even");
+    assert(height % 2 == 0 && "Width must be even");
+
+    // a tensor pix_fmt is converted from rgb24 in this process
+    const bool tensor = TensorConverter::supports(pix_fmt);
+    std::tuple<Size_wh, Size_wh, std::string> filter_options = get_videofilter_cpu(
+        {width, height}, tensor ? "rgb24" : pix_fmt, crop_xywh, resize);
+    size_wh = std::get<1>(filter_options);
+    filterstr = std::get<2>(filter_options);
+    width = size_wh.width;
+    height = size_wh.height;
+    if (tensor) converter = std::make_shared<TensorConverter>(width, height, pix_fmt);
+
+    // 初始化 ffmpeg 的 VideoCapture
+    ffmpeg_cmd = compose_cmd();
+    std::cout << "ffmpeg_cmd: " << ffmpeg_cmd << std::endl;
+
+    // 计算每帧的位数
+    outnumpyshape = get_outnumpyshape(size_wh, pix_fmt);
+    outdtype = get_outdtype(pix_fmt);
+    bytes_per_frame = get_dtype_bytes(outdtype);
+    for (int num : outnumpyshape) {
+        bytes_per_frame *= num;
+    }
+}
+
+std::string VideoCapture::compose_cmd() {
+    std::string skip_opt = keyframes_only ? "-skip_frame nokey " : "";
+    std::string vf = filterstr;
+    std::string sync_opt = "";
+    if (frame_step != 1) {
+        // decoded frame n (counted from the restart point) starts returned frame floor(n / step)
+        char step[32];
+        snprintf(step, sizeof(step), "%.10g", frame_step);
+        std::ostringstream select;
+        select << "select='gt(floor((n+" << select_offset << ")/" << step << "),floor((n+"
+               << select_offset - 1 << ")/" << step << "))'";
+        vf = "-vf \"" + select.str() + (filterstr.empty() ? "" : "," + filterstr.substr(4)) + "\"";
+    }
+    if (frame_step != 1 || keyframes_only) sync_opt = get_passthrough_opt() + " ";
+    std::string end_opt = "";
+    if (range_end > 0 && count > 0) end_opt = "-frames:v " + std::to_string(count - iframe - 1) + " ";
+
+    std::ostringstream oss;
+    oss << "ffmpeg -y " << loglevel_opt << " " << skip_opt << seek_opt << "-i \"" << filename << "\" -f rawvideo "
+        << end_opt << sync_opt << vf << " -pix_fmt " << (converter ? converter->input_pix_fmt() : pix_fmt) << " pipe:";
+    return oss.str();
+}
+
+VideoCapture::~VideoCapture() {
+    release();
+}
+
+void VideoCapture::release() {
+    if (default_buffer) {
+        free(default_buffer);
+        default_buffer = NULL;
+    }
+    if (process) dump_stats(stats_file, "capture", filename, io_stats);
+    stop_process();
+}
+
+int VideoCapture::stop_process() {
+    if (prefetcher) {
+        prefetcher->stop();  // join the reader before its pipe is closed
+        prefetcher.reset();
+    }
+    held_frame = Frame();
+    int status = 0;
+    if (process) {
+        status = process->close();
+        process.reset();
+    }
+    return status;
+}
+
+void VideoCapture::close() {
+    release();
+}
+
+uint8_t* VideoCapture::getBuffer() {
+    if (default_buffer == NULL){
+        default_buffer = (void*)malloc(bytes_per_frame);
+    }
+    return static_cast<uint8_t*>(default_buffer);
+}
+
+FramePool& VideoCapture::getFramePool() {
+    if (frame_pool.bytes_per_frame() != (size_t)bytes_per_frame) {
+        frame_pool = FramePool(bytes_per_frame);
+    }
+    return frame_pool;
+}
+
+void VideoCapture::open_process() {
+    if (!process) {  // VideoCaptureNoProbe starts its process while opening
+        IOStats::Clock::time_point start = IOStats::Clock::now();
+        process = open_pipe_process(ffmpeg_cmd, "r", pipe_size > 0 ? pipe_size : bytes_per_frame, use_popen);
+        io_stats.spawn_seconds += seconds_since(start);
+        io_stats.spawns++;
+    }
+    waitInit = false;
+    if (process && prefetch_frames > 0) {
+        prefetcher = std::make_shared<FramePrefetcher>(process.get(), getFramePool(), prefetch_frames, 0, converter);
+    }
+}
+
+bool VideoCapture::next_prefetched(Frame& frame) {
+    IOStats::Clock::time_point start = IOStats::Clock::now();
+    const long long skipped = prefetcher->skipped;
+    if (prefetcher->next(frame)) {
+        io_stats.add_frames(1, bytes_per_frame, start, IOStats::Clock::now());
+        dropped_frames += int(prefetcher->skipped - skipped);
+        iframe += 1 + int(prefetcher->skipped - skipped);
+        source_iframe = source_frame(iframe);
+        return true;
+    }
+    release();
+    return false;
+}
+
+bool VideoCapture::read(void * frame) {
+    if (waitInit){
+        open_process();
+    }
+
+    if (prefetcher) {
+        Frame ready;
+        if (!next_prefetched(ready)) return false;
+        memcpy(frame, ready.data(), bytes_per_frame);
+        return true;
+    } else if (process) {
+        bool success;
+        IOStats::Clock::time_point start = IOStats::Clock::now();
+        if (converter) {
+            yuv_buffer.resize(converter->input_size());
+            success = process->read(yuv_buffer.data(), yuv_buffer.size()) == yuv_buffer.size();
+            if (success) io_stats.add_frames(1, bytes_per_frame, start, IOStats::Clock::now());
+            if (success) converter->convert(yuv_buffer.data(), static_cast<uint8_t*>(frame));
+        } else {
+            success = process->read(frame, bytes_per_frame) == (size_t)bytes_per_frame;
+            if (success) io_stats.add_frames(1, bytes_per_frame, start, IOStats::Clock::now());
+        }
+        if (success) {
+            iframe += 1;
+            source_iframe = source_frame(iframe);
+            return true;
+        } else {
+            release();
+            return false;
+        }
+    } else {
+        return false;
+    }
+}
+
+std::tuple<bool, void *> VideoCapture::read() {
+    if (waitInit){
+        open_process();
+    }
+    if (prefetcher) {
+        // hand over the prefetched frame itself, valid until the next read
+        held_frame = Frame();
+        bool success = next_prefetched(held_frame);
+        return std::make_tuple(success, static_cast<void *>(held_frame.data()));
+    }
+    uint8_t* buffer = getBuffer();
+    bool success = read(buffer);
+    if (!success) {buffer = NULL;}
+    return std::make_tuple(success, buffer);
+}
+
+bool VideoCapture::read(Frame& frame) {
+    if (waitInit){
+        open_process();
+    }
+    if (prefetcher) {
+        return next_prefetched(frame);
+    }
+    if (frame.empty() || frame.size() != (size_t)bytes_per_frame || frame.use_count() != 1) {
+        frame = getFramePool().acquire();  // refill the caller's frame in place only if nobody else holds it
+    }
+    if (!read(static_cast<void *>(frame.data()))) {
+        frame = Frame();
+        return false;
+    }
+    return true;
+}
+
+int VideoCapture::read_batch(void* dst, int n) {
+    if (n <= 0) return 0;
+    if (waitInit){
+        open_process();
+    }
+    uint8_t* out = static_cast<uint8_t*>(dst);
+    int nread = 0;
+    if (prefetcher) {
+        Frame ready;
+        while (nread < n && next_prefetched(ready)) {
+            memcpy(out + (size_t)nread * bytes_per_frame, ready.data(), bytes_per_frame);
+            nread++;
+        }
+        return nread;
+    }
+    if (converter || !process) {
+        while (nread < n && read(static_cast<void *>(out + (size_t)nread * bytes_per_frame))) nread++;
+        return nread;
+    }
+    // one read for the whole batch, split into as few syscalls as the pipe size allows
+    IOStats::Clock::time_point start = IOStats::Clock::now();
+    size_t bytesRead = process->read(out, (size_t)n * bytes_per_frame);
+    nread = int(bytesRead / bytes_per_frame);
+    io_stats.add_frames(nread, bytes_per_frame, start, IOStats::Clock::now());
+    if (nread > 0) {
+        iframe += nread;
+        source_iframe = source_frame(iframe);
+    }
+    if (nread < n) release();
+    return nread;
+}
+
+int VideoCapture::read_batch(Frame& batch, int n) {
+    const size_t nbytes = (size_t)std::max(n, 0) * bytes_per_frame;
+    if (batch_pool.bytes_per_frame() != nbytes) {
+        batch_pool = FramePool(nbytes);
+    }
+    if (batch.empty() || batch.size() != nbytes || batch.use_count() != 1) {
+        batch = batch_pool.acquire();
+    }
+    int nread = read_batch(static_cast<void *>(batch.data()), n);
+    if (nread == 0) batch = Frame();
+    return nread;
+}
+
+bool VideoCapture::isOpened() {
+    return process != nullptr || waitInit;
+}
+
+IOStats VideoCapture::get_stats() const {
+    return io_stats;
+}
+
+void VideoCapture::reset_stats() {
+    io_stats.reset_counters();
+}
+
+bool VideoCapture::seek(int frame_index) {
+    if (frame_index < 0 || (count > 0 && frame_index >= count)) return false;
+
+    // Restart ffmpeg at the nearest preceding keyframe, then decode forward.
+    const int target = source_frame(frame_index);
+    const float decoded_fps = source_fps > 0 ? source_fps : fps;
+    int start = range_start;
+    std::shared_ptr<const KeyframeIndex> index = get_keyframe_index(filename);
+    if (index && target >= 0 && target < (int)index->pts.size()) {
+        start = std::max(index->keyframe_before(target), range_start);
+        seek_opt = start > range_start ?
+            "-noaccurate_seek -ss " + std::to_string(index->seek_time(start)) + " " : window_seek_opt();
+    } else if (decoded_fps > 0 && !keyframes_only) {
+        start = std::max(target, range_start);  // no packet index, let ffmpeg seek by time
+        seek_opt = start > range_start ? "-ss " + std::to_string(target / decoded_fps) + " " : window_seek_opt();
+    } else {
+        return false;
+    }
+    if (keyframes_only) {  // decoding restarts at this keyframe
+        const std::vector<int>& keyframes = keyframe_index->keyframes;
+        select_offset = int(std::lower_bound(keyframes.begin(), keyframes.end(), start) -
+            std::lower_bound(keyframes.begin(), keyframes.end(), range_start));
+    } else {
+        select_offset = start - range_start;
+    }
+
+    stop_process();
+    iframe = output_frame(start) - 1;
+    ffmpeg_cmd = compose_cmd();  // -frames:v counts from iframe
+    waitInit = true;
+    uint8_t* discard = getBuffer();
+    while (iframe < frame_index - 1) {
+        if (!read(discard)) return false;
+    }
+    return true;
+}
+
+bool VideoCapture::seek_time(double seconds) {
+    std::shared_ptr<const KeyframeIndex> index = get_keyframe_index(filename);
+    if (index && range_start > 0 && range_start < (int)index->pts.size()) {  // seconds count from the window
+        seconds += index->pts[range_start] - index->start_time;
+    }
+    int frame_index = index ? output_frame(index->frame_at(seconds)) : int(seconds * fps + 0.5);
+    return seek(frame_index);
+}
+
+bool VideoCapture::set_subsample(int every_nth_frame, float target_fps, bool keyframes_only) {
+    if (every_nth_frame < 1 || target_fps < 0) return false;
+    if (source_fps == 0 && source_count == 0) {  // first call, keep the source values
+        source_fps = fps;
+        source_count = count;
+        source_duration = duration;
+    }
+    keyframe_index.reset();
+    if (keyframes_only) {
+        keyframe_index = get_keyframe_index(filename);
+        if (!keyframe_index) return false;
+    }
+    this->keyframes_only = keyframes_only;
+    int decoded_count = 0;
+    float decoded_fps = 0;
+    window_frames(decoded_count, decoded_fps);
+
+    double step = every_nth_frame;
+    if (target_fps > 0 && decoded_fps > target_fps) step = decoded_fps / target_fps;
+    char text[32];
+    snprintf(text, sizeof(text), "%.10g", step);
+    frame_step = atof(text);  // exactly the value ffmpeg's select filter gets
+    restart_window();
+    return true;
+}
+
+bool VideoCapture::set_range(int start_frame, int end_frame) {
+    if (source_fps == 0 && source_count == 0) {  // first call, keep the source values
+        source_fps = fps;
+        source_count = count;
+        source_duration = duration;
+    }
+    if (start_frame < 0 || (end_frame > 0 && end_frame <= start_frame)) return false;
+    if (source_count > 0 && start_frame >= source_count) return false;
+    if (source_count > 0 && end_frame >= source_count) end_frame = 0;
+    range_start = start_frame;
+    range_end = end_frame;
+    restart_window();
+    return true;
+}
+
+bool VideoCapture::set_time_range(double start_time, double end_time) {
+    if (start_time < 0 || (end_time > 0 && end_time <= start_time)) return false;
+    std::shared_ptr<const KeyframeIndex> index = get_keyframe_index(filename);
+    if (index) {  // the first frames shown at or after the two times
+        return set_range(index->frame_at(start_time), end_time > 0 ? index->frame_at(end_time) : 0);
+    }
+    const float decoded_fps = source_fps > 0 ? source_fps : fps;
+    if (decoded_fps <= 0) return false;
+    return set_range(int(std::ceil(start_time * decoded_fps - 1e-6)),
+        end_time > 0 ? int(std::ceil(end_time * decoded_fps - 1e-6)) : 0);
+}
+
+void VideoCapture::window_frames(int& decoded_count, float& decoded_fps) const {
+    const int end = range_end > 0 ? range_end : source_count;
+    decoded_count = end > range_start ? end - range_start : 0;  // 0 when the length is unknown
+    decoded_fps = source_fps;
+    if (keyframes_only && keyframe_index) {
+        const std::vector<int>& keyframes = keyframe_index->keyframes;
+        decoded_count = int((range_end > 0 ? std::lower_bound(keyframes.begin(), keyframes.end(), range_end) :
+            keyframes.end()) - std::lower_bound(keyframes.begin(), keyframes.end(), range_start));
+        decoded_fps = duration > 0 ? decoded_count / duration : 0;
+    }
+}
+
+std::string VideoCapture::window_seek_opt() const {
+    if (range_start <= 0) return "";
+    // Half a frame before the window: ffmpeg seeks to the keyframe at or before it,
+    // then drops the decoded frames shown earlier.
+    std::shared_ptr<const KeyframeIndex> index = get_keyframe_index(filename);
+    double seconds = 0;
+    if (index && range_start < (int)index->pts.size()) {
+        seconds = (index->pts[range_start - 1] + index->pts[range_start]) / 2 - index->start_time;
+    } else {
+        const float decoded_fps = source_fps > 0 ? source_fps : fps;
+        seconds = decoded_fps > 0 ? (range_start - 0.5) / decoded_fps : 0;
+    }
+    return "-ss " + std::to_string(seconds) + " ";
+}
+
+void VideoCapture::restart_window() {
+    const int end = range_end > 0 ? range_end : source_count;
+    if (range_start == 0 && range_end == 0) {
+        duration = source_duration;
+    } else {
+        duration = end > range_start && source_fps > 0 ? (end - range_start) / source_fps : 0;
+    }
+    int decoded_count = 0;
+    float decoded_fps = 0;
+    window_frames(decoded_count, decoded_fps);
+    fps = decoded_fps / frame_step;
+    count = decoded_count > 0 ? (int)std::floor((decoded_count - 1) / frame_step) + 1 : 0;
+    seek_opt = window_seek_opt();
+    select_offset = 0;
+    stop_process();
+    iframe = -1;
+    source_iframe = -1;
+    ffmpeg_cmd = compose_cmd();
+    waitInit = true;
+}
+
+bool VideoCapture::set_yuv_conversion(int nthreads, int matrix, int range) {
+    if (TensorConverter::supports(pix_fmt)) return false;  // its converter takes rgb24
+    if (nthreads < 0) {
+        converter.reset();
+    } else if (pix_fmt == "bgr24" || pix_fmt == "rgb24") {  // gray is already the smaller pipe
+        converter = std::make_shared<YUVConverter>(width, height, pix_fmt, nthreads, matrix, range);
+    } else {
+        return false;
+    }
+    select_offset = 0;
+    seek_opt = window_seek_opt();  // back to the start of the window
+    stop_process();
+    iframe = -1;
+    source_iframe = -1;
+    ffmpeg_cmd = compose_cmd();
+    waitInit = true;
+    return true;
+}
+
+bool VideoCapture::set_normalization(const std::vector<float>& mean, const std::vector<float>& stddev, float scale) {
+    if (!TensorConverter::supports(pix_fmt) || !TensorConverter::valid_normalization(mean, stddev)) return false;
+    converter = std::make_shared<TensorConverter>(width, height, pix_fmt, mean, stddev, scale);
+    return true;
+}
+
+int VideoCapture::source_frame(int iframe) const {
+    if (iframe < 0) return -1;
+    // the first decoded frame n with floor(n / step) == iframe, as the select filter sees it
+    int n = (int)std::ceil(iframe * frame_step - 1e-9);
+    while (std::floor(n / frame_step) < iframe) n++;
+    while (n > 0 && std::floor((n - 1) / frame_step) >= iframe) n--;
+    if (!keyframes_only) return range_start + n;
+    if (!keyframe_index) return -1;
+    const std::vector<int>& keyframes = keyframe_index->keyframes;
+    n += int(std::lower_bound(keyframes.begin(), keyframes.end(), range_start) - keyframes.begin());
+    return n < (int)keyframes.size() ? keyframes[n] : -1;
+}
+
+int VideoCapture::output_frame(int source_iframe) const {
+    int n = source_iframe - range_start;  // decoded frames of the window before it
+    if (keyframes_only && keyframe_index) {
+        const std::vector<int>& keyframes = keyframe_index->keyframes;
+        n = int(std::lower_bound(keyframes.begin(), keyframes.end(), source_iframe) -
+            std::lower_bound(keyframes.begin(), keyframes.end(), range_start));
+    }
+    return n > 0 ? (int)std::floor((n - 1) / frame_step) + 1 : 0;
+}
+
+bool VideoCapture::set(int propId, double value) {
+    if (propId == CAP_PROP_POS_FRAMES) return seek(int(value + 0.5));
+    if (propId == CAP_PROP_POS_MSEC) return seek_time(value / 1000);
+    return false;
+}
+
+double VideoCapture::get(int propId) {
+    switch (propId) {
+        case CAP_PROP_POS_MSEC: return fps > 0 ? (iframe + 1) * 1000.0 / fps : 0;
+        case CAP_PROP_POS_FRAMES: return iframe + 1;  // index of the next frame to read
+        case CAP_PROP_FRAME_WIDTH: return width;
+        case CAP_PROP_FRAME_HEIGHT: return height;
+        case CAP_PROP_FPS: return fps;
+        case CAP_PROP_FRAME_COUNT: return count;
+        default: return 0;
+    }
+}
+
+const int VideoCapture::size() {
+    return count;
+}
+
+const int VideoCapture::len() {
+    return count;
+}
+
+VideoCaptureStreamRT::VideoCaptureStreamRT():VideoCapture(){;}
+
+VideoCaptureStreamRT::VideoCaptureStreamRT(const std::string& filename, int isColor,
+    std::tuple<int, int, int, int> crop_xywh, Size_wh resize):
+    VideoCapture(){
+    this->filename = filename;
+    this->crop_xywh = crop_xywh;
+    this->resize = resize;
+    this->pix_fmt = isColor ? "bgr24" : "gray";
+    initializer();
+}
+
+VideoCaptureStreamRT::VideoCaptureStreamRT(const std::string& filename, std::string pix_fmt,
+    std::tuple<int, int, int, int> crop_xywh, Size_wh resize):
+    VideoCapture(){
+    this->filename = filename;
+    this->crop_xywh = crop_xywh;
+    this->resize = resize;
+    this->pix_fmt = pix_fmt;
+    initializer();
+}
+
+void VideoCaptureStreamRT::initializer() {
+    VideoInfo videoinfo = get_info_stream(filename);
+    origin_width = width = videoinfo.width;
+    origin_height = height = videoinfo.height;
+    codec = videoinfo.codec;
+    fps = videoinfo.fps;
+    duration = 0;
+    count = 0;
+    iframe = -1;
+    default_buffer = NULL;
+    waitInit = true;
+
+    assert(width % 2 == 0 && "Height must be even");
+    assert(height % 2 == 0 && "Width must be even");
+
+    // a tensor pix_fmt is converted from rgb24 in this process
+    const bool tensor = TensorConverter::supports(pix_fmt);
+    std::tuple<Size_wh, Size_wh, std::string> filter_options = get_videofilter_cpu(
+        {width, height}, tensor ? "rgb24" : pix_fmt, crop_xywh, resize);
+    size_wh = std::get<1>(filter_options);
+    filterstr = std::get<2>(filter_options);
+    width = size_wh.width;
+    height = size_wh.height;
+    if (tensor) converter = std::make_shared<TensorConverter>(width, height, pix_fmt);
+
+    // 初始化 ffmpeg 的 VideoCapture
+    ffmpeg_cmd = compose_cmd();
+    std::cout << "ffmpeg_cmd: " << ffmpeg_cmd << std::endl;
+
+    // 计算每帧的位数
+    outnumpyshape = get_outnumpyshape(size_wh, pix_fmt);
+    outdtype = get_outdtype(pix_fmt);
+    bytes_per_frame = get_dtype_bytes(outdtype);
+    for (int num : outnumpyshape) {
+        bytes_per_frame *= num;
+    }
+}
+
+std::string VideoCaptureStreamRT::compose_cmd() {
+    std::string rtsp_opt = startsWith(filename, "rtsp://") ? "-rtsp_flags prefer_tcp -pkt_size 736 " : "";
+    std::string lowdelay_opt = latest_only ?
+        "-fflags nobuffer -flags low_delay -probesize 32768 -analyzeduration 0 " : "";
+    std::ostringstream oss;
+    oss << "ffmpeg -y -loglevel warning " << rtsp_opt << lowdelay_opt
+        << "-i \"" << filename << "\" -an -map 0:v -f rawvideo "
+        << filterstr << " -pix_fmt " << (converter ? converter->input_pix_fmt() : pix_fmt) << " pipe:";
+    return oss.str();
+}
+
+void VideoCaptureStreamRT::open_process() {
+    if (!latest_only) {
+        VideoCapture::open_process();
+        return;
+    }
+    ffmpeg_cmd = compose_cmd();  // latest_only may have been set after the constructor
+    prefetch_frames = 0;
+    VideoCapture::open_process();
+    if (process) {
+        prefetcher = std::make_shared<FramePrefetcher>(process.get(), getFramePool(), 1, 0, converter, true);
+    }
+}
+
+VideoCaptureStreamRT::~VideoCaptureStreamRT() {
+    release();
+}
+
+void VideoCaptureStreamRT::release() {
+    // a live source never reaches EOF, and a stalled one would block the reader and close()
+    if (process) process->terminate();
+    VideoCapture::release();
+}
+
+bool VideoCaptureStreamRT::seek(int) {
+    return false;  // live streams cannot seek
+}
+
+bool VideoCaptureStreamRT::set_subsample(int, float, bool) {
+    return false;  // not supported for live streams
+}
+
+bool VideoCaptureStreamRT::set_range(int, int) {
+    return false;  // live streams cannot seek
+}
+
+VideoCaptureNoProbe::VideoCaptureNoProbe():VideoCapture(){;}
+
+VideoCaptureNoProbe::VideoCaptureNoProbe(const std::string& filename, int isColor,
+    std::tuple<int, int, int, int> crop_xywh, Size_wh resize):
+    VideoCapture(){
+    this->filename = filename;
+    this->crop_xywh = crop_xywh;
+    this->resize = resize;
+    this->pix_fmt = isColor ? "bgr24" : "gray";
+    initializer();
+}
+
+VideoCaptureNoProbe::VideoCaptureNoProbe(const std::string& filename, std::string pix_fmt,
+    std::tuple<int, int, int, int> crop_xywh, Size_wh resize):
+    VideoCapture(){
+    this->filename = filename;
+    this->crop_xywh = crop_xywh;
+    this->resize = resize;
+    this->pix_fmt = pix_fmt;
+    initializer();
+}
+
+void VideoCaptureNoProbe::initializer() {
+    io_stats = IOStats();
+    iframe = -1;
+    default_buffer = NULL;
+    waitInit = true;
+
+    // The source size is not known yet; the smallest frame holding the crop passes
+    // the checks in get_videofilter_cpu, and ffmpeg validates the crop itself.
+    const int crop_x = std::get<0>(crop_xywh), crop_y = std::get<1>(crop_xywh);
+    const int crop_w = std::get<2>(crop_xywh), crop_h = std::get<3>(crop_xywh);
+    const bool tensor = TensorConverter::supports(pix_fmt);
+    std::tuple<Size_wh, Size_wh, std::string> filter_options = get_videofilter_cpu(
+        {crop_x + crop_w, crop_y + crop_h}, tensor ? "rgb24" : pix_fmt, crop_xywh, resize);
+    filterstr = std::get<2>(filter_options);
+    if (tensor) converter = std::make_shared<TensorConverter>(0, 0, pix_fmt);  // sized below
+
+    loglevel_opt = "-hide_banner -nostats -loglevel level+info";
+    ffmpeg_cmd = compose_cmd();
+    std::cout << "ffmpeg_cmd: " << ffmpeg_cmd << std::endl;
+    IOStats::Clock::time_point start = IOStats::Clock::now();
+    process = open_pipe_process(ffmpeg_cmd, "r", pipe_size, use_popen, true);
+    io_stats.spawn_seconds = seconds_since(start);
+    io_stats.spawns = 1;
+    loglevel_opt = "-loglevel warning";  // restarts after seek() need no header
+    ffmpeg_cmd = compose_cmd();
+
+    VideoInfo videoinfo;
+    start = IOStats::Clock::now();
+    bool parsed = process && parse_ffmpeg_header(*process, videoinfo, size_wh);
+    io_stats.probe_seconds = seconds_since(start);
+    if (!parsed) {
+        if (process) process->close();
+        process.reset();
+        VideoCapture::initializer();
+        return;
+    }
+    // keep draining stderr, showing what -loglevel warning would have shown
+    process->forward_stderr([](const std::string& line) {
+        if (line.find("[info]") == std::string::npos && line.find("[verbose]") == std::string::npos) {
+            std::cerr << line << std::endl;
+        }
+    });
+
+    origin_width = videoinfo.width;
+    origin_height = videoinfo.height;
+    codec = videoinfo.codec;
+    fps = videoinfo.fps;
+    duration = videoinfo.duration;
+    count = 0;
+    width = size_wh.width;
+    height = size_wh.height;
+    if (tensor) converter = std::make_shared<TensorConverter>(width, height, pix_fmt);
+
+    outnumpyshape = get_outnumpyshape(size_wh, pix_fmt);
+    outdtype = get_outdtype(pix_fmt);
+    bytes_per_frame = get_dtype_bytes(outdtype);
+    for (int num : outnumpyshape) {
+        bytes_per_frame *= num;
+    }
+    process->set_pipe_size(pipe_size > 0 ? pipe_size : bytes_per_frame);
+}
+
+bool parse_ffmpeg_header(PipeProcess& process, VideoInfo& input, Size_wh& output) {
+    // Reads the stream dump ffmpeg prints at -loglevel info, up to the output video stream:
+    //   Duration: 00:00:20.00, start: 0.000000, bitrate: 59 kb/s
+    //   Stream #0:0(und): Video: h264 (High) (avc1 / 0x31637661), yuv420p(progressive), 640x480 [SAR 1:1 DAR 4:3], 30 fps, ...
+    //   Output #0, rawvideo, to 'pipe:':
+    //   Stream #0:0(und): Video: rawvideo (BGR[24] / 0x18524742), bgr24(...), 640x480 [SAR 1:1 DAR 4:3], ..., 30 fps, ...
+    bool in_output = false;
+    std::string line;
+    while (process.read_stderr_line(line)) {
+        if (line.find("Output #") != std::string::npos) {
+            in_output = true;
+            continue;
+        }
+        size_t pos = line.find("Duration: ");
+        if (!in_output && pos != std::string::npos) {
+            int h = 0, m = 0;
+            float sec = 0;
+            if (sscanf(line.c_str() + pos + 10, "%d:%d:%f", &h, &m, &sec) == 3) {
+                input.duration = h * 3600 + m * 60 + sec;
+            }
+            continue;
+        }
+        pos = line.find(" Video: ");
+        if (pos == std::string::npos) continue;
+
+        // ", "-separated fields; commas inside (...) belong to the pixel format
+        std::vector<std::string> fields;
+        int depth = 0;
+        size_t start = pos + 8;
+        for (size_t i = start; i <= line.size(); ++i) {
+            const char c = i < line.size() ? line[i] : ',';
+            if (c == '(') depth++;
+            if (c == ')') depth--;
+            if (c == ',' && depth <= 0) {
+                fields.push_back(line.substr(start, i - start));
+                start = i + 1;
+                while (start < line.size() && line[start] == ' ') start++;
+            }
+        }
+        Size_wh size;
+        float fps = 0;
+        for (const std::string& field : fields) {
+            int w = 0, h = 0;
+            char x = 0;
+            if (size.empty() && sscanf(field.c_str(), "%d%c%d", &w, &x, &h) == 3 && x == 'x') {
+                size = Size_wh(w, h);
+            }
+            const size_t unit = field.find(" fps");
+            if (unit != std::string::npos && unit + 4 == field.size()) fps = strtof(field.c_str(), NULL);
+            if (fps == 0 && field.size() > 4 && field.compare(field.size() - 4, 4, " tbr") == 0) {
+                fps = strtof(field.c_str(), NULL);
+            }
+        }
+        if (!in_output) {
+            if (input.width > 0) continue;  // first video stream only
+            input.codec = fields.empty() ? "" : fields[0].substr(0, fields[0].find(' '));
+            input.width = size.width;
+            input.height = size.height;
+            input.fps = fps;
+        } else {
+            output = size;
+            return input.width > 0 && !output.empty();
+        }
+    }
+    return false;
+}
+
+std::string get_filtergraph_cpu(Size_wh originsize, std::vector<VideoOutput>& outputs) {
+    std::ostringstream graph, maps;
+    graph << "[0:v]split=" << outputs.size();
+    for (size_t k = 0; k < outputs.size(); ++k) graph << "[s" << k << "]";
+    for (size_t k = 0; k < outputs.size(); ++k) {
+        VideoOutput& output = outputs[k];
+        std::tuple<Size_wh, Size_wh, std::string> filter_options = get_videofilter_cpu(
+            originsize, output.pix_fmt, output.crop_xywh, output.resize);
+        output.size_wh = std::get<1>(filter_options);
+        output.bytes_per_frame = 1;
+        for (int num : get_outnumpyshape(output.size_wh, output.pix_fmt)) {
+            output.bytes_per_frame *= num;
+        }
+        std::string chain = std::get<2>(filter_options);  // "-vf a,b" or ""
+        chain = chain.empty() ? "null" : chain.substr(4);
+        graph << ";[s" << k << "]" << chain << "[v" << k << "]";
+        maps << " -map \"[v" << k << "]\" -f rawvideo -pix_fmt " << output.pix_fmt
+             << " pipe:" << (k == 0 ? 1 : k + 2);
+    }
+    return "-filter_complex \"" + graph.str() + "\"" + maps.str();
+}
+
+VideoCaptureMulti::VideoCaptureMulti(){;}
+
+VideoCaptureMulti::VideoCaptureMulti(const std::string& filename, const std::vector<VideoOutput>& outputs):
+    filename(filename), outputs(outputs){
+    initializer();
+}
+
+VideoCaptureMulti::~VideoCaptureMulti() {
+    release();
+}
+
+void VideoCaptureMulti::initializer() {
+    assert(!outputs.empty() && "At least one output is required");
+    VideoInfo videoinfo = get_info(filename);
+    origin_width = videoinfo.width;
+    origin_height = videoinfo.height;
+    codec = videoinfo.codec;
+    fps = videoinfo.fps;
+    duration = videoinfo.duration;
+    count = videoinfo.count;
+    iframe = -1;
+    waitInit = true;
+
+    assert(origin_width % 2 == 0 && "Height must be even");
+    assert(origin_height % 2 == 0 && "Width must be even");
+
+    filterstr = get_filtergraph_cpu({origin_width, origin_height}, outputs);
+    ffmpeg_cmd = compose_cmd();
+    std::cout << "ffmpeg_cmd: " << ffmpeg_cmd << std::endl;
+}
+
+std::string VideoCaptureMulti::compose_cmd() {
+    std::ostringstream oss;
+    oss << "ffmpeg -y -loglevel warning -i \"" << filename << "\" " << filterstr;
+    return oss.str();
+}
+
+void VideoCaptureMulti::open_process() {
+    waitInit = false;
+    int pipe_size = 0;
+    for (const VideoOutput& output : outputs) pipe_size = std::max(pipe_size, output.bytes_per_frame);
+    process = open_pipe_process(ffmpeg_cmd, "r", pipe_size, use_popen, false, (int)outputs.size() - 1);
+    if (process) {
+        for (size_t k = 0; k < outputs.size(); ++k) {
+            // every view needs its own reader, or ffmpeg stalls on the one nobody drains
+            prefetchers.push_back(std::make_shared<FramePrefetcher>(
+                process.get(), FramePool(outputs[k].bytes_per_frame), std::max(prefetch_frames, 1), (int)k));
+        }
+        return;
+    }
+    for (const VideoOutput& output : outputs) {
+        std::shared_ptr<VideoCapture> cap = std::make_shared<VideoCapture>(
+            filename, output.pix_fmt, output.crop_xywh, output.resize);
+        cap->use_popen = use_popen;
+        fallback_caps.push_back(cap);
+    }
+}
+
+void VideoCaptureMulti::release() {
+    if (process) process->terminate();  // a view stopped early must not block the other readers
+    for (auto& prefetcher : prefetchers) prefetcher->stop();
+    prefetchers.clear();
+    held_frames.clear();
+    if (process) {
+        process->close();
+        process.reset();
+    }
+    for (auto& cap : fallback_caps) cap->release();
+    fallback_caps.clear();
+}
+
+void VideoCaptureMulti::close() {
+    release();
+}
+
+bool VideoCaptureMulti::read(std::vector<Frame>& frames) {
+    if (waitInit) {
+        open_process();
+    }
+    frames.resize(outputs.size());
+    bool success = !prefetchers.empty() || !fallback_caps.empty();
+    for (size_t k = 0; success && k < prefetchers.size(); ++k) {
+        success = prefetchers[k]->next(frames[k]);
+    }
+    for (size_t k = 0; success && k < fallback_caps.size(); ++k) {
+        success = fallback_caps[k]->read(frames[k]);
+    }
+    if (!success) {
+        frames.clear();
+        release();
+        return false;
+    }
+    iframe += 1;
+    return true;
+}
+
+bool VideoCaptureMulti::read(const std::vector<void*>& buffers) {
+    assert(buffers.size() == outputs.size());
+    if (!read(held_frames)) return false;
+    for (size_t k = 0; k < outputs.size(); ++k) {
+        memcpy(buffers[k], held_frames[k].data(), outputs[k].bytes_per_frame);
+    }
+    return true;
+}
+
+bool VideoCaptureMulti::isOpened() {
+    return process != nullptr || !fallback_caps.empty() || waitInit;
+}
+
+ParallelVideoCapture::ParallelVideoCapture():VideoCapture(){;}
+
+ParallelVideoCapture::ParallelVideoCapture(const std::string& filename, int nsegments, int isColor,
+    std::tuple<int, int, int, int> crop_xywh, Size_wh resize):
+    VideoCapture(){
+    this->filename = filename;
+    this->nsegments = nsegments;
+    this->crop_xywh = crop_xywh;
+    this->resize = resize;
+    this->pix_fmt = isColor ? "bgr24" : "gray";
+    initializer();
+}
+
+ParallelVideoCapture::ParallelVideoCapture(const std::string& filename, int nsegments, std::string pix_fmt,
+    std::tuple<int, int, int, int> crop_xywh, Size_wh resize):
+    VideoCapture(){
+    this->filename = filename;
+    this->nsegments = nsegments;
+    this->crop_xywh = crop_xywh;
+    this->resize = resize;
+    this->pix_fmt = pix_fmt;
+    initializer();
+}
+
+ParallelVideoCapture::~ParallelVideoCapture() {
+    release();
+}
+
+void ParallelVideoCapture::initializer() {
+    VideoCapture::initializer();  // geometry and filters exactly as VideoCapture
+    if (prefetch_frames <= 0) prefetch_frames = 4;
+
+    // Cut at the keyframes nearest below i * frames / N; each cut is a segment start.
+    segment_starts = {0};
+    std::shared_ptr<const KeyframeIndex> index = get_keyframe_index(filename);
+    const int nframes = index ? (int)index->pts.size() : count;
+    for (int k = 1; index && k < nsegments; ++k) {
+        const int start = index->keyframe_before((int)((long long)nframes * k / nsegments));
+        if (start > segment_starts.back()) segment_starts.push_back(start);
+    }
+    segment_starts.push_back(nframes);
+}
+
+void ParallelVideoCapture::start_segments() {
+    waitInit = false;
+    current_segment = 0;
+    const int nsegment = (int)segment_starts.size() - 1;
+    std::shared_ptr<const KeyframeIndex> index = get_keyframe_index(filename);
+    for (int k = 0; k < nsegment; ++k) {
+        // a plain VideoCapture with this capture's settings, started at the segment's keyframe
+        std::shared_ptr<VideoCapture> segment = std::make_shared<VideoCapture>(static_cast<const VideoCapture&>(*this));
+        segment->default_buffer = NULL;
+        segment->frame_pool = FramePool(bytes_per_frame);
+        segment->prefetch_frames = 0;
+        seek_opt = k > 0 ? "-noaccurate_seek -ss " + std::to_string(index->seek_time(segment_starts[k])) + " " : "";
+        segment->ffmpeg_cmd = compose_cmd();
+        segment->seek_opt = seek_opt;
+        segment->iframe = segment_starts[k] - 1;
+        segment->waitInit = true;
+        segments.push_back(segment);
+        if (ordered || k == 0) {
+            queues.push_back(std::make_shared<BoundedQueue<IndexedFrame>>(
+                ordered ? prefetch_frames : prefetch_frames * nsegment));
+        }
+    }
+    seek_opt = "";
+    running = nsegment;
+    for (int k = 0; k < nsegment; ++k) {
+        workers.push_back(std::thread(&ParallelVideoCapture::decode_segment, this, k));
+    }
+}
+
+void ParallelVideoCapture::decode_segment(int k) {
+    VideoCapture& segment = *segments[k];
+    BoundedQueue<IndexedFrame>& queue = ordered ? *queues[k] : *queues[0];
+    const bool last = k + 2 == (int)segment_starts.size();
+    const int nframes = segment_starts[k + 1] - segment_starts[k];
+    for (int i = 0; last || i < nframes; ++i) {  // the last segment runs to the end of the file
+        IndexedFrame item;
+        if (!segment.read(item.frame)) break;
+        item.iframe = segment.iframe;
+        if (!queue.push(item)) break;
+    }
+    if (segment.process) segment.process->terminate();  // stopped before the end of the file
+    segment.release();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (ordered || --running == 0) queue.close();
+}
+
+void ParallelVideoCapture::release() {
+    if (!workers.empty()) dump_stats(stats_file, "capture", filename, io_stats);
+    for (auto& queue : queues) queue->close();  // wakes workers waiting for room
+    for (auto& worker : workers) worker.join();
+    workers.clear();
+    queues.clear();
+    segments.clear();
+    VideoCapture::release();
+}
+
+bool ParallelVideoCapture::read(Frame& frame) {
+    assert(ordered && "use read_unordered()");
+    if (waitInit) {
+        start_segments();
+    }
+    IOStats::Clock::time_point start = IOStats::Clock::now();
+    while (current_segment < queues.size()) {
+        IndexedFrame item;
+        if (queues[current_segment]->pop(item)) {
+            io_stats.add_frames(1, bytes_per_frame, start, IOStats::Clock::now());
+            frame = item.frame;
+            iframe = source_iframe = item.iframe;
+            return true;
+        }
+        current_segment++;
+    }
+    frame = Frame();
+    release();
+    return false;
+}
+
+bool ParallelVideoCapture::read_unordered(Frame& frame, int& frame_index) {
+    assert(!ordered && "set ordered = false before the first read");
+    if (waitInit) {
+        start_segments();
+    }
+    IndexedFrame item;
+    IOStats::Clock::time_point start = IOStats::Clock::now();
+    if (queues.empty() || !queues[0]->pop(item)) {
+        frame = Frame();
+        release();
+        return false;
+    }
+    io_stats.add_frames(1, bytes_per_frame, start, IOStats::Clock::now());
+    frame = item.frame;
+    frame_index = item.iframe;
+    return true;
+}
+
+bool ParallelVideoCapture::read(void * frame) {
+    Frame ready;
+    if (!read(ready)) return false;
+    memcpy(frame, ready.data(), bytes_per_frame);
+    return true;
+}
+
+std::tuple<bool, void *> ParallelVideoCapture::read() {
+    held_frame = Frame();
+    bool success = read(held_frame);
+    return std::make_tuple(success, static_cast<void *>(held_frame.data()));
+}
+
+bool ParallelVideoCapture::isOpened() {
+    return waitInit || !queues.empty();
+}
+
+bool ParallelVideoCapture::seek(int) {
+    return false;  // open a new capture instead
+}
+
+bool ParallelVideoCapture::set_subsample(int, float, bool) {
+    return false;
+}
+
+bool ParallelVideoCapture::set_range(int, int) {
+    return false;  // open a new capture instead
+}
+
+bool ParallelVideoCapture::set_yuv_conversion(int, int, int) {
+    return false;
+}
+
+CapturePool::CapturePool(){;}
+
+CapturePool::CapturePool(const std::vector<std::string>& files, int max_processes, std::string pix_fmt,
+    std::tuple<int, int, int, int> crop_xywh, Size_wh resize):
+    files(files), max_processes(max_processes), pix_fmt(pix_fmt), crop_xywh(crop_xywh), resize(resize){;}
+
+CapturePool::~CapturePool() {
+    release();
+}
+
+void CapturePool::start() {
+    if (started) return;
+    started = true;
+    const int nworkers = max_processes > 0 ? max_processes : std::max(1, (int)std::thread::hardware_concurrency());
+    running = nworkers;
+    for (int k = 0; k < nworkers; ++k) {
+        workers.push_back(std::thread(&CapturePool::work, this));
+    }
+}
+
+void CapturePool::work() {
+    for (;;) {
+        std::shared_ptr<Clip> clip = next_clip();
+        if (!clip) break;
+        decode_clip(*clip);
+        std::lock_guard<std::mutex> lock(mutex);
+        clip->end = clip->position;  // nothing left to split
+        active_clips.erase(std::find(active_clips.begin(), active_clips.end(), clip));
+        clips_changed.notify_all();
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--running == 0) frame_ready.notify_all();
+}
+
+std::shared_ptr<CapturePool::Clip> CapturePool::next_clip() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!stopping && next_file < files.size()) {
+        std::shared_ptr<Clip> clip = std::make_shared<Clip>();
+        clip->file_index = (int)next_file++;
+        active_clips.push_back(clip);
+        return clip;
+    }
+
+    // No file left: take the back half of the clip with the most frames to go.
+    while (!stopping) {
+        std::shared_ptr<Clip> victim;
+        int most = 0;
+        bool unprobed = false;
+        for (auto& clip : active_clips) {
+            unprobed = unprobed || !clip->probed;
+            if (!clip->probed || !clip->splittable) continue;
+            const int remaining = (clip->end >= 0 ? clip->end : clip->length) - clip->position;
+            if (remaining > most) {
+                most = remaining;
+                victim = clip;
+            }
+        }
+        if (!victim || most < 2 * min_steal_frames) {
+            if (!unprobed) return nullptr;
+            clips_changed.wait(lock);  // a clip still opening may be worth splitting
+            continue;
+        }
+
+        const int file_index = victim->file_index;
+        lock.unlock();
+        std::shared_ptr<const KeyframeIndex> index = get_keyframe_index(files[file_index]);
+        lock.lock();
+        const int end = victim->end >= 0 ? victim->end : (index ? (int)index->pts.size() : 0);
+        const int cut = index ? index->keyframe_before(victim->position + (end - victim->position) / 2) : 0;
+        if (stopping || cut <= victim->position || end - cut < min_steal_frames) {
+            victim->splittable = false;
+            continue;
+        }
+        std::shared_ptr<Clip> clip = std::make_shared<Clip>();
+        clip->file_index = file_index;
+        clip->begin = clip->position = cut;
+        clip->end = victim->end;
+        clip->length = (int)index->pts.size();
+        victim->end = cut;  // the victim stops before the cut, checked ahead of each frame
+        active_clips.push_back(clip);
+        return clip;
+    }
+    return nullptr;
+}
+
+void CapturePool::decode_clip(Clip& clip) {
+    const std::string& filename = files[clip.file_index];
+    VideoCapture cap;
+    cap.filename = filename;
+    cap.pix_fmt = pix_fmt;
+    cap.crop_xywh = crop_xywh;
+    cap.resize = resize;
+    bool opened = file_exsits(filename);
+    if (opened) {
+        cap.initializer();
+        opened = cap.bytes_per_frame > 0 && (clip.begin == 0 || cap.seek(clip.begin));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (clip.begin == 0) clip.length = cap.count;
+        clip.probed = true;
+        if (!opened) {
+            std::cerr << "CapturePool: cannot open " << filename << std::endl;
+            failed_files.push_back(clip.file_index);
+            clip.splittable = false;
+        }
+        clips_changed.notify_all();
+    }
+
+    bool cut_short = false;
+    while (opened) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cut_short = stopping || (clip.end >= 0 && clip.position >= clip.end);
+            if (cut_short) break;
+        }
+        reserve_bytes(cap.bytes_per_frame);
+        ClipFrame item;
+        if (!cap.read(item.frame)) {
+            release_bytes(cap.bytes_per_frame);
+            break;
+        }
+        item.file_index = clip.file_index;
+        item.iframe = cap.iframe;
+        item.width = cap.width;
+        item.height = cap.height;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            clip.position = cap.iframe + 1;
+        }
+        deliver(item);
+    }
+    if (cut_short && cap.process) cap.process->terminate();  // not decoding to the end
+    cap.release();
+}
+
+void CapturePool::deliver(ClipFrame& frame) {
+    if (callback) {
+        const size_t nbytes = frame.frame.size();
+        callback(frame);
+        release_bytes(nbytes);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    ready_frames.push_back(std::move(frame));
+    frame_ready.notify_one();
+}
+
+void CapturePool::reserve_bytes(size_t nbytes) {
+    std::unique_lock<std::mutex> lock(mutex);
+    bytes_freed.wait(lock, [&] {  // a single frame larger than the budget still passes alone
+        return stopping || bytes_in_flight == 0 || bytes_in_flight + nbytes <= max_bytes_in_flight;
+    });
+    bytes_in_flight += nbytes;
+}
+
+void CapturePool::release_bytes(size_t nbytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    bytes_in_flight -= nbytes;
+    bytes_freed.notify_all();
+}
+
+bool CapturePool::read(ClipFrame& frame) {
+    assert(!callback && "run() delivers the frames");
+    if (!started) {
+        start();
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    frame_ready.wait(lock, [this] { return !ready_frames.empty() || running == 0 || stopping; });
+    if (ready_frames.empty()) {
+        lock.unlock();
+        frame = ClipFrame();
+        release();
+        return false;
+    }
+    frame = std::move(ready_frames.front());
+    ready_frames.pop_front();
+    bytes_in_flight -= frame.frame.size();
+    bytes_freed.notify_all();
+    return true;
 }
 
-VideoWriterNV::VideoWriterNV(const std::string& filename, const std::string& codec, double fps, Size_wh size_wh, std::string pix_fmt,
-        std::string ffmpeg_output_opt, int gpu){
-    this->filename = filename;
-    this->codec = codec;
-    this->fps = fps;
-    this->size_wh = size_wh;
-    this->pix_fmt = pix_fmt;
-    this->ffmpeg_output_opt = ffmpeg_output_opt;
-    this->gpu = gpu;
-    initializer();
+void CapturePool::run(const std::function<void(ClipFrame&)>& callback) {
+    assert(!started && "run() cannot follow read()");
+    this->callback = callback;
+    start();
+    for (auto& worker : workers) worker.join();
+    workers.clear();
+    this->callback = nullptr;
+    release();
 }
 
+void CapturePool::release() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        bytes_freed.notify_all();
+        clips_changed.notify_all();
+        frame_ready.notify_all();
+    }
+    for (auto& worker : workers) worker.join();
+    workers.clear();
+    ready_frames.clear();
+    active_clips.clear();
+    bytes_in_flight = 0;
+}
 
-void VideoWriterNV::initializer(){
-    int numGPU = get_num_NVIDIA_GPUs();
-    assert (numGPU > 0 && "No NVIDIA GPU found");
-    gpu = gpu % numGPU;
+bool CapturePool::isOpened() {
+    return !stopping;
+}
 
-    codec = codec.empty() ? "h264" : codec;
-    std::string codec_gpu = encoder_to_nvidia(codec);
-    width = size_wh.width;
-    height = size_wh.height;
-    process = 0;
-    std::string rtsp_str = startsWith(filename, "rtsp://") ? " -f rtsp -rtsp_transport tcp " : " ";
+std::string decoder_to_nvidia(const std::string& codec) {
+    if (codec == "av1")  return "av1_cuvid";
+    if (codec == "h264") return "h264_cuvid";
+    if (codec == "x264") return "h264_cuvid";
+    if (codec == "hevc") return "hevc_cuvid";
+    if (codec == "x265") return "hevc_cuvid";
+    if (codec == "h265") return "hevc_cuvid";
+    if (codec == "mjpeg") return "mjpeg_cuvid";
+    if (codec == "mpeg1video") return "mpeg1_cuvid";
+    if (codec == "mpeg2video") return "mpeg2_cuvid";
+    if (codec == "mpeg4") return "mpeg4_cuvid";
+    if (codec == "vp1") return "vp1_cuvid";
+    if (codec == "vp8") return "vp8_cuvid";
+    if (codec == "vp9") return "vp9_cuvid";
+    throw std::runtime_error("No NV codec found for " + codec);
+}
 
-    std::ostringstream oss;
-    oss << "ffmpeg -y -loglevel warning -f rawvideo -pix_fmt " << pix_fmt
-        << " -s " << width << "x" << height << " -r " << fps
-        << " -i pipe: -c:v " << codec_gpu << " -gpu " << gpu
-        << " -pix_fmt " << output_pix_fmt
-        << ffmpeg_output_opt << rtsp_str << " \"" << filename << "\"";
-    ffmpeg_cmd = oss.str();
-    std::cout << "ffmpeg_cmd: " << ffmpeg_cmd << std::endl;
+std::string encoder_to_nvidia(const std::string& codec) {
+    if (codec == "")  return "hevc_nvenc";
+    if (codec == "h264") return "h264_nvenc";
+    if (codec == "x264") return "h264_nvenc";
+    if (codec == "hevc") return "hevc_nvenc";
+    if (codec == "x265") return "hevc_nvenc";
+    if (codec == "h265") return "hevc_nvenc";
+    return codec + "_nvenc";
+}
 
-    innumpyshape = get_outnumpyshape(size_wh, pix_fmt);
-    bytes_per_frame = 1;
-    for (int num : innumpyshape) {
-        bytes_per_frame *= num;
+int get_num_NVIDIA_GPUs() {
+    static int num_NVIDIA_GPUs = -1;
+    if (num_NVIDIA_GPUs == -1) {
+        std::cout << "Getting number of NVIDIA GPUs...\n";
+        std::string cmd = "ffmpeg -f lavfi -i nullsrc -c:v h264_nvenc -gpu list -f null - 2>&1";
+        std::string output = execute_command(cmd);
+
+        std::regex pattern(R"(GPU #\d+ - < )");
+        auto nv_info_begin = std::sregex_iterator(output.begin(), output.end(), pattern);
+        auto nv_info_end = std::sregex_iterator();
+
+        num_NVIDIA_GPUs = std::distance(nv_info_begin, nv_info_end);
     }
+    return num_NVIDIA_GPUs;
 }
-//================End Video Writer==================
 
-//================Begin Video Reader==================
-std::tuple<Size_wh, Size_wh, std::string> get_videofilter_cpu(
-    Size_wh originsize, std::string pix_fmt, std::tuple<int, int, int, int> crop_xywh, Size_wh resize) {
+
+std::tuple<Size_wh, Size_wh, std::string, std::string> get_videofilter_gpu(
+    Size_wh originsize, std::string pix_fmt, std::tuple<int, int, int, int> crop_xywh, Size_wh resize
+){
     static const std::vector<std::string> allowed_pix_fmts = {"rgb24", "bgr24", "yuv420p", "yuvj420p", "nv12", "gray"};
     assert(std::find(allowed_pix_fmts.begin(), allowed_pix_fmts.end(), pix_fmt) != allowed_pix_fmts.end());
     int origin_width = originsize.width;
@@ -536,8 +5421,12 @@ std::tuple<Size_wh, Size_wh, std::string> get_videofilter_cpu(
     if (crop_w != 0 && crop_h != 0) {
         assert(crop_x % 2 == 0 && crop_y % 2 == 0 && crop_w % 2 == 0 && crop_h % 2 == 0);
         assert(crop_w <= origin_width && crop_h <= origin_height);
-        cropopt = "crop=" + std::to_string(crop_w) + ":" + std::to_string(crop_h) +
-                    ":" + std::to_string(crop_x) + ":" + std::to_string(crop_y);
+        int top(crop_y);
+        int left(crop_x);
+        int bottom(origin_height - (crop_h + crop_y));
+        int right(origin_width - (crop_x + crop_w));
+        cropopt = "-crop" + std::to_string(top) + "x" + std::to_string(bottom) +
+                    "x" + std::to_string(left) + "x" + std::to_string(right);
     } else {
         crop_w = origin_width;
         crop_h = origin_height;
@@ -551,43 +5440,57 @@ std::tuple<Size_wh, Size_wh, std::string> get_videofilter_cpu(
     if (!resize.empty() && (resize_width != 0 || resize_height != 0)) {
         assert (resize_width % 2 == 0 && resize_height % 2 == 0);
         final_size_wh = resize;
-        scaleopt = "scale=" + std::to_string(resize_width) + "x" + std::to_string(resize_height);
+        scaleopt = "-resize " + std::to_string(resize_width) + "x" + std::to_string(resize_height);
     }
 
-    std::string pix_fmt_opt = (pix_fmt == "gray") ? "extractplanes=y" : "";
+    std::string inputstr = cropopt + " " + scaleopt;
     std::string filterstr = "";
-    if (!cropopt.empty() || !scaleopt.empty() || !pix_fmt_opt.empty()) {
-        filterstr = "-vf ";
-        if (!cropopt.empty()) filterstr += cropopt + ",";
-        if (!scaleopt.empty()) filterstr += scaleopt + ",";
-        if (!pix_fmt_opt.empty()) filterstr += pix_fmt_opt + ",";
-        filterstr = filterstr.substr(0, filterstr.size() - 1);
+    std::string pix_fmt_opt = (pix_fmt == "gray") ? "extractplanes=y" : "";
+    if (!pix_fmt_opt.empty()) {
+        filterstr = "-vf " + pix_fmt_opt;
     }
-    return std::make_tuple(cropsize, final_size_wh, filterstr);
+    return std::make_tuple(cropsize, final_size_wh, inputstr, filterstr);
 }
 
-VideoCapture::VideoCapture(){;}
 
-VideoCapture::VideoCapture(const std::string& filename, int isColor,
-    std::tuple<int, int, int, int> crop_xywh, Size_wh resize):
-    filename(filename), pix_fmt(isColor ? "bgr24" : "gray"), crop_xywh(crop_xywh), resize(resize){
+VideoCaptureNV::VideoCaptureNV():VideoCapture(){;}
+
+VideoCaptureNV::VideoCaptureNV(const std::string& filename, int isColor,
+    std::tuple<int, int, int, int> crop_xywh, Size_wh resize, int gpu):
+    VideoCapture(){
+    this->filename = filename;
+    this->crop_xywh = crop_xywh;
+    this->resize = resize;
+    this->pix_fmt = isColor ? "bgr24" : "gray";
+    this->gpu = gpu;
     initializer();
 }
 
-VideoCapture::VideoCapture(const std::string& filename, std::string pix_fmt,
-    std::tuple<int, int, int, int> crop_xywh, Size_wh resize):
-    filename(filename), pix_fmt(pix_fmt), crop_xywh(crop_xywh), resize(resize){
+VideoCaptureNV::VideoCaptureNV(const std::string& filename, std::string pix_fmt,
+    std::tuple<int, int, int, int> crop_xywh, Size_wh resize, int gpu):
+    VideoCapture(){
+    this->filename = filename;
+    this->crop_xywh = crop_xywh;
+    this->resize = resize;
+    this->pix_fmt = pix_fmt;
+    this->gpu = gpu;
     initializer();
 }
 
-void VideoCapture::initializer(){
+
+void VideoCaptureNV::initializer() {
+    int numGPU = get_num_NVIDIA_GPUs();
+    assert (numGPU > 0 && "No NVIDIA GPU found");
+    gpu = gpu % numGPU;
+
     VideoInfo videoinfo = get_info(filename);
     origin_width = width = videoinfo.width;
     origin_height = height = videoinfo.height;
     codec = videoinfo.codec;
+    codec = decoder_to_nvidia(codec);
     fps = videoinfo.fps;
-    duration = videoinfo.duration;
-    count = videoinfo.count;
+    duration = 0;
+    count = 0;
     iframe = -1;
     default_buffer = NULL;
     waitInit = true;
@@ -595,19 +5498,16 @@ void VideoCapture::initializer(){
     assert(width % 2 == 0 && "Height must be even");
     assert(height % 2 == 0 && "Width must be even");
 
-    std::tuple<Size_wh, Size_wh, std::string> filter_options = get_videofilter_cpu(
+    std::tuple<Size_wh, Size_wh, std::string, std::string> filter_options = get_videofilter_gpu(
         {width, height}, pix_fmt, crop_xywh, resize);
     size_wh = std::get<1>(filter_options);
-    std::string filterstr = std::get<2>(filter_options);
+    inputstr = std::get<2>(filter_options);
+    filterstr = std::get<3>(filter_options);
     width = size_wh.width;
     height = size_wh.height;
 
     // 初始化 ffmpeg 的 VideoCapture
-    std::ostringstream oss;
-    oss << "ffmpeg -y -loglevel warning -i \"" << filename << "\" -f rawvideo "
-        << filterstr << " -pix_fmt " << pix_fmt << " pipe:";
-
-    ffmpeg_cmd = oss.str();
+    ffmpeg_cmd = compose_cmd();
     std::cout << "ffmpeg_cmd: " << ffmpeg_cmd << std::endl;
 
     // 计算每帧的位数
@@ -618,77 +5518,420 @@ void VideoCapture::initializer(){
     }
 }
 
+bool VideoCaptureNV::set_subsample(int, float, bool) {
+    return false;  // not supported with the cuda filter chain
+}
 
-VideoCapture::~VideoCapture() {
-    release();
+bool VideoCaptureNV::set_yuv_conversion(int, int, int) {
+    return false;  // not supported with the cuda filter chain
 }
 
-void VideoCapture::release() {
-    if (default_buffer) {
-        free(default_buffer);
-        default_buffer = NULL;
+std::string VideoCaptureNV::compose_cmd() {
+    std::string end_opt = "";
+    if (range_end > 0 && count > 0) end_opt = "-frames:v " + std::to_string(count - iframe - 1) + " ";
+    std::ostringstream oss;
+    oss << "ffmpeg -loglevel warning -hwaccel cuda -hwaccel_device "
+        << gpu << " -vcodec " << codec << " " << inputstr << " " << seek_opt << "-i \""
+        << filename << "\" -f rawvideo " << end_opt
+        << filterstr << " -pix_fmt " << pix_fmt << " pipe:";
+    return oss.str();
+}
+
+//================ Begin Frame cache ==================
+
+FrameCache::FrameCache(const std::string& directory, long long budget_bytes):
+    directory(directory), budget_bytes(budget_bytes) {}
+
+std::string FrameCache::path_for(const std::string& key) const {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.ffcv", (unsigned long long)std::hash<std::string>()(key));
+    return (directory.empty() ? std::string(".") : directory) + "/" + name;
+}
+
+struct CacheFileEntry {
+    std::string path;
+    long long size;
+    long long mtime_ns;
+};
+
+std::vector<CacheFileEntry> list_cache_files(const std::string& directory) {
+    std::vector<CacheFileEntry> files;
+#ifdef __linux__
+    const std::string dirname = directory.empty() ? "." : directory;
+    DIR* dir = opendir(dirname.c_str());
+    if (!dir) return files;
+    while (struct dirent* entry = readdir(dir)) {
+        const std::string name = entry->d_name;
+        if (name.size() < 5 || name.compare(name.size() - 5, 5, ".ffcv") != 0) continue;
+        const std::string path = dirname + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) continue;
+        CacheFileEntry file = {path, (long long)st.st_size,
+            (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec};
+        files.push_back(file);
     }
-    if (process) {
-        PCLOSE(process);
-        process = NULL;
+    closedir(dir);
+#endif
+    return files;
+}
+
+bool FrameCache::make_room(long long nbytes, const std::string& keep) const {
+    if (budget_bytes <= 0) return true;
+    if (nbytes > budget_bytes) return false;
+    std::vector<CacheFileEntry> files = list_cache_files(directory);
+    std::sort(files.begin(), files.end(), [](const CacheFileEntry& a, const CacheFileEntry& b) {
+        return a.mtime_ns < b.mtime_ns;
+    });
+    long long total = nbytes;
+    for (const CacheFileEntry& file : files) total += file.size;
+    for (const CacheFileEntry& file : files) {  // least recently used first
+        if (total <= budget_bytes) break;
+        if (file.path == keep) continue;
+        if (remove(file.path.c_str()) == 0) total -= file.size;  // a reader keeps its mapping
     }
+    return total <= budget_bytes;
 }
 
-void VideoCapture::close() {
+long long FrameCache::used_bytes() const {
+    long long total = 0;
+    for (const CacheFileEntry& file : list_cache_files(directory)) total += file.size;
+    return total;
+}
+
+void FrameCache::touch(const std::string& path) const {
+#ifdef __linux__
+    utime(path.c_str(), NULL);
+#endif
+}
+
+VideoCaptureCached::VideoCaptureCached():VideoCapture(){;}
+
+VideoCaptureCached::VideoCaptureCached(const std::string& filename, const FrameCache& cache, int isColor,
+    std::tuple<int, int, int, int> crop_xywh, Size_wh resize):
+    VideoCapture(){
+    this->filename = filename;
+    this->cache = cache;
+    this->crop_xywh = crop_xywh;
+    this->resize = resize;
+    this->pix_fmt = isColor ? "bgr24" : "gray";
+    initializer();
+}
+
+VideoCaptureCached::VideoCaptureCached(const std::string& filename, const FrameCache& cache, std::string pix_fmt,
+    std::tuple<int, int, int, int> crop_xywh, Size_wh resize):
+    VideoCapture(){
+    this->filename = filename;
+    this->cache = cache;
+    this->crop_xywh = crop_xywh;
+    this->resize = resize;
+    this->pix_fmt = pix_fmt;
+    initializer();
+}
+
+VideoCaptureCached::~VideoCaptureCached() {
     release();
 }
 
-uint8_t* VideoCapture::getBuffer() {
-    if (default_buffer == NULL){
-        default_buffer = (void*)malloc(bytes_per_frame);
+void VideoCaptureCached::initializer() {
+    io_stats = IOStats();
+    long long size = 0, mtime = 0;
+    if (file_signature(filename, size, mtime)) {
+        // the source file and everything that changes the output bytes
+        std::ostringstream key;
+        key << absolute_path(filename) << '\n' << size << ' ' << mtime << ' ' << pix_fmt << ' '
+            << std::get<0>(crop_xywh) << ',' << std::get<1>(crop_xywh) << ','
+            << std::get<2>(crop_xywh) << ',' << std::get<3>(crop_xywh) << ' '
+            << resize.width << 'x' << resize.height;
+        cache_key = key.str();
+        cache_path = cache.path_for(cache_key);
+        if (open_cached()) return;
     }
-    return static_cast<uint8_t*>(default_buffer);
+    VideoCapture::initializer();
+    if (!cache_key.empty()) start_writing();
 }
 
-bool VideoCapture::read(void * frame) {
-    if (waitInit){
-        process = POPEN_R(ffmpeg_cmd.c_str());
-        waitInit = false;
+bool VideoCaptureCached::open_cached() {
+#ifdef __linux__
+    int fd = ::open(cache_path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    FrameCacheHeader h;
+    struct stat st;
+    bool valid = ::read(fd, &h, sizeof(h)) == (ssize_t)sizeof(h) && memcmp(h.magic, "FFCVRAW", 8) == 0 &&
+        h.version == FRAME_CACHE_VERSION && h.count > 0 && h.ndim > 0 && h.ndim <= 4 &&
+        h.key_bytes == cache_key.size() && fstat(fd, &st) == 0 &&
+        st.st_size >= h.data_offset + h.count * h.bytes_per_frame;
+    if (valid) {
+        std::string key(h.key_bytes, '\0');
+        valid = ::read(fd, &key[0], key.size()) == (ssize_t)key.size() && key == cache_key;
     }
+    void* map = valid ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (map == MAP_FAILED) return false;
+
+    mapped = static_cast<const uint8_t*>(map);
+    mapped_bytes = st.st_size;
+    header = h;
+    width = h.width;
+    height = h.height;
+    origin_width = h.origin_width;
+    origin_height = h.origin_height;
+    size_wh = Size_wh(width, height);
+    outnumpyshape.assign(h.shape, h.shape + h.ndim);
+    outdtype = get_outdtype(pix_fmt);
+    bytes_per_frame = (int)h.bytes_per_frame;
+    count = (int)h.count;
+    fps = (float)h.fps;
+    duration = (float)h.duration;
+    iframe = -1;
+    default_buffer = NULL;
+    waitInit = false;
+    cached = true;
+    cache.touch(cache_path);
+    io_stats.probe_seconds = seconds_since(io_stats.open_time);
+    return true;
+#else
+    return false;
+#endif
+}
 
-    if (process) {
-        int bytesRead = fread(frame, sizeof(char), bytes_per_frame, process);
-        if (bytesRead == bytes_per_frame) {
-            iframe += 1;
-            return true;
-        } else {
-            release();
-            return false;
-        }
+void VideoCaptureCached::start_writing() {
+    // leave room for the whole video, or do not cache it at all
+    const long long data_offset = ((long long)(sizeof(FrameCacheHeader) + cache_key.size()) + 4095) / 4096 * 4096;
+    if (!cache.make_room(data_offset + (long long)count * bytes_per_frame)) return;
+    if (!cache.directory.empty()) mkdir(cache.directory.c_str(), 0755);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "FFCVRAW", 8);
+    header.version = FRAME_CACHE_VERSION;
+    header.key_bytes = (uint32_t)cache_key.size();
+    header.width = width;
+    header.height = height;
+    header.origin_width = origin_width;
+    header.origin_height = origin_height;
+    header.ndim = (int32_t)std::min(outnumpyshape.size(), (size_t)4);
+    for (int i = 0; i < header.ndim; i++) header.shape[i] = outnumpyshape[i];
+    header.count = 0;
+    header.bytes_per_frame = bytes_per_frame;
+    header.data_offset = data_offset;
+    header.fps = fps;
+    header.duration = duration;
+
+#ifdef __linux__
+    writer_path = cache_path + "." + std::to_string(getpid()) + ".tmp";
+#else
+    writer_path = cache_path + ".tmp";
+#endif
+    writer = fopen(writer_path.c_str(), "wb");
+    if (!writer) return;
+    std::vector<char> padding(data_offset - sizeof(header) - cache_key.size(), 0);
+    bool success = fwrite(&header, sizeof(header), 1, writer) == 1 &&
+        fwrite(cache_key.data(), 1, cache_key.size(), writer) == cache_key.size() &&
+        fwrite(padding.data(), 1, padding.size(), writer) == padding.size();
+    frames_written = 0;
+    if (!success) finish_writing(false);
+}
+
+void VideoCaptureCached::append_frame(const void* frame) {
+    if (!writer) return;
+    if (fwrite(frame, 1, bytes_per_frame, writer) == (size_t)bytes_per_frame) {
+        frames_written++;
     } else {
-        return false;
+        finish_writing(false);  // e.g. the disk is full, keep decoding
+    }
+}
+
+void VideoCaptureCached::finish_writing(bool complete) {
+    if (!writer) return;
+    // every frame the probe counted, or the file would pass for complete with some missing
+    bool success = complete && frames_written > 0 && (count <= 0 || frames_written == count);
+    if (success) {  // the count marks the file complete
+        header.count = frames_written;
+        header.duration = fps > 0 ? frames_written / fps : duration;
+        success = fseek(writer, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, writer) == 1;
+    }
+    success = fclose(writer) == 0 && success;
+    writer = NULL;
+    if (success) success = rename(writer_path.c_str(), cache_path.c_str()) == 0;
+    if (!success) {
+        remove(writer_path.c_str());
+        return;
+    }
+    cache.make_room(0, cache_path);  // the real size may differ from the estimate
+}
+
+const uint8_t* VideoCaptureCached::frame_data(int frame_index) const {
+    if (!mapped || frame_index < 0 || frame_index >= count) return NULL;
+    return mapped + header.data_offset + (size_t)frame_index * bytes_per_frame;
+}
+
+void VideoCaptureCached::release() {
+    if (process) dump_stats(stats_file, "capture", filename, io_stats);
+    const int status = stop_process();
+    finish_writing(reading && status == 0);  // keep the file only after a clean decode to the end
+#ifdef __linux__
+    if (mapped) {
+        dump_stats(stats_file, "capture", filename, io_stats);
+        munmap(const_cast<uint8_t*>(mapped), mapped_bytes);
+        mapped = NULL;
+    }
+#endif
+    VideoCapture::release();
+}
+
+bool VideoCaptureCached::read(void * frame) {
+    if (cached) {
+        const uint8_t* data = frame_data(iframe + 1);
+        if (!data) return false;
+        IOStats::Clock::time_point start = IOStats::Clock::now();
+        memcpy(frame, data, bytes_per_frame);
+        io_stats.add_frames(1, bytes_per_frame, start, IOStats::Clock::now());
+        iframe += 1;
+        source_iframe = iframe;
+        return true;
+    }
+    reading = true;
+    const bool success = VideoCapture::read(frame);
+    if (!success && writer) release();
+    reading = false;
+    if (success && !prefetcher) append_frame(frame);  // with prefetch, next_prefetched() wrote it
+    return success;
+}
+
+bool VideoCaptureCached::next_prefetched(Frame& frame) {
+    // read(Frame&), read() and read_batch() take prefetched frames without read(void*)
+    reading = true;
+    const bool success = VideoCapture::next_prefetched(frame);
+    if (!success && writer) release();
+    reading = false;
+    if (success) append_frame(frame.data());
+    return success;
+}
+
+std::tuple<bool, void *> VideoCaptureCached::read() {
+    if (cached) {
+        const uint8_t* data = frame_data(iframe + 1);
+        if (!data) return std::make_tuple(false, static_cast<void *>(NULL));
+        IOStats::Clock::time_point now = IOStats::Clock::now();
+        io_stats.add_frames(1, bytes_per_frame, now, now);
+        iframe += 1;
+        source_iframe = iframe;
+        return std::make_tuple(true, static_cast<void *>(const_cast<uint8_t*>(data)));
+    }
+    return VideoCapture::read();  // read(void*) above, into the default buffer
+}
+
+bool VideoCaptureCached::read(Frame& frame) {
+    return VideoCapture::read(frame);  // a pooled frame and read(void*)
+}
+
+int VideoCaptureCached::read_batch(void* dst, int n) {
+    if (!cached) {  // frame by frame, so that every frame reaches the cache file
+        int nread = 0;
+        uint8_t* out = static_cast<uint8_t*>(dst);
+        while (nread < n && read(static_cast<void *>(out + (size_t)nread * bytes_per_frame))) nread++;
+        return nread;
+    }
+    const int nread = std::max(0, std::min(n, count - iframe - 1));
+    if (nread == 0 || !mapped) return 0;
+    IOStats::Clock::time_point start = IOStats::Clock::now();
+    memcpy(dst, frame_data(iframe + 1), (size_t)nread * bytes_per_frame);  // contiguous in the file
+    io_stats.add_frames(nread, bytes_per_frame, start, IOStats::Clock::now());
+    iframe += nread;
+    source_iframe = iframe;
+    return nread;
+}
+
+int VideoCaptureCached::read_batch(Frame& batch, int n) {
+    return VideoCapture::read_batch(batch, n);  // a pooled batch and read_batch(void*)
+}
+
+bool VideoCaptureCached::isOpened() {
+    if (cached) return mapped != NULL && iframe + 1 < count;
+    return VideoCapture::isOpened();
+}
+
+bool VideoCaptureCached::seek(int frame_index) {
+    if (cached) {
+        if (frame_index < 0 || frame_index >= count) return false;
+        iframe = frame_index - 1;
+        source_iframe = iframe;
+        return true;
+    }
+    if (writer) {
+        if (frame_index == iframe + 1 && (count == 0 || frame_index < count)) return true;  // already there
+        finish_writing(false);  // the first pass must see every frame in order
     }
+    return VideoCapture::seek(frame_index);
+}
+
+bool VideoCaptureCached::set_subsample(int, float, bool) {
+    return false;  // the cache holds every frame, use seek() or a plain VideoCapture
 }
 
-std::tuple<bool, void *> VideoCapture::read() {
-    uint8_t* buffer = getBuffer();
-    bool success = read(buffer);
-    if (!success) {buffer = NULL;}
-    return std::make_tuple(success, buffer);
+bool VideoCaptureCached::set_range(int, int) {
+    return false;  // the cache holds every frame, use seek()
 }
 
-bool VideoCapture::isOpened() {
-    return process != NULL || waitInit;
+bool VideoCaptureCached::set_normalization(const std::vector<float>&, const std::vector<float>&, float) {
+    return false;  // not part of the cache key, normalize the cached [0, 1] tensors instead
 }
 
-const int VideoCapture::size() {
-    return count;
+//================ End Frame cache ==================
+
+//================ Begin LibAV backend ==================
+#ifdef FFMPEGCV_USE_LIBAV
+
+// The stream's parameters as get_info() reads them from ffprobe.
+VideoInfo video_info_libav(AVFormatContext* format_context, int stream_index) {
+    AVStream* stream = format_context->streams[stream_index];
+    VideoInfo info;
+    const AVCodecDescriptor* descriptor = avcodec_descriptor_get(stream->codecpar->codec_id);
+    info.codec = descriptor ? descriptor->name : "";
+    info.width = stream->codecpar->width;
+    info.height = stream->codecpar->height;
+    info.fps = stream->r_frame_rate.den > 0 ? (float)av_q2d(stream->r_frame_rate) : 0.0f;
+    if (stream->duration != AV_NOPTS_VALUE) {
+        info.duration = (float)(stream->duration * av_q2d(stream->time_base));
+    } else if (format_context->duration != AV_NOPTS_VALUE) {
+        info.duration = (float)(format_context->duration / (double)AV_TIME_BASE);
+    }
+    // containers without a frame count (mkv, flv, ts): estimated from the duration
+    info.is_complex = stream->nb_frames <= 0;
+    info.count = stream->nb_frames > 0 ? (int)stream->nb_frames : (int)std::lround(info.duration * info.fps);
+    return info;
 }
 
-const int VideoCapture::len() {
-    return count;
+VideoInfo get_info_libav(const std::string& filename) {
+    VideoInfo info;
+    AVFormatContext* format_context = NULL;
+    if (avformat_open_input(&format_context, filename.c_str(), NULL, NULL) < 0) return info;
+    if (avformat_find_stream_info(format_context, NULL) >= 0) {
+        const int stream_index = av_find_best_stream(format_context, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        if (stream_index >= 0) info = video_info_libav(format_context, stream_index);
+    }
+    avformat_close_input(&format_context);
+    return info;
 }
 
-VideoCaptureStreamRT::VideoCaptureStreamRT():VideoCapture(){;}
+// "-preset fast -crf 23 -b:v 2M" as options for avcodec_open2() and avformat_write_header();
+// stream specifiers (":v") are dropped.
+AVDictionary* parse_av_options(const std::string& opt) {
+    AVDictionary* options = NULL;
+    std::istringstream tokens(opt);
+    std::string key, value;
+    while (tokens >> key) {
+        if (key.size() < 2 || key[0] != '-' || !(tokens >> value)) break;
+        const size_t colon = key.find(':');
+        key = key.substr(1, colon == std::string::npos ? std::string::npos : colon - 1);
+        av_dict_set(&options, key.c_str(), value.c_str(), 0);
+    }
+    return options;
+}
 
-VideoCaptureStreamRT::VideoCaptureStreamRT(const std::string& filename, int isColor,
-    std::tuple<int, int, int, int> crop_xywh, Size_wh resize):
-    VideoCapture(){
+VideoCaptureLibav::VideoCaptureLibav(): VideoCapture(){;}
+
+VideoCaptureLibav::VideoCaptureLibav(const std::string& filename, int isColor,
+    std::tuple<int, int, int, int> crop_xywh, Size_wh resize): VideoCapture(){
     this->filename = filename;
     this->crop_xywh = crop_xywh;
     this->resize = resize;
@@ -696,9 +5939,8 @@ VideoCaptureStreamRT::VideoCaptureStreamRT(const std::string& filename, int isCo
     initializer();
 }
 
-VideoCaptureStreamRT::VideoCaptureStreamRT(const std::string& filename, std::string pix_fmt,
-    std::tuple<int, int, int, int> crop_xywh, Size_wh resize):
-    VideoCapture(){
+VideoCaptureLibav::VideoCaptureLibav(const std::string& filename, std::string pix_fmt,
+    std::tuple<int, int, int, int> crop_xywh, Size_wh resize): VideoCapture(){
     this->filename = filename;
     this->crop_xywh = crop_xywh;
     this->resize = resize;
@@ -706,40 +5948,41 @@ VideoCaptureStreamRT::VideoCaptureStreamRT(const std::string& filename, std::str
     initializer();
 }
 
-void VideoCaptureStreamRT::initializer() {
-    VideoInfo videoinfo = get_info_stream(filename);
+VideoCaptureLibav::~VideoCaptureLibav() {
+    release();
+}
+
+void VideoCaptureLibav::initializer() {
+    io_stats = IOStats();
+    iframe = -1;
+    default_buffer = NULL;
+    waitInit = true;
+    draining = finished = pending = false;
+    if (avformat_open_input(&format_context, filename.c_str(), NULL, NULL) < 0 ||
+        avformat_find_stream_info(format_context, NULL) < 0 ||
+        (stream_index = av_find_best_stream(format_context, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)) < 0) {
+        std::cerr << "VideoCaptureLibav: cannot open " << filename << std::endl;
+        if (format_context) avformat_close_input(&format_context);
+        waitInit = false;
+        return;
+    }
+    VideoInfo videoinfo = video_info_libav(format_context, stream_index);
+    io_stats.probe_seconds = seconds_since(io_stats.open_time);
     origin_width = width = videoinfo.width;
     origin_height = height = videoinfo.height;
     codec = videoinfo.codec;
     fps = videoinfo.fps;
-    duration = 0;
-    count = 0;
-    iframe = -1;
-    default_buffer = NULL;
-    waitInit = true;
-
-    assert(width % 2 == 0 && "Height must be even");
-    assert(height % 2 == 0 && "Width must be even");
+    duration = videoinfo.duration;
+    count = videoinfo.count;
 
+    // same output geometry as the ffmpeg filter chain: crop first, then scale
     std::tuple<Size_wh, Size_wh, std::string> filter_options = get_videofilter_cpu(
         {width, height}, pix_fmt, crop_xywh, resize);
     size_wh = std::get<1>(filter_options);
-    std::string filterstr = std::get<2>(filter_options);
     width = size_wh.width;
     height = size_wh.height;
+    out_format = av_get_pix_fmt(pix_fmt == "yuvj420p" ? "yuv420p" : pix_fmt.c_str());
 
-    std::string rtsp_opt = startsWith(filename, "rtsp://") ? "-rtsp_flags prefer_tcp -pkt_size 736 " : "";
-
-    // 初始化 ffmpeg 的 VideoCapture
-    std::ostringstream oss;
-    oss << "ffmpeg -y -loglevel warning " << rtsp_opt
-        << "-i \"" << filename << "\" -an -map 0:v -f rawvideo "
-        << filterstr << " -pix_fmt " << pix_fmt << " pipe:";
-
-    ffmpeg_cmd = oss.str();
-    std::cout << "ffmpeg_cmd: " << ffmpeg_cmd << std::endl;
-
-    // 计算每帧的位数
     outnumpyshape = get_outnumpyshape(size_wh, pix_fmt);
     bytes_per_frame = 1;
     for (int num : outnumpyshape) {
@@ -747,171 +5990,321 @@ void VideoCaptureStreamRT::initializer() {
     }
 }
 
-std::string decoder_to_nvidia(const std::string& codec) {
-    if (codec == "av1")  return "av1_cuvid";
-    if (codec == "h264") return "h264_cuvid";
-    if (codec == "x264") return "h264_cuvid";
-    if (codec == "hevc") return "hevc_cuvid";
-    if (codec == "x265") return "hevc_cuvid";
-    if (codec == "h265") return "hevc_cuvid";
-    if (codec == "mjpeg") return "mjpeg_cuvid";
-    if (codec == "mpeg1video") return "mpeg1_cuvid";
-    if (codec == "mpeg2video") return "mpeg2_cuvid";
-    if (codec == "mpeg4") return "mpeg4_cuvid";
-    if (codec == "vp1") return "vp1_cuvid";
-    if (codec == "vp8") return "vp8_cuvid";
-    if (codec == "vp9") return "vp9_cuvid";
-    throw std::runtime_error("No NV codec found for " + codec);
+void VideoCaptureLibav::open_process() {
+    waitInit = false;
+    if (!format_context) return;
+    IOStats::Clock::time_point start = IOStats::Clock::now();
+    AVStream* stream = format_context->streams[stream_index];
+    const AVCodec* codec_impl = avcodec_find_decoder(stream->codecpar->codec_id);
+    decoder = codec_impl ? avcodec_alloc_context3(codec_impl) : NULL;
+    if (decoder && avcodec_parameters_to_context(decoder, stream->codecpar) >= 0) {
+        decoder->thread_count = decoder_threads;
+        if (avcodec_open2(decoder, codec_impl, NULL) < 0) avcodec_free_context(&decoder);
+    } else if (decoder) {
+        avcodec_free_context(&decoder);
+    }
+    if (!decoder) {
+        std::cerr << "VideoCaptureLibav: no decoder for " << codec << std::endl;
+        release();
+        return;
+    }
+    packet = av_packet_alloc();
+    decoded = av_frame_alloc();
+    io_stats.spawn_seconds += seconds_since(start);
 }
 
-std::string encoder_to_nvidia(const std::string& codec) {
-    if (codec == "")  return "hevc_nvenc";
-    if (codec == "h264") return "h264_nvenc";
-    if (codec == "x264") return "h264_nvenc";
-    if (codec == "hevc") return "hevc_nvenc";
-    if (codec == "x265") return "hevc_nvenc";
-    if (codec == "h265") return "hevc_nvenc";
-    return codec + "_nvenc";
+bool VideoCaptureLibav::decode_next() {
+    while (!finished) {
+        const int ret = avcodec_receive_frame(decoder, decoded);
+        if (ret == 0) return true;
+        if (ret != AVERROR(EAGAIN) || draining) break;  // AVERROR_EOF once drained, or an error
+        if (av_read_frame(format_context, packet) < 0) {
+            draining = true;
+            avcodec_send_packet(decoder, NULL);
+            continue;
+        }
+        if (packet->stream_index == stream_index) avcodec_send_packet(decoder, packet);  // a corrupt packet is skipped
+        av_packet_unref(packet);
+    }
+    finished = true;
+    return false;
 }
 
-int get_num_NVIDIA_GPUs() {
-    static int num_NVIDIA_GPUs = -1;
-    if (num_NVIDIA_GPUs == -1) {
-        std::cout << "Getting number of NVIDIA GPUs...\n";
-        std::string cmd = "ffmpeg -f lavfi -i nullsrc -c:v h264_nvenc -gpu list -f null - 2>&1";
-        std::string output = execute_command(cmd);
-
-        std::regex pattern(R"(GPU #\d+ - < )");
-        auto nv_info_begin = std::sregex_iterator(output.begin(), output.end(), pattern);
-        auto nv_info_end = std::sregex_iterator();
-
-        num_NVIDIA_GPUs = std::distance(nv_info_begin, nv_info_end);
+bool VideoCaptureLibav::read(void* frame) {
+    if (waitInit){
+        open_process();
     }
-    return num_NVIDIA_GPUs;
+    if (!decoder || frame == NULL) return false;
+    IOStats::Clock::time_point start = IOStats::Clock::now();
+    if (!pending && !decode_next()) {
+        release();
+        return false;
+    }
+    pending = false;
+
+    // crop by moving the plane pointers, then scale and convert into the caller's buffer
+    const int crop_w = std::get<2>(crop_xywh), crop_h = std::get<3>(crop_xywh);
+    if (crop_w > 0 && crop_h > 0) {
+        decoded->crop_left = std::get<0>(crop_xywh);
+        decoded->crop_top = std::get<1>(crop_xywh);
+        decoded->crop_right = std::max(0, decoded->width - std::get<0>(crop_xywh) - crop_w);
+        decoded->crop_bottom = std::max(0, decoded->height - std::get<1>(crop_xywh) - crop_h);
+        av_frame_apply_cropping(decoded, AV_FRAME_CROP_UNALIGNED);
+    }
+    // gray is the luma plane as is (extractplanes=y in the pipe backend), not a
+    // range-expanded conversion, so 8-bit yuv sources are scaled as gray8
+    AVPixelFormat in_format = (AVPixelFormat)decoded->format;
+    if (out_format == AV_PIX_FMT_GRAY8) {
+        switch (in_format) {
+        case AV_PIX_FMT_YUV420P: case AV_PIX_FMT_YUV422P: case AV_PIX_FMT_YUV444P:
+        case AV_PIX_FMT_YUV410P: case AV_PIX_FMT_YUV411P: case AV_PIX_FMT_YUVJ420P:
+        case AV_PIX_FMT_YUVJ422P: case AV_PIX_FMT_YUVJ444P: case AV_PIX_FMT_NV12: case AV_PIX_FMT_NV21:
+            in_format = AV_PIX_FMT_GRAY8;
+            break;
+        default:
+            break;
+        }
+    }
+    sws = sws_getCachedContext(sws, decoded->width, decoded->height, in_format,
+        width, height, out_format, SWS_BICUBIC, NULL, NULL, NULL);
+    if (!sws) {
+        release();
+        return false;
+    }
+    uint8_t* dst_data[4];
+    int dst_linesize[4];
+    av_image_fill_arrays(dst_data, dst_linesize, static_cast<uint8_t*>(frame), out_format, width, height, 1);
+    sws_scale(sws, decoded->data, decoded->linesize, 0, decoded->height, dst_data, dst_linesize);
+    io_stats.add_frames(1, bytes_per_frame, start, IOStats::Clock::now());
+    iframe += 1;
+    source_iframe = source_frame(iframe);
+    return true;
 }
 
+std::tuple<bool, void *> VideoCaptureLibav::read() {
+    return VideoCapture::read();  // getBuffer() and read(void*)
+}
 
-std::tuple<Size_wh, Size_wh, std::string, std::string> get_videofilter_gpu(
-    Size_wh originsize, std::string pix_fmt, std::tuple<int, int, int, int> crop_xywh, Size_wh resize
-){
-    static const std::vector<std::string> allowed_pix_fmts = {"rgb24", "bgr24", "yuv420p", "yuvj420p", "nv12", "gray"};
-    assert(std::find(allowed_pix_fmts.begin(), allowed_pix_fmts.end(), pix_fmt) != allowed_pix_fmts.end());
-    int origin_width = originsize.width;
-    int origin_height = originsize.height;
-    int crop_x = std::get<0>(crop_xywh);
-    int crop_y = std::get<1>(crop_xywh);
-    int crop_w = std::get<2>(crop_xywh);
-    int crop_h = std::get<3>(crop_xywh);
-    int resize_width = resize.width;
-    int resize_height = resize.height;
+bool VideoCaptureLibav::read(Frame& frame) {
+    return VideoCapture::read(frame);  // a pooled frame and read(void*)
+}
 
-    std::string cropopt;
-    if (crop_w != 0 && crop_h != 0) {
-        assert(crop_x % 2 == 0 && crop_y % 2 == 0 && crop_w % 2 == 0 && crop_h % 2 == 0);
-        assert(crop_w <= origin_width && crop_h <= origin_height);
-        int top(crop_y);
-        int left(crop_x);
-        int bottom(origin_height - (crop_h + crop_y));
-        int right(origin_width - (crop_x + crop_w));
-        cropopt = "-crop" + std::to_string(top) + "x" + std::to_string(bottom) +
-                    "x" + std::to_string(left) + "x" + std::to_string(right);
-    } else {
-        crop_w = origin_width;
-        crop_h = origin_height;
-        cropopt = "";
-    }
-    Size_wh cropsize = {crop_w, crop_h};
-    Size_wh final_size_wh = cropsize;
+bool VideoCaptureLibav::isOpened() {
+    return format_context != NULL && (waitInit || decoder != NULL);
+}
 
-    std::string scaleopt="";
-    std::string padopt="";
-    if (!resize.empty() && (resize_width != 0 || resize_height != 0)) {
-        assert (resize_width % 2 == 0 && resize_height % 2 == 0);
-        final_size_wh = resize;
-        scaleopt = "-resize " + std::to_string(resize_width) + "x" + std::to_string(resize_height);
+bool VideoCaptureLibav::seek(int frame_index) {
+    if (waitInit){
+        open_process();
     }
-
-    std::string inputstr = cropopt + " " + scaleopt;
-    std::string filterstr = "";
-    std::string pix_fmt_opt = (pix_fmt == "gray") ? "extractplanes=y" : "";
-    if (!pix_fmt_opt.empty()) {
-        filterstr = "-vf " + pix_fmt_opt;
+    if (!decoder || fps <= 0 || frame_index < 0 || (count > 0 && frame_index >= count)) return false;
+
+    // back to the keyframe at or before the target, then decode up to the target
+    AVStream* stream = format_context->streams[stream_index];
+    const double time_base = av_q2d(stream->time_base);
+    const int64_t origin = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+    const int64_t target = origin + std::llround(frame_index / fps / time_base);
+    const int64_t half_frame = std::llround(0.5 / fps / time_base);
+    if (av_seek_frame(format_context, stream_index, target, AVSEEK_FLAG_BACKWARD) < 0) return false;
+    avcodec_flush_buffers(decoder);
+    draining = finished = pending = false;
+    while (decode_next()) {
+        if (decoded->best_effort_timestamp == AV_NOPTS_VALUE || decoded->best_effort_timestamp >= target - half_frame) {
+            pending = true;
+            iframe = frame_index - 1;
+            return true;
+        }
     }
-    return std::make_tuple(cropsize, final_size_wh, inputstr, filterstr);
+    return false;
 }
 
+bool VideoCaptureLibav::set_subsample(int, float, bool) {
+    return false;  // not supported without the ffmpeg filter chain
+}
 
-VideoCaptureNV::VideoCaptureNV():VideoCapture(){;}
+bool VideoCaptureLibav::set_range(int, int) {
+    return false;  // not supported without the ffmpeg command line, use seek()
+}
 
-VideoCaptureNV::VideoCaptureNV(const std::string& filename, int isColor,
-    std::tuple<int, int, int, int> crop_xywh, Size_wh resize, int gpu):
-    VideoCapture(){
+bool VideoCaptureLibav::set_yuv_conversion(int, int, int) {
+    return false;  // sws_scale converts in this process already
+}
+
+void VideoCaptureLibav::release() {
+    if (default_buffer) {
+        free(default_buffer);
+        default_buffer = NULL;
+    }
+    if (decoder) dump_stats(stats_file, "capture", filename, io_stats);
+    sws_freeContext(sws);
+    sws = NULL;
+    av_frame_free(&decoded);
+    av_packet_free(&packet);
+    avcodec_free_context(&decoder);
+    if (format_context) avformat_close_input(&format_context);
+    finished = true;
+}
+
+VideoWriterLibav::VideoWriterLibav(): VideoWriter(){;}
+
+VideoWriterLibav::VideoWriterLibav(const std::string& filename, const std::string& codec, double fps,
+    Size_wh size_wh, int isColor, std::string ffmpeg_output_opt){
     this->filename = filename;
-    this->crop_xywh = crop_xywh;
-    this->resize = resize;
+    this->codec = codec;
+    this->fps = fps;
+    this->size_wh = size_wh;
     this->pix_fmt = isColor ? "bgr24" : "gray";
-    this->gpu = gpu;
+    this->ffmpeg_output_opt = ffmpeg_output_opt;
     initializer();
 }
 
-VideoCaptureNV::VideoCaptureNV(const std::string& filename, std::string pix_fmt,
-    std::tuple<int, int, int, int> crop_xywh, Size_wh resize, int gpu):
-    VideoCapture(){
+VideoWriterLibav::VideoWriterLibav(const std::string& filename, const std::string& codec, double fps,
+    Size_wh size_wh, std::string pix_fmt, std::string ffmpeg_output_opt){
     this->filename = filename;
-    this->crop_xywh = crop_xywh;
-    this->resize = resize;
+    this->codec = codec;
+    this->fps = fps;
+    this->size_wh = size_wh;
     this->pix_fmt = pix_fmt;
-    this->gpu = gpu;
+    this->ffmpeg_output_opt = ffmpeg_output_opt;
     initializer();
 }
 
+VideoWriterLibav::~VideoWriterLibav() {
+    release();
+}
 
-void VideoCaptureNV::initializer() {
-    int numGPU = get_num_NVIDIA_GPUs();
-    assert (numGPU > 0 && "No NVIDIA GPU found");
-    gpu = gpu % numGPU;
-
-    VideoInfo videoinfo = get_info(filename);
-    origin_width = width = videoinfo.width;
-    origin_height = height = videoinfo.height;
-    codec = videoinfo.codec;
-    codec = decoder_to_nvidia(codec);
-    fps = videoinfo.fps;
-    duration = 0;
-    count = 0;
-    iframe = -1;
-    default_buffer = NULL;
+void VideoWriterLibav::initializer() {
+    io_stats = IOStats();
+    codec = codec.empty() ? "h264" : codec;
+    width = size_wh.width;
+    height = size_wh.height;
+    in_format = av_get_pix_fmt(pix_fmt.c_str());
     waitInit = true;
+    failed = false;
+    next_pts = 0;
 
-    assert(width % 2 == 0 && "Height must be even");
-    assert(height % 2 == 0 && "Width must be even");
+    innumpyshape = get_outnumpyshape(size_wh, pix_fmt);
+    bytes_per_frame = 1;
+    for (int num : innumpyshape) {
+        bytes_per_frame *= num;
+    }
+}
 
-    std::tuple<Size_wh, Size_wh, std::string, std::string> filter_options = get_videofilter_gpu(
-        {width, height}, pix_fmt, crop_xywh, resize);
-    size_wh = std::get<1>(filter_options);
-    std::string inputstr = std::get<2>(filter_options);
-    std::string filterstr = std::get<3>(filter_options);
-    width = size_wh.width;
-    height = size_wh.height;
+bool VideoWriterLibav::open_encoder() {
+    waitInit = false;
+    IOStats::Clock::time_point start = IOStats::Clock::now();
+    // an encoder name (libx264) or a codec name (h264, its default encoder)
+    const AVCodec* codec_impl = avcodec_find_encoder_by_name(codec.c_str());
+    if (!codec_impl) {
+        const AVCodecDescriptor* descriptor = avcodec_descriptor_get_by_name(codec.c_str());
+        codec_impl = descriptor ? avcodec_find_encoder(descriptor->id) : NULL;
+    }
+    if (!codec_impl || avformat_alloc_output_context2(&format_context, NULL, NULL, filename.c_str()) < 0) {
+        std::cerr << "VideoWriterLibav: cannot write " << codec << " to " << filename << std::endl;
+        return false;
+    }
+    stream = avformat_new_stream(format_context, NULL);
+    encoder = avcodec_alloc_context3(codec_impl);
+    if (!stream || !encoder) return false;
+    const AVRational frame_rate = av_d2q(fps, 1000000);
+    encoder->width = width;
+    encoder->height = height;
+    encoder->pix_fmt = av_get_pix_fmt(output_pix_fmt.c_str());
+    encoder->time_base = av_inv_q(frame_rate);
+    encoder->framerate = frame_rate;
+    encoder->thread_count = encoder_threads;
+    if (format_context->oformat->flags & AVFMT_GLOBALHEADER) encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    // each of the encoder and the muxer takes the options it knows
+    AVDictionary* options = parse_av_options(ffmpeg_output_opt);
+    AVDictionary* encoder_options = NULL;
+    av_dict_copy(&encoder_options, options, 0);
+    int ret = avcodec_open2(encoder, codec_impl, &encoder_options);
+    av_dict_free(&encoder_options);
+    if (ret >= 0) ret = avcodec_parameters_from_context(stream->codecpar, encoder);
+    stream->time_base = encoder->time_base;
+    if (ret >= 0 && !(format_context->oformat->flags & AVFMT_NOFILE)) {
+        ret = avio_open(&format_context->pb, filename.c_str(), AVIO_FLAG_WRITE);
+    }
+    if (ret >= 0) ret = avformat_write_header(format_context, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        std::cerr << "VideoWriterLibav: cannot open the " << codec << " encoder for " << filename << std::endl;
+        return false;
+    }
+    header_written = true;
+
+    picture = av_frame_alloc();
+    packet = av_packet_alloc();
+    if (!picture || !packet) return false;
+    picture->format = encoder->pix_fmt;
+    picture->width = width;
+    picture->height = height;
+    sws = sws_getContext(width, height, in_format, width, height, encoder->pix_fmt, SWS_BICUBIC, NULL, NULL, NULL);
+    io_stats.spawn_seconds += seconds_since(start);
+    io_stats.spawns++;
+    return sws != NULL && av_frame_get_buffer(picture, 0) >= 0;
+}
 
-    // 初始化 ffmpeg 的 VideoCapture
-    std::ostringstream oss;
-    oss << "ffmpeg -loglevel warning -hwaccel cuda -hwaccel_device "
-        << gpu << " -vcodec " << codec << " " << inputstr << " -i \""
-        << filename << "\" -f rawvideo "
-        << filterstr << " -pix_fmt " << pix_fmt << " pipe:";
+bool VideoWriterLibav::encode(AVFrame* input) {
+    int ret = avcodec_send_frame(encoder, input);
+    while (ret >= 0) {
+        ret = avcodec_receive_packet(encoder, packet);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return true;
+        if (ret < 0) break;
+        av_packet_rescale_ts(packet, encoder->time_base, stream->time_base);
+        packet->stream_index = stream->index;
+        ret = av_interleaved_write_frame(format_context, packet);  // takes the packet's data
+    }
+    return false;
+}
 
-    ffmpeg_cmd = oss.str();
-    std::cout << "ffmpeg_cmd: " << ffmpeg_cmd << std::endl;
+bool VideoWriterLibav::write(const void* frame) {
+    if (waitInit && !open_encoder()) failed = true;
+    if (frame == NULL || failed) return false;
+    IOStats::Clock::time_point start = IOStats::Clock::now();
+    if (av_frame_make_writable(picture) < 0) return false;  // the encoder may still hold the last one
+    uint8_t* src_data[4];
+    int src_linesize[4];
+    av_image_fill_arrays(src_data, src_linesize, static_cast<const uint8_t*>(frame), in_format, width, height, 1);
+    sws_scale(sws, src_data, src_linesize, 0, height, picture->data, picture->linesize);
+    picture->pts = next_pts++;
+    const bool success = encode(picture);
+    if (success) io_stats.add_frames(1, bytes_per_frame, start, IOStats::Clock::now());
+    else failed = true;
+    return success;
+}
 
-    // 计算每帧的位数
-    outnumpyshape = get_outnumpyshape(size_wh, pix_fmt);
-    bytes_per_frame = 1;
-    for (int num : outnumpyshape) {
-        bytes_per_frame *= num;
+bool VideoWriterLibav::write(const Frame& frame) {
+    assert(frame.empty() || frame.size() == (size_t)bytes_per_frame);
+    return !frame.empty() && write(static_cast<const void*>(frame.data()));
+}
+
+bool VideoWriterLibav::isOpened() const {
+    return waitInit || (encoder != NULL && !failed);
+}
+
+void VideoWriterLibav::release() {
+    if (header_written) {
+        if (!failed) encode(NULL);
+        av_write_trailer(format_context);
+        header_written = false;
+        dump_stats(stats_file, "writer", filename, io_stats);
     }
+    if (format_context && !(format_context->oformat->flags & AVFMT_NOFILE)) avio_closep(&format_context->pb);
+    avformat_free_context(format_context);
+    format_context = NULL;
+    stream = NULL;
+    avcodec_free_context(&encoder);
+    av_frame_free(&picture);
+    av_packet_free(&packet);
+    sws_freeContext(sws);
+    sws = NULL;
 }
 
+#endif
+//================ End LibAV backend ==================
+
 } // END NAMESPACE ffmpegcv
 
 
@@ -928,9 +6321,18 @@ void operator<<(ffmpegcv::VideoWriter& writer, void* frame) {
     writer.write(frame);
 }
 
+ffmpegcv::Frame& operator>>(ffmpegcv::VideoCapture& cap, ffmpegcv::Frame& frame) {
+    cap.read(frame);
+    return frame;
+}
+
+void operator<<(ffmpegcv::VideoWriter& writer, const ffmpegcv::Frame& frame) {
+    writer.write(frame);
+}
+
 void operator>>(ffmpegcv::VideoCapture& cap, ffmpegcv::VideoWriter& writer) {
-    void* frame = static_cast<void*>(cap.getBuffer());
-    if (cap.read(frame)) {
-        writer.write(frame);
+    std::tuple<bool, void*> ret = cap.read();
+    if (std::get<0>(ret)) {
+        writer.write(std::get<1>(ret));
     }
 }